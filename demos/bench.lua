@@ -0,0 +1,174 @@
+-- Render throughput benchmark. Runs headless, so no terminal is needed:
+--
+--   luajit demos/bench.lua [frames] [width] [height]
+--
+-- Every workload goes through the real tb_render path. For each one we
+-- report frames per second, bytes sent to the terminal, cells changed and
+-- bytes allocated by Lua, all per frame.
+
+local ui   = require('demos.lib.ui')
+local tb   = require('luabox')
+local time = require('demos.lib.time')
+
+local frames = tonumber(arg[1]) or 500
+local width  = tonumber(arg[2]) or 120
+local height = tonumber(arg[3]) or 40
+
+local results = {}
+
+local function load()
+  -- no frame pacing, so every step that changed something draws it
+  local window = ui.load({ headless = true, width = width, height = height, stats = true, frame_ms = 0 })
+  if not window then
+    io.stderr:write("Unable to start headless UI.\n")
+    os.exit(1)
+  end
+  return window
+end
+
+local function measure(name, frame)
+  collectgarbage('collect')
+  collectgarbage('stop')
+  ui.reset_stats()
+
+  local heap, bytes, start = collectgarbage('count'), tb.headless_bytes(), time.clock()
+  for i = 1, frames do
+    frame(i)
+  end
+  local elapsed = time.clock() - start
+
+  local alloc = (collectgarbage('count') - heap) * 1024
+  collectgarbage('restart')
+
+  local stats = ui.stats()
+  -- /proc/thread-self/io is Linux only, otherwise count what came out of the pty
+  local written = stats.bytes_written > 0 and stats.bytes_written or (tb.headless_bytes() - bytes)
+
+  table.insert(results, {
+    name    = name,
+    fps     = frames / elapsed,
+    bytes   = written / frames,
+    changed = stats.cells_changed / frames,
+    alloc   = alloc / frames,
+    render  = stats.render_us / frames,
+  })
+end
+
+-----------------------------------------
+-- workloads
+
+-- redraws every cell, switching colors each frame so they all change
+local function fill()
+  load() -- only to bring termbox up, the window is never drawn
+  local rows = { string.rep('#', width), string.rep('.', width) }
+
+  measure('fill', function(i)
+    local row, fg = rows[i % 2 + 1], i % 2 == 0 and tb.RED or tb.BLUE
+    for y = 0, height - 1 do
+      tb.string(0, y, fg, tb.DEFAULT, row)
+    end
+    tb.render()
+  end)
+
+  ui.unload(true)
+end
+
+local function list_items(count)
+  local items = {}
+  for i = 1, count do
+    items[i] = string.format('%05d  item number %d in a long list', i, i)
+  end
+  return items
+end
+
+-- same as above, but with items kept in a native list store
+local function store_items(count)
+  return tb.list_store(table.concat(list_items(count), '\n'))
+end
+
+local function list_scroll(name, items)
+  local window = load()
+  local list = ui.List(items, {})
+  window:add(list)
+  list:focus()
+  ui.step(0)
+
+  measure(name, function(i)
+    list:move(i % 1000 == 0 and -999 or 1)
+    ui.step(0)
+  end)
+
+  ui.unload(true)
+end
+
+local function typing()
+  local window = load()
+  local editor = ui.EditableTextBox('', {})
+  window:add(editor)
+  editor:focus()
+  ui.step(0)
+
+  local text = 'the quick brown fox jumps over the lazy dog '
+  measure('typing', function(i)
+    local pos = (i - 1) % #text + 1
+    tb.headless_feed(text:sub(pos, pos))
+    ui.step(10) -- the key reaches us through the pty, so wait for it
+  end)
+
+  ui.unload(true)
+end
+
+local function resize_storm()
+  local window = load()
+  window:add(ui.TextBox(string.rep('lorem ipsum dolor sit amet ', 400), {}))
+  ui.step(0)
+
+  measure('resize storm', function(i)
+    local grow = i % 2 == 0 and 0 or 20
+    tb.headless_resize(width - 20 + grow, height - 10 + grow / 2)
+    ui.step(10)
+  end)
+
+  tb.headless_resize(width, height)
+  ui.step(10)
+  ui.unload(true)
+end
+
+-- a live chart over the whole window, plotting thousands of points a frame
+local function chart()
+  local window = load()
+  local canvas = ui.Canvas({ fg = tb.GREEN })
+  window:add(canvas)
+  ui.step(0)
+
+  local values = {}
+  measure('chart', function(i)
+    for n = 1, 5000 do
+      values[n] = math.sin((n + i * 10) / 200) + math.sin((n + i * 7) / 37) / 4
+    end
+    canvas:plot(values, -1.25, 1.25)
+    ui.step(0)
+  end)
+
+  ui.unload(true)
+end
+
+-----------------------------------------
+
+fill()
+list_scroll('list scroll', list_items(10000))
+list_scroll('store scroll', store_items(10000))
+typing()
+resize_storm()
+chart()
+
+ui.unload() -- shuts termbox down
+
+print(string.format('%d frames at %dx%d\n', frames, width, height))
+print(string.format('%-14s %10s %12s %12s %12s %12s',
+  'workload', 'fps', 'render us', 'bytes', 'changed', 'lua alloc'))
+
+for _, r in ipairs(results) do
+  print(string.format('%-14s %10.1f %12.1f %12.1f %12.1f %12.1f',
+    r.name, r.fps, r.render, r.bytes, r.changed, r.alloc))
+end
@@ -0,0 +1,58 @@
+-- Direct access to the termbox back buffer through LuaJIT's FFI.
+--
+-- Writes go straight into termbox's memory, so there's no Lua -> C call
+-- per cell. The view always points at the current buffer, including after
+-- termbox reallocates it on resize, but width/height/ptr must be re-read
+-- after every EVENT_RESIZE (cells.refresh() does that). Code writing to
+-- cells directly should flag each row it touches in view.dirty, or call
+-- tb.mark_dirty(), so tb.render_dirty() knows there's something to draw.
+
+local ffi = require('ffi')
+local tb  = require('luabox')
+
+-- either struct might have been declared already by someone else
+if not pcall(ffi.sizeof, 'struct tb_cell') then
+  ffi.cdef(tb.CELL_CDEF)
+end
+if not pcall(ffi.sizeof, 'struct luabox_view') then
+  ffi.cdef(tb.VIEW_CDEF)
+end
+
+local view = ffi.cast('struct luabox_view *', (tb.screen_view()))
+
+local cells = {}
+
+-- returns the current buffer pointer (as struct tb_cell *) and its size,
+-- plus the dirty row flags (unsigned char *)
+function cells.refresh()
+  return view.cells, view.width, view.height, view.dirty
+end
+
+function cells.width()
+  return view.width
+end
+
+function cells.height()
+  return view.height
+end
+
+function cells.set(x, y, ch, fg, bg)
+  local w = view.width
+  if x < 0 or y < 0 or x >= w or y >= view.height then return end
+
+  local cell = view.cells[y * w + x]
+  cell.ch = type(ch) == 'string' and tb.utf8_char_to_unicode(ch) or ch
+  cell.fg = fg
+  cell.bg = bg
+  if view.dirty ~= nil then view.dirty[y] = 1 end
+end
+
+function cells.get(x, y)
+  local w = view.width
+  if x < 0 or y < 0 or x >= w or y >= view.height then return end
+
+  local cell = view.cells[y * w + x]
+  return cell.ch, cell.fg, cell.bg
+end
+
+return cells
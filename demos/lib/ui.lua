@@ -7,7 +7,29 @@ local ustring = require('demos.lib.ustring')
 local screen, window, stopped
 local tab_width = 8
 local stopchars = {[' ']=true, ['/']=true, ['#']=true, ['.']=true, ['%']=true, ['\n']=true}
+-- the same as sets for buffer:find(): the chars that end a word, and those
+-- that end a run of stopchars (anything else, or a newline)
+local word_ends, stop_ends = '', '^'
+for ch in pairs(stopchars) do
+  word_ends = word_ends .. ch
+  if ch ~= '\n' then stop_ends = stop_ends .. ch end
+end
 local page_move_ratio = 1.3
+local max_events_per_frame = 64
+local frame_us = 0 -- total time spent rendering, see stats()
+local frame_ms = 16 -- at most one frame every frame_ms, see load()
+local render -- draws a frame, run by luabox once something changed
+
+-- screen contents under window.above_item, captured the first time it's
+-- rendered. below_renders counts boxes redrawn underneath since then.
+local below_above, below_above_surface
+local below_renders, rendering_above = 0, false
+
+-- boxes by the id they record in luabox's owner map when they're drawn, so
+-- a mouse event goes to whatever is on top with a lookup (see tb.hit)
+local owner_boxes = setmetatable({}, { __mode = 'v' })
+local last_owner_id = 0
+local hovered -- the box under the pointer, going by motion events
 local default_cursor_color = tb.RED
 
 -- Cursor blink state: true = cursor visible (filled block), false = hollow square
@@ -18,6 +40,7 @@ local cursor_blink_timer = nil
 -- Track whether termbox is initialized so load/unload transitions don't
 -- cycle init/shutdown (which can fail on some terminals).
 local tb_alive = false
+local tracing = false -- started by load(), see LUABOX_RECORD/LUABOX_REPLAY
 
 local function dump(o)
   if type(o) == 'table' then
@@ -56,11 +79,6 @@ local function debug(obj)
   errwrite(dump(obj))
 end
 
-local function round(num)
-  if num >= 0 then return math.floor(num+.5)
-  else return math.ceil(num-.5) end
-end
-
 local function merge_table(a, b)
   for key, val in pairs(b) do
     a[key] = val
@@ -110,106 +128,35 @@ local function find_stopchar(str, start_char_pos)
   return nil
 end
 
+-- the following measure text in screen columns, expanding tabs and
+-- counting wide chars as two columns. the heavy lifting is done in C.
+
 local function display_len(str)
-  local col = 0
-  local i = 1
-  local len = #str
-  while i <= len do
-    local b = string.byte(str, i)
-    if b == 9 then
-      col = col + (tab_width - (col % tab_width))
-      i = i + 1
-    else
-      col = col + 1
-      i = i + utf8_char_len(b)
-    end
-  end
-  return col
+  return (tb.text_width(str, tab_width))
 end
 
-local function chars_for_width(str, max_col)
-  if max_col <= 0 then return 0 end
-  local col = 0
-  local byte_i = 1
-  local char_i = 0
-  local len = #str
-  while byte_i <= len do
-    local b = string.byte(str, byte_i)
-    local skip = (b == 9) and 1 or utf8_char_len(b)
-    local add = (b == 9) and (tab_width - (col % tab_width)) or 1
-    if col + add > max_col then return char_i end
-    col = col + add
-    char_i = char_i + 1
-    byte_i = byte_i + skip
-  end
-  return char_i
-end
-
-local function char_at_visual(str, target_col)
-  if target_col <= 0 then return 0 end
-  local col = 0
-  local byte_i = 1
-  local char_i = 0
-  local len = #str
-  while byte_i <= len do
-    local b = string.byte(str, byte_i)
-    local skip = (b == 9) and 1 or utf8_char_len(b)
-    local add = (b == 9) and (tab_width - (col % tab_width)) or 1
-    if col + add > target_col then return char_i end
-    col = col + add
-    char_i = char_i + 1
-    byte_i = byte_i + skip
-  end
-  return char_i
+local function expand_line(str)
+  return tb.expand_tabs(str, tab_width)
 end
 
-local function expand_line(str)
-  local out = {}
-  local col = 0
-  local i = 1
-  local len = #str
-  while i <= len do
-    local b = string.byte(str, i)
-    if b == 9 then
-      local n = tab_width - (col % tab_width)
-      out[#out + 1] = string.rep(' ', n)
-      col = col + n
-      i = i + 1
-    elseif b < 128 then
-      out[#out + 1] = string.char(b)
-      col = col + 1
-      i = i + 1
-    else
-      local clen = utf8_char_len(b)
-      out[#out + 1] = string.sub(str, i, i + clen - 1)
-      col = col + 1
-      i = i + clen
-    end
-  end
-  return table.concat(out)
+-- appends a {text, fg, bg} segment to a flat span list for tb.runs()
+local function add_span(spans, text, fg, bg)
+  local n = #spans
+  spans[n + 1] = text
+  spans[n + 2] = fg
+  spans[n + 3] = bg
 end
 
 -----------------------------------------
 -- timers
 
-local timers = {}
-
--- local function find_timer_by_name(name)
---   for idx, timer in ipairs(timers) do
---     if timer.name and timer.name == name then
---       return timer
---     end
---   end
--- end
-
+-- timers are kept by luabox, ordered by deadline, and run from step()
 local function add_timer(time, fn, repeating, name)
-  -- if name and find_timer_by_name(name) then
-  --   return
-  -- end
-
-  local t = { time = time, fn = fn, name = name, repeating = repeating and time or nil }
-  table.insert(timers, t)
-  return t
+  if repeating then
+    return tb.every(time, fn)
+  else
+    return tb.after(time, fn)
+  end
 end
 
 local function add_immediate_timer(fn, name)
@@ -220,36 +167,12 @@ local function add_repeating_timer(time, fn, name)
   return add_timer(time, fn, true, name)
 end
 
-local function update_timers(last_time)
-  local now = (time.time() * 1000)
-  local delta = now - last_time
-  -- io.stderr:write("now: " .. now .. ", delta: " .. delta .. "\n")
-
-  for idx, timer in ipairs(timers) do
-    timer.time = timer.time - delta
-    if timer.time <= 0 then
-      local res = timer.fn()
-      if timer.repeating and not res then
-        timer.time = timer.repeating
-      else
-        table.remove(timers, idx)
-      end
-    end
-  end
-
-  return now
-end
-
 local function remove_timer(t)
-  for idx, timer in ipairs(timers) do
-    if timer == t then
-      table.remove(timers, idx)
-    end
-  end
+  if t then tb.cancel(t) end
 end
 
 local function clear_timers()
-  timers = {}
+  tb.clear_timers()
 end
 
 local function start_blink_timer()
@@ -287,6 +210,54 @@ local function toggle_blink_timer(is_focused)
   end
 end
 
+-------------------------------------------------------------
+-- layout cache
+
+-- a box's rect depends on its parent's, so working out offset() and size()
+-- from scratch means going up to the root (twice, as the margins need the
+-- parent's size as well) on every call. instead each box keeps the rect it
+-- resolved to until something that affects it changes: its own position or
+-- size (through the setters), being shown, hidden or moved to another
+-- parent, or the screen being resized. only that box and what's inside it
+-- are invalidated, and each is computed again once, from the parent's rect.
+
+local layout_changes -- while set, boxes whose rect changed are added to it
+
+-- adds box to layout_changes with the rect it was shown at until now, or
+-- false if it had none. boxes that work out their own size (see track_size)
+-- were shown at that size rather than at the one layout() had.
+local function note_layout_change(box)
+  if not layout_changes or layout_changes[box] ~= nil then return end
+
+  local rect = box.rect
+  if not rect then
+    layout_changes[box] = false
+  else
+    layout_changes[box] = { ox = rect.x, oy = rect.y, w = box.tracked_w or rect.w, h = box.tracked_h or rect.h }
+  end
+end
+
+local function invalidate_layout(box)
+  box.rect_valid = false
+  for _, child in ipairs(box.children) do
+    invalidate_layout(child)
+  end
+end
+
+-- boxes that work out their own size() (eg. menus, sized by their items)
+-- pass it through here, so the cached rects of what's inside them, which
+-- depend on it, are dropped whenever it changes
+local function track_size(box, w, h)
+  if box.tracked_w ~= w or box.tracked_h ~= h then
+    if box.tracked_w then note_layout_change(box) end
+    box.tracked_w, box.tracked_h = w, h
+    for _, child in ipairs(box.children) do
+      invalidate_layout(child)
+    end
+  end
+  return w, h
+end
+
 -------------------------------------------------------------
 
 local Rect = Object:extend()
@@ -329,15 +300,6 @@ function Window:new(screen, opts)
   self.bg = opts and opts.bg
   self.window_focused = true
   self.shown = true
-
-  self:on('mouse_event', function(x, y, evt, ...)
-    for _, child in ipairs(self.children) do
-      if child.shown and child:contains(x, y) then
-        child:trigger('mouse_event', x, y, evt, ...)
-        child:trigger(evt, x, y, ...)
-      end
-    end
-  end)
 end
 
 function Window:set_focused(bool)
@@ -368,6 +330,7 @@ function Window:add(child)
 
   child.parent = self
   table.insert(self.children, child)
+  invalidate_layout(child)
   self:trigger('child_added', child)
   -- self:mark_changed()
   return child
@@ -432,6 +395,9 @@ function Box:new(opts)
   Box.super.new(self, opts)
 
   self.id       = opts.id or Box.next_id()
+  last_owner_id = last_owner_id + 1
+  self.owner_id = last_owner_id
+  owner_boxes[last_owner_id] = self
   self.fg       = opts.fg
   self.bg       = opts.bg
   self.focus_fg = opts.focus_fg
@@ -459,16 +425,6 @@ function Box:new(opts)
   --   end
   -- end)
 
-  -- cascade events down
-  self:on('mouse_event', function(x, y, evt, ...)
-    for _, child in ipairs(self.children) do
-      if child.shown and child:contains(x, y) then
-        child:trigger('mouse_event', x, y, evt, ...)
-        child:trigger(evt, x, y, ...)
-      end
-    end
-  end)
-
   -- lets us tell child windows to redraw based on a x/y cell coord
   self:on('cell_changed', function(x, y)
     for _, child in ipairs(self.children) do
@@ -490,23 +446,27 @@ function Box:set_position(top, right, bottom, left)
   if bottom then self.bottom = bottom end
   if right then self.right = right end
   if left then self.left = left end
+  invalidate_layout(self)
   self:trigger('resized')
   -- return self:mark_changed()
 end
 
 function Box:set_width(val)
   self.width = val
+  invalidate_layout(self)
   self:trigger('resized')
 end
 
 function Box:set_height(val)
   self.height = val
+  invalidate_layout(self)
   self:trigger('resized')
 end
 
 function Box:set_hidden(bool)
   self.hidden = bool
   self.shown = not bool
+  invalidate_layout(self)
   self:trigger(bool and 'hidden' or 'unhidden')
   return bool
 end
@@ -514,10 +474,35 @@ end
 function Box:mark_changed()
   local was_changed = self.changed
   self.changed = true
+  tb.invalidate()
+  self.scrolled_from, self.scrolled_to = nil, nil -- redraw everything
   self:trigger('changed')
   return was_changed
 end
 
+-- shifts what the box shows on screen by dy rows, so only the rows scrolled
+-- into view have to be rendered again. this is only possible if the box was
+-- fully drawn and nothing is shown above it. returns the range of rows
+-- (0 based) that need to be rendered, or nil if the whole box does.
+function Box:scroll_contents(dy)
+  if self.changed or not self.shown or window.above_item or dy == 0 then return end
+
+  local x, y = self:offset()
+  local width, height = self:size()
+  local rows = self.height_floor and math.floor(height) or math.ceil(height)
+  local cols = self.width_floor and math.floor(width) or math.ceil(width)
+  if math.abs(dy) >= rows then return end
+
+  local fg, bg = self:colors()
+  tb.scroll(x, y, cols, rows, dy, fg, bg)
+
+  if dy > 0 then
+    return rows - dy, rows - 1
+  else
+    return 0, -dy - 1
+  end
+end
+
 function Box:toggle(bool)
   self:mark_changed()
   local hidden_val
@@ -615,9 +600,8 @@ function Box:string(x, y, str)
 end
 --]]
 
-function Box:margin()
-  local parent_w, parent_h = self.parent:size()
-
+-- margins of a box within a parent of the given size
+local function resolve_margin(self, parent_w, parent_h)
   -- raw width to calculate in case the width is %
   local w, h = self.width, self.height
   if w and w < 1 then w = w * parent_w end
@@ -648,44 +632,71 @@ function Box:margin()
   return top, right, bottom, left
 end
 
-function Box:offset()
-  local x, y = self.parent:offset()
-  local top, right, bottom, left = self:margin()
-  local x_offset = self.left_floor and math.floor(x + left) or math.ceil(x + left)
-  local y_offset = self.top_floor and math.floor(y + top) or math.ceil(y + top)
-  return x_offset, y_offset
+function Box:margin()
+  return resolve_margin(self, self.parent:size())
 end
 
-function Box:size()
-  if self.hidden then
-    return 0, 0
+-- returns the box's offset and size (x, y, w, h), computing them only if
+-- they were invalidated since the last call
+function Box:layout()
+  local rect = self.rect
+  if self.rect_valid then
+    return rect.x, rect.y, rect.w, rect.h
   end
 
-  local w, h
+  local parent_x, parent_y = self.parent:offset()
   local parent_w, parent_h = self.parent:size()
-  local top, right, bottom, left = self:margin()
+  local top, right, bottom, left = resolve_margin(self, parent_w, parent_h)
 
-  if self.width then -- width of parent
-    w = self.width > 1 and self.width or parent_w * self.width
-    if self.right and self.right > 0 then
-      w = w - (self.right >= 1 and self.right or parent_w * self.right)
+  local x = self.left_floor and math.floor(parent_x + left) or math.ceil(parent_x + left)
+  local y = self.top_floor and math.floor(parent_y + top) or math.ceil(parent_y + top)
+  local w, h
+
+  if self.hidden then
+    w, h = 0, 0
+  else
+    if self.width then -- width of parent
+      w = self.width > 1 and self.width or parent_w * self.width
+      if self.right and self.right > 0 then
+        w = w - (self.right >= 1 and self.right or parent_w * self.right)
+      end
+    else -- width not set. parent width minus left/right margins
+      w = parent_w - (left + right)
     end
-  else -- width not set. parent width minus left/right margins
-    w = parent_w - (left + right)
-  end
 
-  if self.height then -- height of parent
-    h = self.height >= 1 and self.height or parent_h * self.height
-    if self.bottom and self.bottom > 0 then
-      h = h - (self.bottom >= 1 and self.bottom or parent_h * self.bottom)
+    if self.height then -- height of parent
+      h = self.height >= 1 and self.height or parent_h * self.height
+      if self.bottom and self.bottom > 0 then
+        h = h - (self.bottom >= 1 and self.bottom or parent_h * self.bottom)
+      end
+    else -- height not set. parent height minus top/bottom margins
+      h = parent_h - (top + bottom)
     end
-  else -- height not set. parent height minus top/bottom margins
-    h = parent_h - (top + bottom)
+
+    if self.width_floor then w = math.floor(w) end
+    if self.height_floor then h = math.floor(h) end
   end
 
-  if self.width_floor then w = math.floor(w) end
-  if self.height_floor then h = math.floor(h) end
+  if not rect then
+    note_layout_change(self)
+    rect = {}
+    self.rect = rect
+  elseif rect.x ~= x or rect.y ~= y or rect.w ~= w or rect.h ~= h then
+    note_layout_change(self)
+  end
 
+  rect.x, rect.y, rect.w, rect.h = x, y, w, h
+  self.rect_valid = true
+  return x, y, w, h
+end
+
+function Box:offset()
+  local x, y = self:layout()
+  return x, y
+end
+
+function Box:size()
+  local _, _, w, h = self:layout()
   return w, h
 end
 
@@ -709,6 +720,7 @@ function Box:add(child)
 
   child.parent = self
   table.insert(self.children, child)
+  invalidate_layout(child)
   self:trigger('child_added', child)
   self:mark_changed()
   return child
@@ -727,7 +739,7 @@ function Box:contains(x, y)
 end
 
 function Box:clear_line(x, y, fg, bg, char, width)
-  tb.string(x, y, fg, bg, string.rep(char, width))
+  tb.fill(x, y, width, 1, char, fg, bg)
 end
 
 function Box:clear()
@@ -735,10 +747,9 @@ function Box:clear()
   local width, height = self:size()
   local fg, bg = self:colors()
   local rounded_width = self.width_floor and math.floor(width) or math.ceil(width)
+  local rounded_height = self.height_floor and math.floor(height) or math.ceil(height)
 
-  for y = 0, (self.height_floor and math.floor(height) or math.ceil(height)) - 1, 1 do
-    self:clear_line(offset_x, y + offset_y, fg, bg, self.bg_char, rounded_width)
-  end
+  tb.fill(offset_x, offset_y, rounded_width, rounded_height, self.bg_char, fg, bg)
 end
 
 function Box:render_self()
@@ -761,13 +772,24 @@ function Box:rendered()
   self.changed = false
 end
 
+-- records the box as the owner of the cells it covers, for mouse events
+function Box:claim_cells()
+  local x, y = self:offset()
+  local width, height = self:size()
+  local cols = self.width_floor and math.floor(width) or math.ceil(width)
+  local rows = self.height_floor and math.floor(height) or math.ceil(height)
+  tb.set_owner(x, y, cols, rows, self.owner_id)
+end
+
 function Box:render()
   -- errwrite('rendering ' .. self.id)
   if self.shown then
     if self.changed then
       -- errwrite('changed! ' .. self.id)
+      if not rendering_above then below_renders = below_renders + 1 end
       self:render_self()
       self:rendered()
+      self:claim_cells()
       -- render_self() cleared our area, so children must redraw too
       for _, child in ipairs(self.children) do
         child:mark_changed()
@@ -800,6 +822,7 @@ function Box:remove()
   self:remove_tree()
   self.emitter:removeAllListeners()
   self.hidden = true
+  self.rect_valid = false
 end
 
 local StyledBox = Box:extend()
@@ -814,15 +837,9 @@ function StyledBox:render_self()
   local parent_fg, parent_bg = self.parent:colors()
   local h = self.height_floor and math.floor(height) or math.ceil(height)
 
-  for y = 0, h - 1, 1 do
-    tb.char(offset_x, y + offset_y, tb.LIGHT_GREEN, bg, '┃')
-  end
-
+  tb.fill(offset_x, offset_y, 1, h, '┃', tb.LIGHT_GREEN, bg)
   tb.char(offset_x, h + offset_y, tb.LIGHT_GREEN, parent_bg, '╹')
-
-  for x = 1, math.ceil(width - 1), 1 do
-    tb.char(x + offset_x, h + offset_y, bg, parent_bg, '▀')
-  end
+  tb.fill(offset_x + 1, h + offset_y, math.ceil(width - 1), 1, '▀', bg, parent_bg)
 end
 
 local RoundedBox = Box:extend()
@@ -838,9 +855,7 @@ function RoundedBox:render_self()
   local h = self.height_floor and math.floor(height) or math.ceil(height)
   local w = self.width_floor and math.floor(width) or math.ceil(width)
 
-  for x = 1, w - 1, 1 do
-    tb.char(x + offset_x, offset_y - 1, bg, parent_bg, '▄')
-  end
+  tb.fill(offset_x + 1, offset_y - 1, w - 1, 1, '▄', bg, parent_bg)
 
   tb.char(offset_x, offset_y - 1, tb.bold(bg), parent_bg, '▗') -- top left
   tb.char(offset_x + w, offset_y - 1, tb.bold(bg), parent_bg, '▖') -- top right
@@ -850,9 +865,7 @@ function RoundedBox:render_self()
   tb.char(offset_x, offset_y + h, tb.bold(bg), parent_bg, '▝') -- bottom left
   tb.char(offset_x + w, offset_y + h, tb.bold(bg), parent_bg, '▘') -- bottom right
 
-  for x = 1, w - 1, 1 do
-    tb.char(x + offset_x, h + offset_y, bg, parent_bg, '▀')
-  end
+  tb.fill(offset_x + 1, h + offset_y, w - 1, 1, '▀', bg, parent_bg)
 end
 
 ----------------------------------------
@@ -885,6 +898,7 @@ function Drawing:set(str)
   end
 
   self.width = w
+  invalidate_layout(self)
   self:mark_changed()
 end
 
@@ -905,6 +919,58 @@ end
 
 ----------------------------------------
 
+-- a box to plot on, backed by a native canvas (see tb.canvas) as big as the
+-- box itself. draw on get_canvas() and call mark_changed(), or use plot().
+local Canvas = Box:extend()
+
+function Canvas:new(opts)
+  local opts = opts or {}
+  Canvas.super.new(self, opts)
+  self.mode = opts.mode -- 'braille' (the default) or 'half'
+end
+
+-- returns the canvas, cleared first if the box changed size since
+function Canvas:get_canvas()
+  local width, height = self:size()
+  local cols, rows = math.max(0, math.floor(width)), math.max(0, math.floor(height))
+
+  if not self.canvas then
+    self.canvas = tb.canvas(cols, rows, self.mode)
+  else
+    self.canvas:resize(cols, rows)
+  end
+
+  return self.canvas
+end
+
+-- replaces whatever was drawn with a line (or bars) across the box for the
+-- given values, scaled to min and max if given. returns the min and max used.
+function Canvas:plot(values, min, max, color, bars)
+  local canvas = self:get_canvas()
+  canvas:clear()
+
+  local lo, hi
+  if bars then
+    lo, hi = canvas:bars(values, min, max, color)
+  else
+    lo, hi = canvas:plot(values, min, max, color)
+  end
+
+  self:mark_changed()
+  return lo, hi
+end
+
+function Canvas:render_self()
+  Canvas.super.render_self(self)
+  if not self.canvas then return end
+
+  local x, y = self:offset()
+  local fg, bg = self:colors()
+  self.canvas:draw_to(x, y, fg, bg)
+end
+
+----------------------------------------
+
 local Label = Box:extend()
 
 function Label:new(text, opts)
@@ -976,21 +1042,57 @@ end
 function TextBox:set_text(text)
   self:mark_changed()
   self.text = text or '' -- :gsub("\n", " ")
+  self.chunks = nil
   self.chars = ustring.len(self.text)
+  self.wrap_index = nil
   self.xpos = 0
   self.ypos = 0
 end
 
+-- adds text at the end without rewrapping what's already there,
+-- so logs and other append-only views stay cheap as they grow.
+-- appended chunks are only joined once the whole text is asked for.
+function TextBox:append_text(text)
+  if not text or text == '' then return end
+
+  if self.wrap_index then
+    self.wrap_index:append(text)
+  end
+
+  self:mark_changed()
+  local chunks = self.chunks or { self.text }
+  chunks[#chunks + 1] = text
+  self.chunks = chunks
+  self.text = nil -- see get_text()
+  self.chars = self.chars + ustring.len(text)
+end
+
 function TextBox:get_text()
+  if self.chunks then
+    self.text = table.concat(self.chunks)
+    self.chunks = nil
+  end
   return self.text
 end
 
+-- returns the wrapped row index for the current text, built on first use
+function TextBox:get_wrap_index(width)
+  local index = self.wrap_index
+  if not index then
+    index = tb.wrap_index(self:get_text(), width, tab_width)
+    self.wrap_index = index
+  else
+    index:set_width(width) -- no-op unless width changed
+  end
+  return index
+end
+
 function TextBox:scroll_up()
-  -- TODO
+  self:move(-1)
 end
 
 function TextBox:scroll_down()
-  -- TODO
+  self:move(1)
 end
 
 function TextBox:move_to(ypos)
@@ -1006,13 +1108,15 @@ function TextBox:move(dir)
 
   -- ensure we stay within bounds
   if result < 0 then
-    return self:move_to(0)
+    result = 0
   -- and that the don't show an empty box
   elseif dir > 0 and (self.nlines > 0 and result > (self.nlines - height + dir)) then
     return
   end
 
+  local from, to = self:scroll_contents(result - self.ypos)
   self:move_to(result)
+  self.scrolled_from, self.scrolled_to = from, to
 end
 
 function TextBox:get_xpos()
@@ -1028,47 +1132,36 @@ function TextBox:render_line(x, y, fg, bg, line)
 end
 
 function TextBox:render_self()
-  -- TextBox.super.clear(self)
-  self:clear()
-
-  local xpos = self:get_xpos()
   local ypos = self:get_ypos()
   local x, y = self:offset()
   local fg, bg = self:colors()
   local width, height = self:size()
+  local from, to = self.scrolled_from, self.scrolled_to
   width = math.floor(width)
 
-  local nlines = 1
-  local str, line, linebreak, limit, line_num = self:get_text()
-  for line_num = 0, (height+ypos) - 1, 1 do
-    if ustring.len(str) <= 0 then break end
-
-    linebreak = ustring.find(str, '\n')
-    if linebreak and linebreak <= width then
-      line = ustring.sub(str, 0, linebreak - 1)
-      limit = linebreak + 1
-    else
-      -- check if remaining string is shorter than width
-      local diff = width - ustring.len(str)
-
-      if diff > 0 then -- yep, this is the last line
-        line = str
-      else
-        line = ustring.sub(str, 0, round(width))
-      end
-
-      limit = width + 1
+  if from then -- the rest was moved into place by scroll_contents()
+    for line = from, to do
+      self:clear_line(x, y + line, fg, bg, self.bg_char, width)
     end
+  else
+    -- TextBox.super.clear(self)
+    self:clear()
+    from, to = 0, height - 1
+  end
 
-    if line_num >= ypos then
-      self:render_line(x, y + line_num - ypos, fg, bg, line)
-    end
+  if width <= 0 then return end
+
+  -- only the visible rows are fetched, however long the text is
+  local index = self:get_wrap_index(width)
+  local rows = index:rows()
+  local last = math.min(rows, ypos + to + 1) - 1
 
-    str = ustring.sub(str, limit)
-    nlines = nlines + 1
+  for row = ypos + from, last do
+    self:render_line(x, y + row - ypos, fg, bg, expand_line(index:line(row)))
   end
 
-  self.nlines = nlines
+  self.nlines = rows
+  self.scrolled_from, self.scrolled_to = nil, nil
 end
 
 local EditableTextBox = TextBox:extend()
@@ -1113,8 +1206,26 @@ function EditableTextBox:get_text()
   if self.placeholder and self.placeholder:len() > 0 and self.chars == 0 then
     return self.placeholder
   else
-    return self.text
+    return self.buffer:text()
+  end
+end
+
+function EditableTextBox:append_text(text)
+  if not text or text == '' then return end
+
+  self:mark_changed()
+  self.chars = self.chars + self.buffer:insert(self.chars, text)
+end
+
+-- returns the text buffer, with rows wrapped at width (or the box's width)
+function EditableTextBox:wrapped(width)
+  if not width then
+    local w, h = self:size()
+    width = math.floor(w)
   end
+
+  self.buffer:set_wrap(math.max(width, 1), tab_width) -- no-op unless width changed
+  return self.buffer
 end
 
 function EditableTextBox:delete_selection()
@@ -1127,10 +1238,7 @@ function EditableTextBox:delete_selection()
     return false
   end
 
-  local before = ustring.sub(self.text, 0, s)
-  local after  = ustring.sub(self.text, e + 1)
-  self.text = before .. after
-  self.chars = ustring.len(self.text)
+  self.chars = self.chars - self.buffer:delete(s, e - s)
   self.cursor_pos = s
   self.selection_anchor = nil
   return true
@@ -1264,43 +1372,7 @@ function EditableTextBox:handle_key(key, meta)
 end
 
 function EditableTextBox:pos_from_visual(col, target_line, width)
-  if not width then
-    local w, h = self:size()
-    width = round(w)
-  end
-
-  local remaining = self.text
-  local chars_consumed = 0
-
-  for line_idx = 0, target_line do
-    if ustring.len(remaining) <= 0 then
-      return math.min(self.chars, chars_consumed + col)
-    end
-
-    local linebreak = ustring.find(remaining, '\n')
-    local linebreak_visual = linebreak and (display_len(ustring.sub(remaining, 0, linebreak - 1)) + 1)
-    local line_len, advance
-
-    if linebreak and linebreak_visual <= width then
-      line_len = linebreak - 1
-      advance  = linebreak
-    else
-      line_len = chars_for_width(remaining, width)
-      if line_len == 0 then line_len = math.min(1, ustring.len(remaining)) end
-      advance  = math.max(line_len, 1)
-    end
-
-    if line_idx == target_line then
-      local line_sub = ustring.sub(remaining, 0, line_len)
-      local char_at = char_at_visual(line_sub, col)
-      return chars_consumed + math.min(char_at, line_len)
-    end
-
-    chars_consumed = chars_consumed + advance
-    remaining = ustring.sub(remaining, advance + 1)
-  end
-
-  return chars_consumed
+  return self:wrapped(width):row_col_to_pos(target_line, col)
 end
 
 function EditableTextBox:move_cursor(dir)
@@ -1398,47 +1470,27 @@ function EditableTextBox:ensure_cursor_visible()
   end
 end
 
+-- every edit after this is undone in one step, back to the current cursor
+-- and selection. there's no limit to how far back undo can go: the buffer
+-- only keeps what each edit changed.
 function EditableTextBox:save_undo()
-  self.undo_stack = self.undo_stack or {}
-  self.redo_stack = self.redo_stack or {}
-  local last = self.undo_stack[#self.undo_stack]
-  if last and last.text == self.text then return end
-  table.insert(self.undo_stack, {
-    text = self.text,
-    chars = self.chars,
-    cursor_pos = self.cursor_pos,
-    selection_anchor = self.selection_anchor,
-  })
-  self.redo_stack = {}
-  if #self.undo_stack > 100 then
-    table.remove(self.undo_stack, 1)
-  end
+  self.buffer:checkpoint(self.cursor_pos, self.selection_anchor)
 end
 
-function EditableTextBox:_swap_state(pop_stack, push_stack)
-  table.insert(push_stack, {
-    text = self.text,
-    chars = self.chars,
-    cursor_pos = self.cursor_pos,
-    selection_anchor = self.selection_anchor,
-  })
-  local state = table.remove(pop_stack)
-  self.text = state.text
-  self.chars = state.chars
-  self.cursor_pos = state.cursor_pos
-  self.selection_anchor = state.selection_anchor
+function EditableTextBox:_restore_state(cursor_pos, selection_anchor)
+  if not cursor_pos then return end -- nothing to undo or redo
+  self.chars = self.buffer:chars()
+  self.cursor_pos = cursor_pos
+  self.selection_anchor = selection_anchor
   self:mark_changed()
 end
 
 function EditableTextBox:undo()
-  if not self.undo_stack or #self.undo_stack == 0 then return end
-  self.redo_stack = self.redo_stack or {}
-  self:_swap_state(self.undo_stack, self.redo_stack)
+  self:_restore_state(self.buffer:undo(self.cursor_pos, self.selection_anchor))
 end
 
 function EditableTextBox:redo()
-  if not self.redo_stack or #self.redo_stack == 0 then return end
-  self:_swap_state(self.redo_stack, self.undo_stack)
+  self:_restore_state(self.buffer:redo(self.cursor_pos, self.selection_anchor))
 end
 
 function EditableTextBox:move_cursor_to_beginning()
@@ -1449,42 +1501,18 @@ function EditableTextBox:move_cursor_to_end()
   self.cursor_pos = self.chars
 end
 
-function EditableTextBox:move_cursor_to_last(char)
-  local search_fn
-  if type(char) == 'function' then
-    search_fn = char
-  else
-    search_fn = function(str, from)
-      return ustring.find(str, char, from)
-    end
-  end
-  local found_at = nil
-  local search_from = 1
-  while true do
-    local pos = search_fn(self.text, search_from)
-    if not pos or pos >= self.cursor_pos + 1 then break end
-    found_at = pos
-    search_from = pos + 1
-  end
-  if found_at then
-    self.cursor_pos = found_at
-  else
-    self:move_cursor_to_beginning()
-  end
+-- moves the cursor right after the last of chars (as in buffer:find) before
+-- it, or to the beginning if there's none
+function EditableTextBox:move_cursor_to_last(chars)
+  local found = self.buffer:find(self.cursor_pos, chars, true)
+  self.cursor_pos = found and found + 1 or 0
 end
 
-function EditableTextBox:move_cursor_to_next(char, insert_after)
-  local search_fn
-  if type(char) == 'function' then
-    search_fn = char
-  else
-    search_fn = function(str, from)
-      return ustring.find(str, char, from)
-    end
-  end
-  local nextpos = search_fn(self.text, self.cursor_pos + 2)
-  local offset = insert_after and 0 or -1
-  self.cursor_pos = nextpos and (nextpos + offset) or self.chars
+-- moves the cursor right before the next of chars after the one it's on, or
+-- right after it if insert_after is set, or to the end if there's none
+function EditableTextBox:move_cursor_to_next(chars, insert_after)
+  local found = self.buffer:find(self.cursor_pos + 1, chars)
+  self.cursor_pos = found and found + (insert_after and 1 or 0) or self.chars
 end
 
 function EditableTextBox:move_cursor_word(dir)
@@ -1494,14 +1522,8 @@ function EditableTextBox:move_cursor_word(dir)
       self.cursor_pos = self.cursor_pos - 1
       return
     end
-    while self.cursor_pos > 0
-        and self:get_char_at_pos(self.cursor_pos) ~= '\n'
-        and stopchars[self:get_char_at_pos(self.cursor_pos)] do
-      self.cursor_pos = self.cursor_pos - 1
-    end
-    while self.cursor_pos > 0 and not stopchars[self:get_char_at_pos(self.cursor_pos)] do
-      self.cursor_pos = self.cursor_pos - 1
-    end
+    self:move_cursor_to_last(stop_ends)
+    self:move_cursor_to_last(word_ends)
     if self.cursor_pos > 0 and self:get_char_at_pos(self.cursor_pos) == '\n' then
       self.cursor_pos = self.cursor_pos - 1
     end
@@ -1511,14 +1533,8 @@ function EditableTextBox:move_cursor_word(dir)
       self.cursor_pos = self.cursor_pos + 1
       return
     end
-    while self.cursor_pos < self.chars
-        and self:get_char_at_pos(self.cursor_pos + 1) ~= '\n'
-        and stopchars[self:get_char_at_pos(self.cursor_pos + 1)] do
-      self.cursor_pos = self.cursor_pos + 1
-    end
-    while self.cursor_pos < self.chars and not stopchars[self:get_char_at_pos(self.cursor_pos + 1)] do
-      self.cursor_pos = self.cursor_pos + 1
-    end
+    self.cursor_pos = self.buffer:find(self.cursor_pos, stop_ends) or self.chars
+    self.cursor_pos = self.buffer:find(self.cursor_pos, word_ends) or self.chars
   end
 end
 
@@ -1529,21 +1545,17 @@ end
 
 function EditableTextBox:set_text(text)
   EditableTextBox.super.set_text(self, text)
+  -- edits go to the buffer from now on, self.text isn't kept up to date
+  self.buffer = tb.text_buffer(self.text, 0, tab_width)
+  self.text = nil
   self.cursor_pos = 0
   self.selection_anchor = nil
-  self.undo_stack = {}
-  self.redo_stack = {}
 end
 
 function EditableTextBox:append_char(char)
-  if self.cursor_pos == self.chars then
-    self.text = self.text .. char
-  else
-    self.text = ustring.sub(self.text, 0, self.cursor_pos) .. char .. ustring.sub(self.text, self.cursor_pos + 1)
-  end
-
-  self.chars = self.chars + 1
-  self:move_cursor(1)
+  local added = self.buffer:insert(self.cursor_pos, char)
+  self.chars = self.chars + added
+  self:move_cursor(added)
 end
 
 function EditableTextBox:delete_char(at)
@@ -1551,12 +1563,7 @@ function EditableTextBox:delete_char(at)
     return false
   end
 
-  if self.cursor_pos == self.chars then
-    self.text = ustring.sub(self.text, 0, self.chars + at)
-  else
-    self.text = ustring.sub(self.text, 0, self.cursor_pos + at) .. ustring.sub(self.text, self.cursor_pos + (at + 2))
-  end
-
+  self.buffer:delete(self.cursor_pos + at, 1)
   self.chars = self.chars - 1
   self:move_cursor(at)
   self:maybe_move_cursor(-1)
@@ -1565,69 +1572,30 @@ function EditableTextBox:delete_char(at)
 end
 
 function EditableTextBox:delete_last_word()
-  if self.cursor_pos > 0 and self:get_char_at_pos(self.cursor_pos) == '\n' then
+  if self.cursor_pos == 0 then return end
+  if self:get_char_at_pos(self.cursor_pos) == '\n' then
     self:delete_char(-1)
     return
   end
 
-  local deleting = true
-  while deleting do
-    if self:delete_char(-1) == false then
-      deleting = false
-    elseif self.cursor_pos > 0 then
-      local ch = self:get_char_at_pos(self.cursor_pos)
-      if ch == '\n' or stopchars[ch] then
-        deleting = false
-      end
-    end
-  end
+  -- the char before the cursor goes, and those before it up to a stopchar
+  local found = self.buffer:find(self.cursor_pos - 1, word_ends, true)
+  local from = found and found + 1 or 0
+  self.chars = self.chars - self.buffer:delete(from, self.cursor_pos - from)
+  self.cursor_pos = from
+  self:maybe_move_cursor(-1)
 end
 
 function EditableTextBox:get_cursor_offset(width)
-  if not width then
-    local w, h = self:size()
-    width = round(w)
-  end
-
-  local pos = self.cursor_pos
-  local remaining = self.text
-  local chars_consumed = 0
-
-  for line_idx = 0, math.huge do
-    if ustring.len(remaining) <= 0 then
-      local visual_x = display_len(ustring.sub(remaining, 0, pos - chars_consumed))
-      return visual_x, line_idx - self:get_ypos()
-    end
-
-    local linebreak = ustring.find(remaining, '\n')
-    local linebreak_visual = linebreak and (display_len(ustring.sub(remaining, 0, linebreak - 1)) + 1)
-    local line_len, advance
-
-    if linebreak and linebreak_visual <= width then
-      line_len = linebreak - 1
-      advance  = linebreak
-    else
-      line_len = chars_for_width(remaining, width)
-      if line_len == 0 then line_len = math.min(1, ustring.len(remaining)) end
-      advance  = math.max(line_len, 1)
-    end
-
-    local line_start = chars_consumed
-
-    if pos <= line_start + line_len then
-      local line_prefix = ustring.sub(remaining, 0, pos - line_start)
-      return display_len(line_prefix), line_idx - self:get_ypos()
-    end
-
-    chars_consumed = chars_consumed + advance
-    remaining = ustring.sub(remaining, advance + 1)
-  end
-
-  return 0, 0
+  local row, col = self:wrapped(width):pos_to_row(self.cursor_pos)
+  return col, row - self:get_ypos()
 end
 
 function EditableTextBox:get_char_at_pos(pos)
-  return ustring.sub(self:get_text(), pos, pos)
+  if self.chars == 0 then
+    return ustring.sub(self:get_text(), pos, pos)
+  end
+  return self.buffer:char_at(pos - 1)
 end
 
 function EditableTextBox:render_cursor()
@@ -1658,6 +1626,17 @@ function EditableTextBox:render_cursor()
   end
 end
 
+-- the placeholder goes through the same wrapping as the text
+function EditableTextBox:placeholder_buffer(width)
+  if self.placeholder_shown ~= self.placeholder then
+    self.placeholder_shown = self.placeholder
+    self.placeholder_text = tb.text_buffer(self.placeholder, 0, tab_width)
+  end
+
+  self.placeholder_text:set_wrap(math.max(width, 1), tab_width)
+  return self.placeholder_text
+end
+
 function EditableTextBox:render_self()
   self:clear()
 
@@ -1667,11 +1646,7 @@ function EditableTextBox:render_self()
   local width, height = self:size()
   width = math.floor(width)
 
-  local text_width = width
-
-  local nlines = 0
-  local remaining = self.chars == 0 and self.placeholder or self.text
-  local chars_before = 0
+  local source = self.chars == 0 and self.placeholder and self:placeholder_buffer(width) or self:wrapped(width)
   local sel_start, sel_end
 
   if self:has_selection() then
@@ -1679,89 +1654,38 @@ function EditableTextBox:render_self()
     sel_end   = math.max(self.selection_anchor, self.cursor_pos)
   end
 
-  for vis_line = 0, height + ypos - 1 do
-    if #remaining <= 0 then break end
-
-    local linebreak = ustring.find(remaining, '\n')
-    local linebreak_visual = linebreak and (display_len(ustring.sub(remaining, 0, linebreak - 1)) + 1)
-    local line, limit, line_len
+  -- only the visible rows are wrapped, as text, pos, chars triples
+  local rows = source:rows_at(ypos, math.floor(height))
 
-    if linebreak and linebreak_visual <= text_width then
-      line_len = linebreak - 1
-      line  = ustring.sub(remaining, 0, line_len)
-      limit = linebreak + 1
-    else
-      line_len = chars_for_width(remaining, text_width)
-      if line_len == 0 then line_len = math.min(1, ustring.len(remaining)) end
-      if line_len >= ustring.len(remaining) then
-        line = remaining
-      else
-        line = ustring.sub(remaining, 0, line_len)
-      end
-      limit = line_len + 1
-    end
+  for i = 1, #rows, 3 do
+    local line, chars_before, line_len = rows[i], rows[i + 1], rows[i + 2]
+    local screen_y = offset_y + (i - 1) / 3
 
-    if vis_line >= ypos then
-      local screen_y = offset_y + vis_line - ypos
+    if sel_start and sel_end and sel_end > chars_before and sel_start < chars_before + line_len then
+      local sel_from_chars = math.max(0, sel_start - chars_before)
+      local sel_to_chars = math.min(line_len, sel_end - chars_before)
 
-      if sel_start and sel_end and sel_end > chars_before and sel_start < chars_before + line_len then
-        local before_chars = math.max(0, sel_start - chars_before)
-        local sel_from_chars = math.max(0, sel_start - chars_before)
-        local sel_to_chars = math.min(line_len, sel_end - chars_before)
-
-        local expanded = expand_line(line)
-        local before_visual = display_len(ustring.sub(line, 0, before_chars))
-        local sel_from_visual = display_len(ustring.sub(line, 0, sel_from_chars))
-        local sel_to_visual = display_len(ustring.sub(line, 0, sel_to_chars))
-        local line_visual_len = display_len(line)
-        local off = 0
-
-        if before_visual > 0 then
-          local before_text = ustring.sub(expanded, 0, before_visual)
-          tb.string(offset_x, screen_y, fg, bg, before_text)
-          off = off + ustring.len(before_text)
-        end
+      -- find where the selection starts and ends within the expanded line
+      local expanded = expand_line(line)
+      local _, sel_from = tb.col_to_index(expanded, display_len(ustring.sub(line, 0, sel_from_chars)))
+      local _, sel_to = tb.col_to_index(expanded, display_len(ustring.sub(line, 0, sel_to_chars)))
+      local spans = {}
 
-        if sel_to_visual > sel_from_visual then
-          local sel_text = ustring.sub(expanded, sel_from_visual + 1, sel_to_visual)
-          tb.string(offset_x + off, screen_y, self.selection_fg, self.selection_bg, sel_text)
-          off = off + ustring.len(sel_text)
-        end
-
-        if off < line_visual_len then
-          local after_text = ustring.sub(expanded, off + 1)
-          tb.string(offset_x + off, screen_y, fg, bg, after_text)
-        end
-      else
-        tb.string(offset_x, screen_y, fg, bg, expand_line(line))
-      end
-    end
+      add_span(spans, expanded:sub(1, sel_from), fg, bg)
+      add_span(spans, expanded:sub(sel_from + 1, sel_to), self.selection_fg, self.selection_bg)
+      add_span(spans, expanded:sub(sel_to + 1), fg, bg)
 
-    chars_before = chars_before + line_len
-    if linebreak and linebreak_visual and linebreak_visual <= text_width then
-      chars_before = chars_before + 1
-    end
-
-    remaining = ustring.sub(remaining, limit)
-    nlines = nlines + 1
-  end
-
-  -- count remaining visual lines for accurate nlines
-  while ustring.len(remaining) > 0 do
-    local linebreak = ustring.find(remaining, '\n')
-    local linebreak_visual = linebreak and (display_len(ustring.sub(remaining, 0, linebreak - 1)) + 1)
-    local advance
-    if linebreak and linebreak_visual <= text_width then
-      advance = linebreak
+      tb.runs(offset_x, screen_y, width, spans)
     else
-      advance = chars_for_width(remaining, text_width)
-      if advance == 0 then advance = math.min(1, ustring.len(remaining)) end
+      tb.string(offset_x, screen_y, fg, bg, expand_line(line))
     end
-    remaining = ustring.sub(remaining, advance + 1)
-    nlines = nlines + 1
   end
 
-  self.nlines = nlines + 1
+  -- one row more than the text takes, unless it ends in a newline, in
+  -- which case the buffer already counts the empty row after it
+  local chars = source:chars()
+  local last = chars > 0 and source:char_at(chars - 1) ~= '\n'
+  self.nlines = source:rows() + (last and 1 or 0)
 
   if needs_scrollbar and self.nlines > height then
     local sx = offset_x + width - 1
@@ -1798,7 +1722,7 @@ function TextInput:new(opts)
 end
 
 function TextInput:handle_enter(meta)
-  self:trigger('submit', self.text)
+  self:trigger('submit', self.buffer:text())
 end
 
 function TextInput:move_cursor(dir)
@@ -1831,8 +1755,7 @@ function List:new(items, opts)
 
   self.ypos = 1
   self.selected = 0
-  self.items = items or {}
-  self.nitems = table.getn(self.items)
+  self:use_items(items or {})
 
   self.selection_fg = opts.selection_fg
   self.selection_bg = opts.selection_bg or tb.BLACK
@@ -1915,13 +1838,15 @@ function List:move(dir)
 
   -- ensure we stay within bounds
   if result < 1 then
-    return self:move_to(1)
+    result = 1
   -- and that the don't show an empty box
   elseif dir > 0 and (nitems > 0 and result > (nitems - height + dir)) then
     return
   end
 
+  local from, to = self:scroll_contents(result - self.ypos)
   self:move_to(result)
+  self.scrolled_from, self.scrolled_to = from, to
 end
 
 function List:page_up(height)
@@ -1941,8 +1866,19 @@ function List:move_page(dir, height)
   self:set_selected_item(new_sel, true)
 end
 
+-- items can be a table of strings, or a tb.list_store() for long lists:
+-- its lines are kept in a single C buffer and drawn natively
+function List:use_items(items)
+  if type(items) == 'userdata' then
+    self.store, self.items, self.nitems = items, {}, nil
+  else
+    self.store, self.items, self.nitems = nil, items, table.getn(items)
+  end
+end
+
 function List:num_items()
-  return self.nitems
+  -- a store can grow on its own (eg. from load_fd), so always ask it
+  return self.store and self.store:count() or self.nitems
 end
 
 function List:clear_items()
@@ -1950,8 +1886,7 @@ function List:clear_items()
 end
 
 function List:set_items(arr, reset_position)
-  self.items = arr
-  self.nitems = table.getn(self.items)
+  self:use_items(arr)
   self:mark_changed()
   if reset_position then
     self:set_ypos(1)
@@ -1967,16 +1902,22 @@ function List:set_items(arr, reset_position)
 end
 
 function List:set_item(number, item)
+  if self.store then
+    assert(number == self.store:count() + 1, "items can only be appended to a list store")
+    return self.store:push(item)
+  end
+
   self.items[number] = item
   -- we might be adding a new item, so recalc
   self.nitems = table.getn(self.items)
 end
 
 function List:add_item(item)
-  self:set_item(self.nitems + 1, item)
+  self:set_item(self:num_items() + 1, item)
 end
 
 function List:get_item(number)
+  if self.store then return self.store:get(number) end
   return self.items[number]
 end
 
@@ -2084,11 +2025,33 @@ function List:render_line(item, index, rounded_width, x, y, fg, bg)
   self:render_item(final, self.align_right and (x + diff) or x, y, self:item_fg_color(index, item, fg), self:item_bg_color(index, item, bg), self:is_selected(index), rounded_width-1)
 end
 
+-- whether rows can be drawn by the list store itself, which is only the
+-- case if nothing that draws a row was overridden
+function List:renders_natively()
+  return self.store and self.render_line == List.render_line and self.render_item == List.render_item
+    and self.format_item == List.format_item and self.get_item == List.get_item
+    and self.is_selected == List.is_selected and self.item_fg_color == List.item_fg_color
+    and self.item_bg_color == List.item_bg_color
+end
+
+-- draws rows from..to (0 based) of the box from the list store
+function List:render_store_rows(from, to, x, y, width, fg, bg)
+  local sel_fg = self:item_fg_color(self.selected, nil, fg)
+  local sel_bg = self:item_bg_color(self.selected, nil, bg)
+  local rounded_width = width % 1 == 0 and width or math.floor(width) + 1
+  self.store:draw(x, y + from, rounded_width, to - from + 1, self.ypos + from, fg, bg, self.selected, sel_fg, sel_bg, self.align_right)
+end
+
 function List:render_self()
-  if not self.changed_line_from then
+  local scrolled_from, scrolled_to = self.scrolled_from, self.scrolled_to
+  if not self.changed_line_from and not scrolled_from then
     self:clear()
   end
 
+  if self:renders_natively() then
+    return self:render_self_from_store()
+  end
+
   local x, y = self:offset()
   local width, height = self:size()
   local fg, bg = self:colors()
@@ -2102,7 +2065,13 @@ function List:render_self()
     index = line + self.ypos
     skip_render = false
 
-    if self.changed_line_from and self.changed_line_to then --
+    if scrolled_from then -- the rest was moved into place by scroll_contents()
+      if line >= scrolled_from and line <= scrolled_to then
+        self:clear_line(x, y + line, fg, bg, self.bg_char, width)
+      else
+        skip_render = true
+      end
+    elseif self.changed_line_from and self.changed_line_to then --
       if index == self.changed_line_from or index == self.changed_line_to then
         self:clear_line(x, y + line, fg, bg, self.bg_char, width)
       else
@@ -2120,6 +2089,36 @@ function List:render_self()
 
   self.changed_line_from = nil
   self.changed_line_to = nil
+  self.scrolled_from, self.scrolled_to = nil, nil
+end
+
+function List:render_self_from_store()
+  local x, y = self:offset()
+  local width, height = self:size()
+  local fg, bg = self:colors()
+  local h = self.height_floor and math.floor(height) or math.ceil(height)
+  local from, to = self.changed_line_from, self.changed_line_to
+
+  if self.scrolled_from then -- the rest was moved into place by scroll_contents()
+    for line = self.scrolled_from, self.scrolled_to do
+      self:clear_line(x, y + line, fg, bg, self.bg_char, width)
+    end
+    self:render_store_rows(self.scrolled_from, self.scrolled_to, x, y, width, fg, bg)
+  elseif from and to then -- just the previous and new selection
+    for _, index in ipairs({ from, to }) do
+      local line = index - self.ypos
+      if line >= 0 and line < h then
+        self:clear_line(x, y + line, fg, bg, self.bg_char, width)
+        self:render_store_rows(line, line, x, y, width, fg, bg)
+      end
+    end
+  else
+    self:render_store_rows(0, h - 1, x, y, width, fg, bg)
+  end
+
+  self.changed_line_from = nil
+  self.changed_line_to = nil
+  self.scrolled_from, self.scrolled_to = nil, nil
 end
 
 -----------------------------------------
@@ -2255,6 +2254,7 @@ function Menu:set_offset(x, y)
 
   self.offset_x = x
   self.offset_y = y
+  invalidate_layout(self)
 end
 
 function Menu:offset()
@@ -2285,7 +2285,7 @@ end
 function Menu:size()
   local num_items = self:num_items()
   if num_items == 0 then
-    return 0, 0
+    return track_size(self, 0, 0)
   end
 
   local w = self.width
@@ -2307,7 +2307,7 @@ function Menu:size()
     end
   end
 
-  return w, h
+  return track_size(self, w, h)
 end
 
 -----------------------------------------
@@ -2331,6 +2331,7 @@ function SmartMenu:new(items, opts)
   SmartMenu.super.new(self, box_opts)
 
   self.original_items = items
+  self.max_results = opts.max_results or 500
   self.selected_item = 0
   self.revealed = false
 
@@ -2410,7 +2411,7 @@ end
 function SmartMenu:size()
   local w, h = SmartMenu.super.size(self)
   local menu_w, menu_h = self.menu:size()
-  return w, h + menu_h
+  return track_size(self, w, h + menu_h)
 end
 
 function SmartMenu:set_width(val)
@@ -2425,6 +2426,7 @@ end
 
 function SmartMenu:set_items(items)
   self.original_items = items
+  self.matcher = nil
   self.menu:set_items(items)
 end
 
@@ -2511,12 +2513,19 @@ function SmartMenu:set_options(arr)
   -- end
 end
 
+-- ranks the items by how well they fuzzy match str (see tb.fuzzy_matcher),
+-- keeping the best max_results. the matcher remembers what matched the last
+-- query, so each char typed only looks at those.
 function SmartMenu:filter_options(str)
   local str = str or self.input:get_text()
+  if str == '' then return self:set_options(self.original_items) end
+
+  self.matcher = self.matcher or tb.fuzzy_matcher(self.original_items)
+  local found = self.matcher:match(str, self.max_results)
 
   local arr = {}
-  for _, item in ipairs(self.original_items) do
-    if string.find(item:lower(), str:lower()) then table.insert(arr, item) end
+  for i, index in ipairs(found) do
+    arr[i] = self.original_items[index]
   end
 
   self:set_options(arr)
@@ -2764,7 +2773,7 @@ end
 function ComboBox:size()
   local w, h = ComboBox.super.size(self)
   local menu_w, menu_h = self.menu:size()
-  return w, h + menu_h
+  return track_size(self, w, h + menu_h)
 end
 
 function ComboBox:set_width(val)
@@ -3037,12 +3046,37 @@ local function load(opts)
   assert(not window, "window already loaded")
 
   if not tb_alive then
-    if not tb.init() then return end
+    if opts.headless then
+      -- no terminal needed: termbox draws into a pty of the given size
+      if tb.init_headless(opts.width or 80, opts.height or 24) ~= 0 then return end
+    elseif not tb.init() then
+      return
+    end
     tb_alive = true
   end
   tb.clear_buffer()
+  tb.clear_owners()
   stopped = false
+  tb.on_frame(render, opts.frame_ms or frame_ms)
+  tb.invalidate()
   if opts.mouse then tb.enable_mouse() end
+  if opts.stats then tb.enable_frame_stats() end
+
+  -- record the session's input to a trace (or play one back instead of
+  -- reading the terminal), to measure input to frame latency. unload()
+  -- returns the report, and prints it to stderr once termbox is shut down.
+  local record, replay = opts.record or os.getenv('LUABOX_RECORD'), opts.replay or os.getenv('LUABOX_REPLAY')
+  if record or replay then
+    local ok, err
+    if replay then
+      ok, err = tb.replay_trace(replay, tonumber(opts.replay_speed or os.getenv('LUABOX_REPLAY_SPEED')))
+    else
+      ok, err = tb.record_trace(record)
+    end
+    if not ok then errwrite(err) end
+    tracing = ok
+  end
+
   tb.hide_cursor()
   tb.enable_focus_tracking()
   start_blink_timer()
@@ -3102,7 +3136,18 @@ local function load(opts)
 
     -- self:remove(above_item)
     self.above_item = nil
-    self:refresh() -- force redraw of child elements
+
+    -- if nothing under the popup was redrawn while it was shown, putting back
+    -- what we captured is enough. otherwise redraw everything.
+    local below = below_above
+    below_above = nil
+    if below and below_renders == 0 and below:width() == screen.width and below:height() == screen.height then
+      below:draw_to(0, 0)
+      if not tb.restore_owners() then tb.clear_owners() end
+    else
+      tb.clear_owners()
+      self:refresh() -- force redraw of child elements
+    end
   end
 
   window.toggle_above = function(self, item)
@@ -3178,7 +3223,12 @@ local function load(opts)
   return window
 end
 
+-- shuts termbox down unless keep is set. if a trace was being recorded or
+-- replayed, returns its report, and prints it too if termbox was shut down
+-- (any earlier and it'd be wiped along with the alternate screen).
 local function unload(keep)
+  local report
+
   if screen then
     stopped = true
     stop_blink_timer()
@@ -3188,7 +3238,16 @@ local function unload(keep)
       window = nil
     end
 
+    below_above = nil
+    hovered = nil
+
     screen = nil
+    tb.on_frame(nil)
+  end
+
+  if tracing then
+    report = tb.stop_trace()
+    tracing = false
   end
 
   -- tb.show_cursor()
@@ -3196,6 +3255,14 @@ local function unload(keep)
     tb.shutdown()
     tb_alive = false
   end
+
+  if report and not tb_alive then
+    errwrite(string.format("trace: %d events, %d frames, key to frame p50 %.2fms p99 %.2fms max %.2fms",
+      report.events, report.frames, (report.latency_p50 or 0) / 1e3, (report.latency_p99 or 0) / 1e3,
+      (report.latency_max or 0) / 1e3))
+  end
+
+  return report
 end
 
 -----------------------------------------
@@ -3226,56 +3293,113 @@ local mouse_events = {
   [tb.KEY_MOUSE_WHEEL_DOWN] = 'scroll_down'
 }
 
+-- the innermost shown box at x/y within root, trying the ones drawn last
+-- (so on top) first
+local function search_box_at(root, x, y)
+  local children = root.children
+  for i = #children, 1, -1 do
+    local child = children[i]
+    if child.shown and not child.hidden and child:contains(x, y) then
+      return search_box_at(child, x, y) or child
+    end
+  end
+end
+
+-- the box on top at x/y within root (the window, or the item shown above
+-- it). that's whoever drew the cell last, as long as it's still shown there
+-- and within root, otherwise (something was hidden or removed since) the
+-- tree is searched.
+local function box_at(root, x, y)
+  local box = owner_boxes[tb.hit(x, y) or 0]
+  if box and box:contains(x, y) then
+    local parent = box
+    while parent and parent ~= root do
+      parent = parent.shown and not parent.hidden and parent.parent
+    end
+    if parent then return box end
+  end
+
+  return search_box_at(root, x, y)
+end
+
+-- triggers evt on box and then on every box it's in, up to (but not
+-- including) root's parent, or the window
+local function bubble(box, root, evt, ...)
+  local stop = root == window and window or root.parent
+  while box and box ~= stop do
+    box:trigger(evt, ...)
+    box = box.parent
+  end
+end
+
+-- pointer motion: tells boxes when the pointer enters or leaves them, and
+-- the one under it that it moved (or dragged, if a button is held)
+local function on_motion(x, y, event, meta)
+  local box = box_at(window.above_item or window, x, y)
+
+  if box ~= hovered then
+    if hovered then hovered:trigger('mouse_leave', x, y) end
+    hovered = box
+    if box then box:trigger('mouse_enter', x, y) end
+  end
+
+  if box then
+    box:trigger(event and 'drag' or 'mouse_move', x, y, meta)
+  end
+end
+
 local function on_click(key, x, y, count, is_motion, meta)
   if not window then return end
 
   local event = mouse_events[key]
+  if is_motion then return on_motion(x, y, event, meta) end
   if not event then return false end
 
-  if is_motion then return end
-
   -- -- stash raw mouse meta on window so widgets (e.g. MultiOptionList) can read it
   -- if window then window.last_mouse_meta = raw_meta or 0 end
 
-  local target = window
+  local root = window
 
   if window.above_item then
-    target = window.above_item
-    if window.above_item:contains(x, y) then
-      window.above_item:trigger(event, x, y)
-    else
+    root = window.above_item
+    if not root:contains(x, y) then
       window:hide_above()
       return -- we don't want to propagate
     end
   end
 
-  target:trigger('mouse_event', x, y, event, meta)
+  -- the event goes to the box on top at x/y, then to the ones it's in
+  local target = box_at(root, x, y) or root
+  if target == window then return end
+
+  bubble(target, root, event, x, y, meta)
 
   if event:match('_click') then
     -- trigger a 'click' event for all mouse clicks, regardless of button
-    target:trigger('mouse_event', x, y, 'click', meta)
+    bubble(target, root, 'click', x, y, meta)
 
     if count > 0 and count % 2 == 0 then -- four clicks in a row should count as 2 x double-click
-      target:trigger('mouse_event', x, y, 'double_click', meta)
+      bubble(target, root, 'double_click', x, y, meta)
     elseif count > 0 and count % 3 == 0 then -- same as above, but x3
-      target:trigger('mouse_event', x, y, 'triple_click', meta)
+      bubble(target, root, 'triple_click', x, y, meta)
     end
 
   elseif event:match('scroll_') then
     -- trigger a 'scroll' event for up/down
     local dir = key == tb.KEY_MOUSE_WHEEL_UP and -5 or 5
-    target:trigger('mouse_event', x, y, 'scroll', dir, raw_meta)
+    bubble(target, root, 'scroll', x, y, dir, raw_meta)
   end
 
 end
 
--- Recursively collect {box, ox, oy, w, h} for all shown boxes in the tree
+-- Recursively collect {box, ox, oy, w, h} for all shown boxes in the tree.
+-- goes through offset() and size(), as some boxes work out their own.
 local function collect_rects(box, result)
   result = result or {}
   if box.shown then
     if box.id then -- window doesn't have and id
       local ox, oy = box:offset()
-      local w, h   = box:size()
+      local w, h = box:size()
       result[box]  = { id = box.id, ox = ox, oy = oy, w = w, h = h }
     end
     for _, child in ipairs(box.children) do
@@ -3285,25 +3409,20 @@ local function collect_rects(box, result)
   return result
 end
 
--- Mark only boxes whose position or size changed as dirty.
--- Also mark any box that now overlaps a region that a changed box previously
--- occupied (so vacated areas are repainted by their new occupant).
-local function mark_changed_rects(old_rects, new_rects)
+-- Mark only boxes whose position or size changed as dirty, given the old
+-- rects of the ones that did (or false if they had none) and the new rects
+-- of every shown box. Also mark any box that now overlaps a region that a
+-- changed box previously occupied (so vacated areas are repainted by their
+-- new occupant).
+local function mark_changed_rects(changes, new_rects)
   local dirty_regions = {}  -- list of {ox,oy,w,h} that need repainting
 
-  for box, new_r in pairs(new_rects) do
-    local old_r = old_rects[box]
-    if old_r then
-      if old_r.ox ~= new_r.ox or old_r.oy ~= new_r.oy or
-         old_r.w  ~= new_r.w  or old_r.h  ~= new_r.h  then
-        box:mark_changed()
-        -- record both old and new regions as dirty so neighbours can repaint
-        table.insert(dirty_regions, old_r)
-        table.insert(dirty_regions, new_r)
-      end
-    else
-      -- new box (wasn't visible before), always redraw
+  for box, old_r in pairs(changes) do
+    local new_r = new_rects[box]
+    if new_r then -- hidden boxes don't need repainting
       box:mark_changed()
+      -- record both old and new regions as dirty so neighbours can repaint
+      if old_r then table.insert(dirty_regions, old_r) end
       table.insert(dirty_regions, new_r)
     end
   end
@@ -3336,64 +3455,185 @@ local function on_resize(w, h)
   end
 
   add_immediate_timer(function()
-    -- snapshot every box's current rect BEFORE updating screen size
-    local old_rects = collect_rects(window)
-
-    -- apply new screen dimensions
+    -- apply new screen dimensions, and note the old rect of every box that
+    -- moves or changes size as the layout is computed again
+    layout_changes = {}
     screen.width  = w
     screen.height = h
+    invalidate_layout(window)
 
     -- trigger 'resized' so widgets can update internal state (e.g. scroll limits)
     window:trigger('resized', w, h)
 
-    -- snapshot new rects now that layout has been recalculated
+    -- resolve every shown box with the new dimensions
     local new_rects = collect_rects(window)
+    local changes = layout_changes
+    layout_changes = nil
 
     -- mark only the boxes whose geometry changed (or that overlap changed regions)
-    mark_changed_rects(old_rects, new_rects)
+    mark_changed_rects(changes, new_rects)
   end, 'resize')
 end
 
 -----------------------------------------
 -- loop start/stop/render
 
-local function render()
+function render()
   if not window then return end
+  local start = time.clock()
+
   window:render()
   if window.above_item then
+    -- keep what's under the popup, so hiding it can put that back in one go
+    if not below_above then
+      below_above = below_above_surface or tb.surface(screen.width, screen.height)
+      below_above_surface = below_above
+      below_above:resize(screen.width, screen.height)
+      below_above:capture(0, 0)
+      tb.save_owners()
+      below_renders = 0
+    end
+
+    rendering_above = true
     window.above_item:render()
+    rendering_above = false
   end
-  tb.render()
+  tb.render_dirty() -- skipped if no box drew anything
+
+  frame_us = frame_us + (time.clock() - start) * 1e6
 end
 
-local function start()
-  local res, ev, last_loop = nil, {}, (time.time() * 1000)
-  repeat
-    last_loop = update_timers(last_loop)
-    render()
-    res = tb.peek_event(ev, 100)
-
-    if res == tb.EVENT_KEY then
-      if ev.key == tb.KEY_ESC and window and window.above_item then
-        window:hide_above()
-      else
-        if ev.key == tb.KEY_CTRL_C or ev.key == tb.KEY_CTRL_Q then break end
-        on_key(ev.key, ev.ch, ev.meta)
-      end
+-- luabox's counters plus the time spent in render(). whatever part of it
+-- wasn't spent in tb.render() (render_us) went to widget code.
+local function stats()
+  local res = tb.stats()
+  res.frame_us = frame_us
+  res.widgets_us = frame_us - res.render_us
+  return res
+end
+
+local function reset_stats()
+  frame_us = 0
+  tb.reset_stats()
+end
+
+-- returns false if the event should stop the loop
+local function handle_event(ev)
+  local res = ev.type
+
+  if res == tb.EVENT_KEY then
+    if ev.key == tb.KEY_ESC and window and window.above_item then
+      window:hide_above()
+    else
+      if ev.key == tb.KEY_CTRL_C or ev.key == tb.KEY_CTRL_Q then return false end
+      on_key(ev.key, ev.ch, ev.meta)
+    end
+
+  elseif res == tb.EVENT_MOUSE then
+    on_click(ev.key, ev.x, ev.y, ev.clicks, ev.meta == 9, ev.meta)
+
+  elseif res == tb.EVENT_FOCUS then
+    local is_focused = ev.key == 1
+    -- toggle_blink_timer(is_focused)
+    window:set_focused(is_focused)
+
+  elseif res == tb.EVENT_RESIZE then
+    on_resize(ev.w, ev.h)
+  end
+
+  return true
+end
+
+-----------------------------------------
+-- watched fds
+
+local watched_fds, watchers, ready_fds = {}, {}, {}
+
+-- calls fn(fd) from the main loop whenever fd is readable. unwatch it before
+-- closing it.
+local function watch(fd, fn)
+  if not watchers[fd] then table.insert(watched_fds, fd) end
+  watchers[fd] = fn
+end
 
-    elseif res == tb.EVENT_MOUSE then
-      on_click(ev.key, ev.x, ev.y, ev.clicks, ev.meta == 9, ev.meta)
+local function unwatch(fd)
+  if not watchers[fd] then return end
+  watchers[fd] = nil
+  for idx, other in ipairs(watched_fds) do
+    if other == fd then
+      table.remove(watched_fds, idx)
+      break
+    end
+  end
+end
+
+-- runs script on a worker thread (see tb.worker), calling on_message(...)
+-- from the main loop for each message it sends and on_exit(status, err)
+-- once it's finished and every message has been handled.
+local function spawn_worker(script, on_message, on_exit, ...)
+  local w = tb.worker(script, ...)
+  local fd = w:fd()
+
+  local function deliver(ok, ...)
+    if ok and on_message then on_message(...) end
+    return ok
+  end
+
+  watch(fd, function()
+    repeat until not deliver(w:recv())
+    if w:status() == 'running' then return end
+
+    -- it may have sent more just before finishing
+    repeat until not deliver(w:recv())
+    unwatch(fd)
+    if on_exit then on_exit(w:join()) end
+  end)
+
+  return w
+end
+
+local step_events, events_pending = {}, false
 
-    elseif res == tb.EVENT_FOCUS then
-      local is_focused = ev.key == 1
-      -- toggle_blink_timer(is_focused)
-      window:set_focused(is_focused)
+-- one pass of the main loop: runs due timers, renders if anything changed
+-- and the frame interval has passed, then sleeps until there's input, a
+-- watched fd is ready or the next timer or frame is due, but no more than
+-- timeout ms (if given). returns false once the loop should end.
+local function step(timeout)
+  tb.run_timers()
+  if stopped then return false end
 
-    elseif res == tb.EVENT_RESIZE then
-      on_resize(ev.w, ev.h)
+  local wait = tb.next_timer()
+  if events_pending then
+    wait = 0 -- termbox still has some from the last pass
+  elseif timeout and (not wait or timeout < wait) then
+    wait = timeout
+  end
+
+  local tty_ready, ready, ready_count = tb.wait(watched_fds, wait, ready_fds)
+  for i = 1, ready_count do
+    local fn = watchers[ready[i]]
+    if fn then fn(ready[i]) end
+  end
+
+  if not tty_ready and not events_pending then
+    return not stopped
+  end
+
+  -- handle everything that arrived since the last frame (a paste or a burst
+  -- of mouse motion) before rendering again
+  local count = tb.drain_events(step_events, max_events_per_frame, 0)
+  events_pending = count == max_events_per_frame
+  for i = 1, count do
+    if stopped or not handle_event(step_events[i]) then
+      return false
     end
+  end
+
+  return not stopped and count ~= -1
+end
 
-  until stopped or res == -1
+local function start()
+  repeat until not step()
   clear_timers()
 end
 
@@ -3406,8 +3646,12 @@ ui.tb     = tb -- for constants (eg. tb.BLACK, tb.BOLD)
 ui.load   = load
 ui.unload = unload
 ui.start  = start
+ui.step   = step
 ui.stop   = stop
 ui.render = render
+ui.invalidate_layout = invalidate_layout -- after changing a box's top, width, etc. directly
+ui.stats  = stats
+ui.reset_stats = reset_stats
 
 -- timers
 ui.after  = add_timer -- ui.after(100, do_something())
@@ -3415,10 +3659,16 @@ ui.next_tick = add_immediate_timer
 ui.every  = add_repeating_timer
 ui.cancel = remove_timer
 
+-- fds
+ui.watch   = watch -- ui.watch(fd, function(fd) ... end)
+ui.unwatch = unwatch
+ui.worker  = spawn_worker -- ui.worker(script, on_message, on_exit, ...)
+
 ui.Box        = Box
 ui.StyledBox  = StyledBox
 ui.RoundedBox  = RoundedBox
 ui.Drawing    = Drawing
+ui.Canvas     = Canvas
 ui.Label      = Label
 ui.TextBox    = TextBox
 ui.EditableTextBox = EditableTextBox
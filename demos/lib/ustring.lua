@@ -1301,4 +1301,56 @@ function ustring.toNFKD( s )
   return internalChar( internalDecompose( cps, normal.decompK ) )
 end
 
+---- Native versions ----
+-- When running under luabox, these come from its C implementation instead,
+-- which works on grapheme clusters: a flag, a ZWJ family or a letter with
+-- its accents counts as a single emoji or character, as wide as it's shown.
+
+local hasNative, native = pcall( require, 'luabox' )
+if hasNative and type( native ) == 'table' and native.grapheme_count then
+  function ustring.emojiCount(s)
+    local _, _, emojis = native.grapheme_count(s)
+    return emojis
+  end
+
+  function ustring.replaceEmoji(s, toChar)
+    local toChar = toChar or ' '
+    local parts = {}
+    for i, j, _, emoji in native.graphemes(s) do
+      parts[#parts + 1] = emoji and toChar or S.sub(s, i, j)
+    end
+    return table.concat(parts, '')
+  end
+
+  -- columns taken on screen, counting tabs as one
+  function ustring.lenWithEmojis(s)
+    return native.text_width(s, 1)
+  end
+
+  -- the clusters shown from column i to column j, both from 1. negative
+  -- columns count from the end. clusters are never cut in half.
+  function ustring.subWithEmojis(s, i, j)
+    local width = native.text_width(s, 1)
+    i, j = i or 1, j or -1
+    if i < 0 then i = width + i + 1 end
+    if j < 0 then j = width + j + 1 end
+    if i < 1 then i = 1 end
+    if j < i then return '' end
+
+    local _, from = native.col_to_index(s, i - 1, 1)
+    local _, to = native.clip_to_width(s, j, 1)
+    return S.sub(s, from + 1, to)
+  end
+
+  function ustring.toNFC( s )
+    checkString( 'toNFC', s )
+    return native.nfc( s )
+  end
+
+  function ustring.toNFD( s )
+    checkString( 'toNFD', s )
+    return native.nfd( s )
+  end
+end
+
 return ustring
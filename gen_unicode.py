@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+#
+# generates unicode_tables.h, the character tables behind luabox's grapheme
+# clusters, display widths and normalization:
+#
+#   python3 gen_unicode.py path/to/ucd > unicode_tables.h
+#
+# the ucd directory needs GraphemeBreakProperty.txt and emoji/emoji-data.txt
+# (or emoji-data.txt) from https://www.unicode.org/Public/<version>/ucd/,
+# for the same version python's unicodedata module was built with, which
+# provides everything else.
+
+import os
+import sys
+import unicodedata
+
+MAX_CP = 0x110000
+
+# grapheme cluster break classes, in the order of the GB_ enum
+BREAK_CLASSES = [
+  'Other', 'CR', 'LF', 'Control', 'Extend', 'ZWJ', 'Regional_Indicator',
+  'Prepend', 'SpacingMark', 'L', 'V', 'T', 'LV', 'LVT'
+]
+
+HANGUL_S_BASE, HANGUL_S_COUNT = 0xAC00, 11172
+
+
+def read_property_file(path, wanted):
+  """maps each codepoint to its property, for the properties in wanted."""
+  values = {}
+  version = None
+
+  with open(path, encoding='utf-8') as f:
+    for line in f:
+      if version is None and line.startswith('#'):
+        for word in line.replace('-', ' ').replace('.txt', ' ').split():
+          if word[0].isdigit() and word.count('.') >= 1:
+            version = word
+      line = line.split('#', 1)[0].strip()
+      if not line:
+        continue
+
+      cps, prop = [part.strip() for part in line.split(';')[:2]]
+      if prop not in wanted:
+        continue
+
+      lo, _, hi = cps.partition('..')
+      for cp in range(int(lo, 16), int(hi or lo, 16) + 1):
+        values.setdefault(prop, set()).add(cp)
+
+  return values, version
+
+
+def find_file(ucd, *names):
+  for name in names:
+    path = os.path.join(ucd, name)
+    if os.path.exists(path):
+      return path
+  sys.exit('%s not found in %s' % (names[0], ucd))
+
+
+def check_version(name, version):
+  expected = unicodedata.unidata_version
+  if version and version.split('.')[:2] != expected.split('.')[:2]:
+    sys.exit('%s is for unicode %s, but unicodedata is %s' % (name, version, expected))
+
+
+def char_width(cp, emoji_presentation):
+  """columns a codepoint takes on its own: 0, 1 or 2."""
+  if cp < 0x300:
+    return 1  # latin and controls, handled by the callers
+
+  ch = chr(cp)
+  cat = unicodedata.category(ch)
+  if cat in ('Mn', 'Me', 'Cf'):
+    return 0
+  if 0x1160 <= cp <= 0x11FF or 0xD7B0 <= cp <= 0xD7FF:
+    return 0  # hangul medial vowels and final consonants
+  if 0x1F1E6 <= cp <= 0x1F1FF:
+    return 1  # regional indicators, so a pair (a flag) takes 2
+  if unicodedata.east_asian_width(ch) in ('W', 'F') or cp in emoji_presentation:
+    return 2
+  return 1
+
+
+def full_decomposition(cp):
+  """canonical decomposition of cp, applied recursively, or None."""
+  decomp = unicodedata.decomposition(chr(cp))
+  if not decomp or decomp.startswith('<'):
+    return None
+
+  result = []
+  for part in decomp.split():
+    sub = int(part, 16)
+    result.extend(full_decomposition(sub) or [sub])
+  return result
+
+
+def two_stage(values, shift):
+  """splits values into an index of blocks of 1 << shift values each, with
+  duplicate blocks stored once."""
+  size = 1 << shift
+  blocks, index, seen = [], [], {}
+
+  for start in range(0, len(values), size):
+    block = tuple(values[start:start + size])
+    if block not in seen:
+      seen[block] = len(blocks)
+      blocks.append(block)
+    index.append(seen[block])
+
+  return index, blocks
+
+
+def best_two_stage(values):
+  best = None
+  for shift in range(4, 10):
+    index, blocks = two_stage(values, shift)
+    index_bytes = len(index) * (1 if len(blocks) <= 256 else 2)
+    total = index_bytes + (len(blocks) << shift)
+    if best is None or total < best[0]:
+      best = (total, shift, index, blocks)
+  return best[1:]
+
+
+def c_array(ctype, name, values, per_line=16, fmt='%d'):
+  out = ['static const %s %s[%d] = {' % (ctype, name, len(values))]
+  for i in range(0, len(values), per_line):
+    out.append('  ' + ', '.join(fmt % v for v in values[i:i + per_line]) + ',')
+  out.append('};')
+  return '\n'.join(out)
+
+
+def emit_lookup(out, name, ctype, values, comment):
+  shift, index, blocks = best_two_stage(values)
+  index_type = 'uint8_t' if len(blocks) <= 256 else 'uint16_t'
+  flat = [v for block in blocks for v in block]
+
+  out.append('// %s, as a two stage table: %s_index[cp >> %d] picks a block of %d' % (comment, name, shift, 1 << shift))
+  out.append('// values in %s_blocks.' % name)
+  out.append('#define %s_SHIFT %d' % (name.upper(), shift))
+  out.append(c_array(index_type, name + '_index', index))
+  out.append(c_array(ctype, name + '_blocks', flat, 32))
+  out.append('')
+  out.append('static inline %s %s(uint32_t cp) {' % (ctype, name))
+  out.append('  if (cp >= 0x110000) return 0;')
+  out.append('  return %s_blocks[(%s_index[cp >> %s_SHIFT] << %s_SHIFT) | (cp & ((1 << %s_SHIFT) - 1))];'
+             % (name, name, name.upper(), name.upper(), name.upper()))
+  out.append('}')
+  out.append('')
+
+
+def main():
+  if len(sys.argv) != 2:
+    sys.exit('usage: %s path/to/ucd > unicode_tables.h' % sys.argv[0])
+
+  ucd = sys.argv[1]
+  gcb_path = find_file(ucd, 'GraphemeBreakProperty.txt', 'auxiliary/GraphemeBreakProperty.txt')
+  emoji_path = find_file(ucd, 'emoji/emoji-data.txt', 'emoji-data.txt')
+
+  breaks, version = read_property_file(gcb_path, set(BREAK_CLASSES))
+  check_version(gcb_path, version)
+  emoji, version = read_property_file(emoji_path, {'Extended_Pictographic', 'Emoji_Presentation'})
+  check_version(emoji_path, version)
+
+  pictographic = emoji.get('Extended_Pictographic', set())
+  emoji_presentation = emoji.get('Emoji_Presentation', set())
+
+  break_of = [0] * MAX_CP
+  for i, name in enumerate(BREAK_CLASSES):
+    for cp in breaks.get(name, ()):
+      break_of[cp] = i
+
+  props, ccc = [], []
+  for cp in range(MAX_CP):
+    width = char_width(cp, emoji_presentation)
+    props.append(break_of[cp] | (0x10 if cp in pictographic else 0) | (width << 5))
+    ccc.append(unicodedata.combining(chr(cp)))
+
+  decompositions, data = [], []
+  compositions = []
+  for cp in range(MAX_CP):
+    if HANGUL_S_BASE <= cp < HANGUL_S_BASE + HANGUL_S_COUNT:
+      continue  # done algorithmically
+
+    full = full_decomposition(cp)
+    if not full:
+      continue
+
+    decompositions.append((cp, len(data), len(full)))
+    data.extend(full)
+
+    # primary composites: two char decompositions NFC leaves alone
+    pair = unicodedata.decomposition(chr(cp)).split()
+    if len(pair) == 2 and unicodedata.normalize('NFC', chr(cp)) == chr(cp):
+      compositions.append((int(pair[0], 16), int(pair[1], 16), cp))
+
+  compositions.sort()
+  assert max(n for _, _, n in decompositions) < 8 and len(data) < 0x10000
+
+  out = []
+  out.append('// generated by gen_unicode.py from unicode %s data. do not edit.' % unicodedata.unidata_version)
+  out.append('')
+  out.append('#define UNICODE_VERSION "%s"' % unicodedata.unidata_version)
+  out.append('')
+  out.append('// grapheme cluster break classes (uax #29)')
+  out.append('enum {')
+  names = ['GB_OTHER', 'GB_CR', 'GB_LF', 'GB_CONTROL', 'GB_EXTEND', 'GB_ZWJ', 'GB_RI',
+           'GB_PREPEND', 'GB_SPACING_MARK', 'GB_L', 'GB_V', 'GB_T', 'GB_LV', 'GB_LVT']
+  out.append('  ' + ', '.join(names))
+  out.append('};')
+  out.append('')
+  out.append('// char_props(cp): break class in the low 4 bits, then whether it is')
+  out.append('// extended pictographic, then the columns it takes on its own (0-2)')
+  out.append('#define PROP_BREAK(p)    ((p) & 0x0F)')
+  out.append('#define PROP_PICTOGRAPH  0x10')
+  out.append('#define PROP_WIDTH(p)    (((p) >> 5) & 3)')
+  out.append('')
+  emit_lookup(out, 'char_props', 'uint8_t', props, 'props of every codepoint')
+  emit_lookup(out, 'combining_class', 'uint8_t', ccc, 'canonical combining classes')
+
+  out.append('// full canonical decompositions, except for hangul syllables. each entry has')
+  out.append('// the offset and length of its codepoints in decomposition_data, which is')
+  out.append('// never more than DECOMPOSITION_MAX.')
+  out.append('#define DECOMPOSITION_MAX %d' % max(n for _, _, n in decompositions))
+  out.append('struct decomposition { uint32_t cp; uint16_t offset; uint8_t len; };')
+  out.append('static const struct decomposition decompositions[%d] = {' % len(decompositions))
+  for i in range(0, len(decompositions), 4):
+    out.append('  ' + ' '.join('{ 0x%04X, %d, %d },' % d for d in decompositions[i:i + 4]))
+  out.append('};')
+  out.append('')
+  out.append(c_array('uint32_t', 'decomposition_data', data, 10, '0x%04X'))
+  out.append('')
+  out.append('// pairs that compose into one codepoint, sorted by first and second')
+  out.append('struct composition { uint32_t first, second, composite; };')
+  out.append('static const struct composition compositions[%d] = {' % len(compositions))
+  for i in range(0, len(compositions), 3):
+    out.append('  ' + ' '.join('{ 0x%04X, 0x%04X, 0x%04X },' % c for c in compositions[i:i + 3]))
+  out.append('};')
+
+  sys.stdout.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+  main()
@@ -1,13 +1,37 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // posix_openpt, ptsname
+#endif
+
 #include <lua.h>
 #include <lauxlib.h>
+#include <lualib.h> // luaL_openlibs, for workers
+#include <stdio.h>  // snprintf
 #include <stdlib.h> // malloc, free
 #include <string.h> // strlen, strncpy
+#include <time.h>   // clock_gettime
+#include <fcntl.h>  // open
+#include <unistd.h> // pread
+#include <errno.h>
+#include <limits.h> // INT_MAX
+#include <math.h>   // NAN, HUGE_VAL
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <termbox.h>
-#include "util.h"
+#include "unicode_tables.h" // generated by gen_unicode.py
 
 static int char_len;
 static char utf8_char[5];
 static int mouse_enabled = 0;
+static int running = 0; // between a successful init and shutdown
 static int focus_tracking_enabled = 0;
 
 #if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM == 501
@@ -26,330 +50,7665 @@ static int focus_tracking_enabled = 0;
     lua_pop(L, nup);
   }
 
-  #define luaL_newlibtable(L,l)       lua_createtable(L, 0, sizeof(l)/sizeof((l)[0]) - 1)
-  #define luaL_newlib(L,l)            (luaL_newlibtable(L,l), luaL_setfuncs(L,l,0))
-#endif
+  #define luaL_newlibtable(L,l)       lua_createtable(L, 0, sizeof(l)/sizeof((l)[0]) - 1)
+  #define luaL_newlib(L,l)            (luaL_newlibtable(L,l), luaL_setfuncs(L,l,0))
+#endif
+
+  #define luaL_checkunsigned(L, narg) (luaL_checknumber(L, narg))
+  #define luaL_len(L, idx)            (lua_objlen(L, idx))
+
+#elif defined(LUA_VERSION_NUM) && LUA_VERSION_NUM == 503
+  #define luaL_checkunsigned(L, narg) (luaL_checknumber(L, narg))
+#endif
+
+static struct tb_event event;
+
+///////////////////
+// dirty rows
+
+// one byte per screen row, set by every call that draws on it. render_dirty()
+// uses them to skip tb_render altogether when nothing was drawn.
+static unsigned char * dirty_rows;
+static int dirty_rows_cap;
+static int force_render = 1; // for changes that aren't in any row, eg. the cursor
+static int undrawn_rows;     // left dirty by the last frame, see frame_pending()
+
+static void view_dirty_moved(unsigned char *rows);
+
+// returns the dirty row flags, making sure there's one for each screen row
+static unsigned char * screen_dirty_rows(void) {
+  int height = tb_height();
+
+  if (height > dirty_rows_cap) {
+    unsigned char * rows = realloc(dirty_rows, height);
+    if (!rows) {
+      force_render = 1;
+      return NULL;
+    }
+
+    memset(rows + dirty_rows_cap, 1, height - dirty_rows_cap);
+    dirty_rows = rows;
+    dirty_rows_cap = height;
+    view_dirty_moved(rows); // before FFI code gets to write to the old ones
+  }
+
+  return dirty_rows;
+}
+
+static void mark_rows(int y, int h) {
+  unsigned char * rows = screen_dirty_rows();
+  int height = tb_height();
+
+  if (y < 0) { h += y; y = 0; }
+  if (y + h > height) h = height - y;
+  if (rows && h > 0) memset(rows + y, 1, h);
+}
+
+static void mark_all_rows(void) {
+  mark_rows(0, tb_height());
+}
+
+static int count_dirty_rows(void) {
+  int i, count = 0, height = tb_height();
+  if (!dirty_rows) return 0;
+  for (i = 0; i < height && i < dirty_rows_cap; i++) count += dirty_rows[i];
+  return count;
+}
+
+static void clear_dirty_rows(void) {
+  if (dirty_rows) memset(dirty_rows, 0, dirty_rows_cap);
+  force_render = 0;
+  undrawn_rows = 0;
+}
+
+// the back buffer as seen from LuaJIT's FFI. its address never changes, so
+// FFI code can hold on to it and read the current pointer and size from it
+// every frame, even after termbox reallocates the buffer on resize. code
+// writing to cells directly should set dirty[y] for each row it touches.
+static struct luabox_view {
+  struct tb_cell *cells;
+  int width;
+  int height;
+  unsigned char *dirty;
+} screen_view;
+
+static void view_dirty_moved(unsigned char *rows) {
+  screen_view.dirty = rows;
+}
+
+static void sync_view(void) {
+  int width = tb_width(), height = tb_height();
+
+  screen_view.cells  = tb_cell_buffer();
+  screen_view.dirty  = screen_dirty_rows();
+
+  if (width != screen_view.width || height != screen_view.height) {
+    screen_view.width  = width;
+    screen_view.height = height;
+    mark_all_rows();
+  }
+}
+
+///////////////////
+// stats
+
+// render times are bucketed by powers of two: bucket i counts frames that
+// took less than 2^i microseconds, and the last one everything slower.
+#define RENDER_BUCKETS 16
+
+static struct luabox_stats {
+  unsigned long * calls; // one per entry in l_luabox, in the same order
+  double cells_written;  // by any of the drawing functions
+  double cells_changed;  // differing from the previous frame when rendered
+  double bytes_written;  // to the terminal, by tb_render
+  double frames;
+  double render_us;
+  double render_max_us;
+  double wait_us;        // blocked waiting for events
+  double render_hist[RENDER_BUCKETS];
+} stats;
+
+static const struct luaL_Reg * stats_funcs;
+static int stats_nfuncs;
+
+// changed cells, tty bytes and the render histogram cost a bit more than
+// plain counters, so they're only tracked after enable_frame_stats()
+static int frame_stats_enabled = 0;
+static struct tb_cell * last_frame;
+static int last_frame_w, last_frame_h;
+static int proc_io_fd = -1; // the rendering thread's io counters
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// every function in the module goes through here, with its index in
+// l_luabox as upvalue. the wrapped function gets the same stack.
+static int counted_call(lua_State *L) {
+  int i = lua_tointeger(L, lua_upvalueindex(1));
+  stats.calls[i]++;
+  return stats_funcs[i].func(L);
+}
+
+// like luaL_newlib, but every function is wrapped to count its calls
+static void new_counted_lib(lua_State *L, const luaL_Reg *funcs) {
+  int i, n = 0;
+  while (funcs[n].name) n++;
+
+  if (!stats.calls) stats.calls = calloc(n, sizeof(*stats.calls));
+  stats_funcs  = funcs;
+  stats_nfuncs = n;
+
+  lua_createtable(L, 0, n);
+  for (i = 0; i < n; i++) {
+    lua_pushinteger(L, i);
+    lua_pushcclosure(L, counted_call, 1);
+    lua_setfield(L, -2, funcs[i].name);
+  }
+}
+
+// termbox keeps its front buffer to itself, so we keep our own copy of the
+// last rendered frame to see how many cells the next render will change.
+// after a resize or clear_screen everything counts as changed.
+// if only_dirty is set, rows that weren't drawn on are assumed to be the same.
+static void count_changed_cells(int only_dirty) {
+  struct tb_cell * cells = tb_cell_buffer();
+  int w = tb_width(), h = tb_height(), x, y;
+  size_t count = (size_t)w * h;
+
+  if (!cells || w <= 0 || h <= 0) return;
+
+  if (!last_frame || w != last_frame_w || h != last_frame_h) {
+    free(last_frame);
+    last_frame = malloc(count * sizeof(struct tb_cell));
+    last_frame_w = last_frame ? w : 0;
+    last_frame_h = last_frame ? h : 0;
+    stats.cells_changed += count;
+    if (last_frame) memcpy(last_frame, cells, count * sizeof(struct tb_cell));
+    return;
+  }
+
+  for (y = 0; y < h; y++) {
+    struct tb_cell * row = cells + y * w, * last = last_frame + y * w;
+    if (only_dirty && dirty_rows && y < dirty_rows_cap && !dirty_rows[y]) continue;
+
+    for (x = 0; x < w; x++) {
+      if (row[x].ch != last[x].ch || row[x].fg != last[x].fg || row[x].bg != last[x].bg)
+        stats.cells_changed++;
+    }
+
+    memcpy(last, row, w * sizeof(struct tb_cell));
+  }
+}
+
+static void forget_last_frame(void) {
+  free(last_frame);
+  last_frame = NULL;
+  last_frame_w = last_frame_h = 0;
+}
+
+// total bytes written by the calling thread so far, or -1 if we can't tell
+// (always, off linux). termbox writes the whole frame from within tb_render,
+// on the thread calling it, so the difference before and after is what went
+// to the terminal. the counter is per thread so that workers, the headless
+// pty reader and anything else writing meanwhile aren't counted.
+static double thread_bytes_written(void) {
+#ifdef __linux__
+  char buf[512], *p;
+  ssize_t n;
+
+  if (proc_io_fd < 0) proc_io_fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+  if (proc_io_fd < 0) return -1;
+
+  n = pread(proc_io_fd, buf, sizeof(buf) - 1, 0);
+  if (n <= 0) { // eg. opened by a thread that's gone since, so try again next time
+    close(proc_io_fd);
+    proc_io_fd = -1;
+    return -1;
+  }
+  buf[n] = 0;
+
+  if ((p = strstr(buf, "wchar:"))) return strtod(p + 6, NULL);
+#endif
+  return -1;
+}
+
+static void record_render(double elapsed) {
+  int bucket = 0;
+
+  stats.frames++;
+  stats.render_us += elapsed;
+  if (elapsed > stats.render_max_us) stats.render_max_us = elapsed;
+
+  if (frame_stats_enabled) {
+    while (bucket < RENDER_BUCKETS - 1 && elapsed >= (double)(1 << bucket)) bucket++;
+    stats.render_hist[bucket]++;
+  }
+}
+
+static void set_number(lua_State *L, const char *name, double val) {
+  lua_pushnumber(L, val);
+  lua_setfield(L, -2, name);
+}
+
+// stats() -> table with call counts per function, cells written and changed,
+// bytes sent to the terminal and render/event wait times in microseconds.
+// bytes are only counted on linux, and stay at 0 elsewhere.
+static int l_tb_stats(lua_State *L) {
+  int i;
+
+  lua_createtable(L, 0, 10);
+
+  lua_createtable(L, 0, stats_nfuncs);
+  for (i = 0; i < stats_nfuncs; i++) {
+    if (!stats.calls[i]) continue;
+    lua_pushnumber(L, stats.calls[i]);
+    lua_setfield(L, -2, stats_funcs[i].name);
+  }
+  lua_setfield(L, -2, "calls");
+
+  set_number(L, "cells_written", stats.cells_written);
+  set_number(L, "cells_changed", stats.cells_changed);
+  set_number(L, "bytes_written", stats.bytes_written);
+  set_number(L, "frames",        stats.frames);
+  set_number(L, "render_us",     stats.render_us);
+  set_number(L, "render_max_us", stats.render_max_us);
+  set_number(L, "wait_us",       stats.wait_us);
+
+  if (frame_stats_enabled) {
+    lua_createtable(L, RENDER_BUCKETS, 0);
+    for (i = 0; i < RENDER_BUCKETS; i++) {
+      lua_pushnumber(L, stats.render_hist[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "render_histogram");
+  }
+
+  return 1;
+}
+
+static int l_tb_reset_stats(lua_State *L) {
+  unsigned long * calls = stats.calls;
+
+  memset(calls, 0, stats_nfuncs * sizeof(*calls));
+  memset(&stats, 0, sizeof(stats));
+  stats.calls = calls;
+  return 0;
+}
+
+static int l_tb_enable_frame_stats(lua_State *L) {
+  frame_stats_enabled = 1;
+  return 0;
+}
+
+static int l_tb_disable_frame_stats(lua_State *L) {
+  frame_stats_enabled = 0;
+  forget_last_frame();
+  return 0;
+}
+
+///////////////////
+// traces
+
+// record_trace() logs every event handed out by peek_event, poll_event and
+// drain_events, plus every render with how long it took and the bytes it
+// wrote, to a binary file. replay_trace() feeds the events of one back
+// through the same functions instead of the terminal's, at the pace they
+// were recorded at or faster. either way, the time from each key event to
+// the end of the render after it is kept for trace_report().
+//
+// the file starts with TRACE_MAGIC, followed by a trace_record per event or
+// render, each with a trace_event or trace_render after it. times are in
+// microseconds since the previous record, in the host's byte order.
+#define TRACE_MAGIC "LBTRACE1"
+#define TRACE_PENDING_KEYS 256 // keys waiting for a render, more aren't timed
+
+enum { TRACE_EVENT = 'e', TRACE_RENDER = 'r' };
+
+struct trace_record {
+  uint8_t tag;
+  uint8_t type, meta; // of the event
+  uint8_t unused;
+  uint32_t delta_us;
+};
+
+struct trace_event {
+  uint32_t key, ch;
+  int32_t x, y, w, h;
+};
+
+struct trace_render {
+  uint32_t render_us;
+  uint32_t bytes;
+};
+
+static struct {
+  FILE * file;
+  int measuring;             // latencies, from record_trace() or replay_trace() to stop_trace()
+  int recording, replaying;
+  double last;               // now_us() of the last record written
+  double speed;              // of the replay, 0 being as fast as possible
+  double clock;              // when the last event read from the trace is due
+  int has_next;
+  struct tb_event next;      // event to be replayed once it's due
+
+  double events, frames;
+  double pending[TRACE_PENDING_KEYS];  // when keys waiting for a render came in
+  int npending;
+  double * latencies;        // key to end of render, in us
+  size_t nlatencies, latencies_cap;
+} trace;
+
+static void trace_write(uint8_t tag, const struct tb_event *ev, const void *body, size_t len) {
+  struct trace_record rec = { tag, 0, 0, 0, 0 };
+  double now = now_us(), delta = now - trace.last;
+
+  if (ev) { rec.type = ev->type; rec.meta = ev->meta; }
+  rec.delta_us = delta < 0 ? 0 : delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+  trace.last = now;
+
+  if (fwrite(&rec, sizeof(rec), 1, trace.file) != 1 || fwrite(body, len, 1, trace.file) != 1) {
+    fclose(trace.file); // out of space or so. the trace so far is still usable
+    trace.file = NULL;
+    trace.recording = 0;
+  }
+}
+
+static void close_trace(void) {
+  if (trace.file) fclose(trace.file);
+  trace.file = NULL;
+  trace.recording = trace.replaying = trace.has_next = 0;
+}
+
+// reads the next event to replay, skipping renders. stops at the end.
+static void trace_read_next(void) {
+  struct trace_record rec;
+  struct trace_event ev;
+  struct trace_render rendered;
+
+  trace.has_next = 0;
+  while (fread(&rec, sizeof(rec), 1, trace.file) == 1) {
+    if (trace.speed > 0) trace.clock += rec.delta_us / trace.speed;
+
+    if (rec.tag == TRACE_RENDER) {
+      if (fread(&rendered, sizeof(rendered), 1, trace.file) != 1) break;
+      continue;
+    }
+
+    if (rec.tag != TRACE_EVENT || fread(&ev, sizeof(ev), 1, trace.file) != 1) break;
+
+    memset(&trace.next, 0, sizeof(trace.next));
+    trace.next.type = rec.type;
+    trace.next.meta = rec.meta;
+    trace.next.key  = ev.key;
+    trace.next.ch   = ev.ch;
+    trace.next.x    = ev.x;
+    trace.next.y    = ev.y;
+    trace.next.w    = ev.w;
+    trace.next.h    = ev.h;
+    trace.has_next  = 1;
+    return;
+  }
+
+  close_trace(); // back to the terminal's events
+}
+
+static void sleep_us(double us) {
+  struct timespec ts;
+  if (us <= 0) return;
+  ts.tv_sec  = (time_t)(us / 1e6);
+  ts.tv_nsec = (long)((us - ts.tv_sec * 1e6) * 1e3);
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+// like tb_peek_event, but with the next event from the trace once it's due.
+// terminal input that comes in meanwhile is dropped.
+static int replay_peek_event(struct tb_event *ev, int timeout) {
+  struct tb_event live;
+  double wait;
+
+  if (running) while (tb_peek_event(&live, 0) > 0);
+
+  wait = trace.speed > 0 ? trace.clock - now_us() : 0;
+  if (wait > 0) {
+    if (timeout >= 0 && wait > timeout * 1000.0) {
+      sleep_us(timeout * 1000.0);
+      return 0;
+    }
+    sleep_us(wait);
+  }
+
+  *ev = trace.next;
+  trace_read_next();
+  return ev->type;
+}
+
+// ms until the next replayed event is due, or -1 if not replaying
+static int replay_wait_ms(void) {
+  double wait;
+
+  if (!trace.replaying) return -1;
+  wait = trace.speed > 0 ? trace.clock - now_us() : 0;
+  return wait > 0 ? (int)(wait / 1000) + 1 : 0;
+}
+
+static void trace_event(const struct tb_event *ev) {
+  struct trace_event body;
+
+  trace.events++;
+  if (ev->type == TB_EVENT_KEY && trace.npending < TRACE_PENDING_KEYS)
+    trace.pending[trace.npending++] = now_us();
+
+  if (!trace.recording) return;
+
+  body.key = ev->key;
+  body.ch  = ev->ch;
+  body.x   = ev->x;
+  body.y   = ev->y;
+  body.w   = ev->w;
+  body.h   = ev->h;
+  trace_write(TRACE_EVENT, ev, &body, sizeof(body));
+}
+
+// called once a render finished at end, having taken elapsed us
+static void trace_render(double end, double elapsed, double bytes) {
+  struct trace_render body;
+  double * grown;
+  size_t cap;
+  int i;
+
+  trace.frames++;
+
+  if (trace.nlatencies + trace.npending > trace.latencies_cap) {
+    cap = trace.latencies_cap ? trace.latencies_cap * 2 : 1024;
+    while (cap < trace.nlatencies + trace.npending) cap *= 2;
+    if ((grown = realloc(trace.latencies, cap * sizeof(double)))) {
+      trace.latencies = grown;
+      trace.latencies_cap = cap;
+    }
+  }
+
+  for (i = 0; i < trace.npending && trace.nlatencies < trace.latencies_cap; i++)
+    trace.latencies[trace.nlatencies++] = end - trace.pending[i];
+  trace.npending = 0;
+
+  if (!trace.recording) return;
+
+  body.render_us = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+  body.bytes = bytes < 0 ? 0 : bytes > UINT32_MAX ? UINT32_MAX : (uint32_t)bytes;
+  trace_write(TRACE_RENDER, NULL, &body, sizeof(body));
+}
+
+static void reset_trace_report(void) {
+  trace.events = trace.frames = 0;
+  trace.npending = 0;
+  trace.nlatencies = 0;
+}
+
+// tb_peek_event and tb_poll_event, adding the time spent to wait_us, or
+// replaying a trace
+static int timed_peek_event(struct tb_event *ev, int timeout) {
+  double start = now_us();
+  int ret = trace.replaying ? replay_peek_event(ev, timeout) : tb_peek_event(ev, timeout);
+  stats.wait_us += now_us() - start;
+  if (ret > 0 && trace.measuring) trace_event(ev);
+  return ret;
+}
+
+static int timed_poll_event(struct tb_event *ev) {
+  double start = now_us();
+  int ret = trace.replaying ? replay_peek_event(ev, -1) : tb_poll_event(ev);
+  stats.wait_us += now_us() - start;
+  if (ret > 0 && trace.measuring) trace_event(ev);
+  return ret;
+}
+
+// record_trace(path) -> true, or nil and an error message
+// starts logging events and renders to path, replacing what's there
+static int l_tb_record_trace(lua_State *L) {
+  const char * path = luaL_checkstring(L, 1);
+  FILE * file = fopen(path, "wb");
+
+  if (!file || fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1, 1, file) != 1) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    if (file) fclose(file);
+    return 2;
+  }
+
+  close_trace();
+  reset_trace_report();
+  trace.file = file;
+  trace.recording = 1;
+  trace.measuring = 1;
+  trace.last = now_us();
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// replay_trace(path [, speed]) -> true, or nil and an error message
+// from now on, events come from the trace at path instead of the terminal,
+// until it runs out or stop_trace() is called. speed is relative to how fast
+// they were recorded (1 by default), 0 meaning as fast as they're read.
+static int l_tb_replay_trace(lua_State *L) {
+  const char * path = luaL_checkstring(L, 1);
+  double speed = luaL_optnumber(L, 2, 1);
+  char magic[sizeof(TRACE_MAGIC) - 1];
+  FILE * file;
+
+  luaL_argcheck(L, speed >= 0, 2, "speed can't be negative");
+
+  if (!(file = fopen(path, "rb"))) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    return 2;
+  }
+
+  if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+    fclose(file);
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: not a luabox trace", path);
+    return 2;
+  }
+
+  close_trace();
+  reset_trace_report();
+  trace.file = file;
+  trace.replaying = 1;
+  trace.measuring = 1;
+  trace.speed = speed;
+  trace.clock = now_us();
+  trace_read_next();
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// replaying() -> whether events are still coming from a trace
+static int l_tb_replaying(lua_State *L) {
+  lua_pushboolean(L, trace.replaying);
+  return 1;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// trace_report() -> table with the events and frames seen since the last
+// record_trace() or replay_trace(), and percentiles of the time from a key
+// event to the end of the render after it, in microseconds: latency_p50,
+// latency_p99 and latency_max (missing if no key was rendered yet).
+static int l_tb_trace_report(lua_State *L) {
+  size_t n = trace.nlatencies;
+  double * sorted;
+
+  lua_createtable(L, 0, 6);
+  set_number(L, "events", trace.events);
+  set_number(L, "frames", trace.frames);
+  set_number(L, "keys",   n);
+  if (!n) return 1;
+
+  if (!(sorted = malloc(n * sizeof(double)))) return luaL_error(L, "out of memory");
+  memcpy(sorted, trace.latencies, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), compare_doubles);
+
+  set_number(L, "latency_p50", sorted[(n - 1) / 2]);
+  set_number(L, "latency_p99", sorted[(size_t)((n - 1) * 0.99)]);
+  set_number(L, "latency_max", sorted[n - 1]);
+  free(sorted);
+  return 1;
+}
+
+// stop_trace() -> same as trace_report(), after closing the trace being
+// recorded or replayed
+static int l_tb_stop_trace(lua_State *L) {
+  close_trace();
+  trace.measuring = 0;
+  return l_tb_trace_report(L);
+}
+
+///////////////////
+// headless mode
+
+// runs termbox against a pty we create ourselves instead of /dev/tty, so it
+// works without a terminal (eg. on CI). a thread keeps reading whatever
+// termbox writes to the other end, so tb_render never blocks on a full pty.
+static struct {
+  int active;
+  int master;
+  int slave;                // termbox's end, which it owns
+  pthread_t reader;
+  unsigned long long bytes; // read from the master end so far
+} headless = { 0, -1, -1 };
+
+static void * drain_pty(void *arg) {
+  char buf[16384];
+  ssize_t n;
+
+  for (;;) {
+    n = read(headless.master, buf, sizeof(buf));
+    if (n > 0) {
+      __atomic_add_fetch(&headless.bytes, n, __ATOMIC_RELAXED);
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else {
+      break; // EIO once the slave end is closed
+    }
+  }
+
+  return NULL;
+}
+
+static int set_pty_size(int fd, int width, int height) {
+  struct winsize ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_col = width;
+  ws.ws_row = height;
+  return ioctl(fd, TIOCSWINSZ, &ws);
+}
+
+static void stop_headless(void) {
+  if (!headless.active) return;
+
+  pthread_cancel(headless.reader);
+  pthread_join(headless.reader, NULL);
+  close(headless.master);
+
+  headless.active = 0;
+  headless.master = -1;
+  headless.slave  = -1;
+}
+
+// init_headless(width, height) -> same as init()
+static int l_tb_init_headless(lua_State *L) {
+  int width  = luaL_optinteger(L, 1, 80);
+  int height = luaL_optinteger(L, 2, 24);
+  int master, slave, ret;
+  sigset_t all, prev;
+  const char * term = getenv("TERM");
+
+  luaL_argcheck(L, width > 0 && height > 0, 1, "invalid size");
+  if (headless.active) return luaL_error(L, "already running headless");
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0
+    || (slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0) {
+    if (master >= 0) close(master);
+    lua_pushinteger(L, TB_EFAILED_TO_OPEN_TTY);
+    return 1;
+  }
+
+  set_pty_size(master, width, height);
+
+  // termbox picks its escape sequences by $TERM, which CI often leaves empty
+  if (!term || !*term || strcmp(term, "dumb") == 0) setenv("TERM", "xterm", 1);
+
+  // the reader shouldn't be the one getting SIGWINCH and friends
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+  headless.master = master;
+  headless.bytes  = 0;
+  ret = pthread_create(&headless.reader, NULL, drain_pty, NULL);
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+
+  if (ret != 0) {
+    close(slave);
+    close(master);
+    headless.master = -1;
+    lua_pushinteger(L, TB_EFAILED_TO_OPEN_TTY);
+    return 1;
+  }
+
+  headless.active = 1;
+  headless.slave  = slave;
+  ret = tb_init_fd(slave);
+  if (ret == 0) {
+    running = 1;
+    sync_view();
+  } else {
+    close(slave);
+    stop_headless();
+  }
+
+  lua_pushinteger(L, ret);
+  return 1;
+}
+
+// headless_resize(width, height) resizes the pty. a resize event follows,
+// just like when a real terminal window changes size.
+static int l_tb_headless_resize(lua_State *L) {
+  int width  = luaL_checkinteger(L, 1);
+  int height = luaL_checkinteger(L, 2);
+
+  luaL_argcheck(L, width > 0 && height > 0, 1, "invalid size");
+  if (!headless.active) return luaL_error(L, "not running headless");
+
+  set_pty_size(headless.master, width, height);
+  raise(SIGWINCH); // the pty isn't our controlling terminal, so no one else will
+  return 0;
+}
+
+// headless_feed(str) sends str as terminal input, eg. keystrokes or
+// mouse sequences, to be read back by peek_event/poll_event
+static int l_tb_headless_feed(lua_State *L) {
+  size_t len, off = 0;
+  const char * str = luaL_checklstring(L, 1, &len);
+  ssize_t n;
+
+  if (!headless.active) return luaL_error(L, "not running headless");
+
+  while (off < len) {
+    n = write(headless.master, str + off, len - off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return luaL_error(L, "write failed: %s", strerror(errno));
+    off += n;
+  }
+
+  return 0;
+}
+
+// headless_bytes() -> bytes termbox has written to the pty so far
+static int l_tb_headless_bytes(lua_State *L) {
+  lua_pushnumber(L, __atomic_load_n(&headless.bytes, __ATOMIC_RELAXED));
+  return 1;
+}
+
+///////////////////
+// waiting on file descriptors
+
+// termbox's own tty fd and resize pipe are private, so wait() keeps its own
+// fd for the terminal: the pty in headless mode, or /dev/tty opened again.
+// input is queued per terminal, so it's readable whenever termbox's fd is.
+// resizes come through a pipe of ours, written to by a SIGWINCH handler that
+// runs before termbox's.
+#define WAIT_MAX_FDS 64
+#define WAIT_POLL_MS 10 // when the terminal can't be watched
+
+static struct {
+  int started;
+  int tty;       // -1 if it couldn't be opened
+  int tty_owned; // opened by us, so we close it
+  int winch[2];
+  struct sigaction old_winch;
+#ifdef __linux__
+  int epfd;
+  int fds[WAIT_MAX_FDS]; // registered with epfd, besides the tty and winch
+  int nfds;
+#endif
+} waiter = {
+  .tty = -1, .winch = { -1, -1 },
+#ifdef __linux__
+  .epfd = -1,
+#endif
+};
+
+static void wait_on_winch(int sig) {
+  int saved = errno;
+  if (write(waiter.winch[1], "", 1)) {} // full means a wakeup is pending anyway
+  errno = saved;
+
+  if (waiter.old_winch.sa_handler != SIG_DFL && waiter.old_winch.sa_handler != SIG_IGN)
+    waiter.old_winch.sa_handler(sig);
+}
+
+#ifdef __linux__
+static void epoll_watch(int fd) {
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+  if (fd >= 0 && waiter.epfd >= 0) epoll_ctl(waiter.epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+#endif
+
+// opens the tty and resize pipe the first time wait() is called after init
+static void start_waiting(void) {
+  struct sigaction sa;
+  int i;
+
+  if (waiter.started || !running) return;
+  waiter.started = 1;
+
+  if (headless.active) {
+    waiter.tty = headless.slave;
+    waiter.tty_owned = 0;
+  } else {
+    waiter.tty = open("/dev/tty", O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    waiter.tty_owned = waiter.tty >= 0;
+  }
+
+  if (pipe(waiter.winch) == 0) {
+    for (i = 0; i < 2; i++) {
+      fcntl(waiter.winch[i], F_SETFL, O_NONBLOCK);
+      fcntl(waiter.winch[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wait_on_winch;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, &waiter.old_winch);
+  } else {
+    waiter.winch[0] = waiter.winch[1] = -1;
+  }
+
+#ifdef __linux__
+  epoll_watch(waiter.tty);
+  epoll_watch(waiter.winch[0]);
+#endif
+}
+
+// called on shutdown, before termbox's handler goes away
+static void stop_waiting(void) {
+  if (!waiter.started) return;
+
+#ifdef __linux__
+  // the fds it watched might be reused after init() again, so start over
+  if (waiter.epfd >= 0) close(waiter.epfd);
+  waiter.epfd = -1;
+  waiter.nfds = 0;
+#endif
+
+  if (waiter.winch[0] >= 0) {
+    sigaction(SIGWINCH, &waiter.old_winch, NULL);
+    close(waiter.winch[0]);
+    close(waiter.winch[1]);
+  }
+  if (waiter.tty_owned) close(waiter.tty);
+
+  waiter.started = 0;
+  waiter.tty = waiter.winch[0] = waiter.winch[1] = -1;
+  waiter.tty_owned = 0;
+}
+
+static void drain_winch(void) {
+  char buf[32];
+  while (read(waiter.winch[0], buf, sizeof(buf)) > 0);
+}
+
+// reads the array of fds at arg into fds, returning how many there are
+static int check_fd_list(lua_State *L, int arg, int *fds) {
+  int i, n;
+
+  if (lua_isnoneornil(L, arg)) return 0;
+  luaL_checktype(L, arg, LUA_TTABLE);
+
+  n = luaL_len(L, arg);
+  luaL_argcheck(L, n <= WAIT_MAX_FDS, arg, "too many fds");
+
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, arg, i + 1);
+    fds[i] = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    luaL_argcheck(L, fds[i] >= 0, arg, "invalid fd");
+  }
+
+  return n;
+}
+
+static int has_fd(const int *fds, int n, int fd) {
+  while (n--) if (fds[n] == fd) return 1;
+  return 0;
+}
+
+#ifdef __linux__
+// brings the fds registered with epoll in line with the ones passed, so a
+// set of fds that stays the same from one call to the next costs nothing.
+// fds must be removed from the list before they're closed.
+static int sync_epoll_fds(lua_State *L, const int *fds, int n) {
+  struct epoll_event ev;
+  int i;
+
+  if (waiter.epfd < 0) {
+    waiter.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (waiter.epfd < 0) return luaL_error(L, "epoll_create1 failed: %s", strerror(errno));
+    epoll_watch(waiter.tty);
+    epoll_watch(waiter.winch[0]);
+  }
+
+  for (i = 0; i < waiter.nfds; i++) {
+    if (has_fd(fds, n, waiter.fds[i])) continue;
+    epoll_ctl(waiter.epfd, EPOLL_CTL_DEL, waiter.fds[i], NULL); // might be closed already
+    waiter.fds[i--] = waiter.fds[--waiter.nfds];
+  }
+
+  for (i = 0; i < n; i++) {
+    if (has_fd(waiter.fds, waiter.nfds, fds[i]) || fds[i] == waiter.tty || fds[i] == waiter.winch[0]) continue;
+    ev.events = EPOLLIN;
+    ev.data.fd = fds[i];
+    if (epoll_ctl(waiter.epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+      return luaL_error(L, "can't wait on fd %d: %s", fds[i], strerror(errno));
+    waiter.fds[waiter.nfds++] = fds[i];
+  }
+
+  return 0;
+}
+#endif
+
+// wait(fds, timeout [, ready]) -> tty_ready, ready, count
+// blocks until there's terminal input (or a resize), one of the fds in the
+// fds array is readable, or timeout ms pass (forever if nil or negative).
+// the ready fds are stored in the ready table, which can be reused between
+// calls. returns whether termbox has events to read, plus the ready fds.
+// termbox may still hold events it read earlier, so drain them all first.
+static int l_tb_wait(lua_State *L) {
+  int fds[WAIT_MAX_FDS];
+  int n = check_fd_list(L, 1, fds);
+  int timeout = luaL_optinteger(L, 2, -1);
+  int tty, winch, tty_ready = 0, count = 0, ret, i, replay_ms;
+  double start;
+
+  start_waiting();
+  tty = waiter.tty;
+  winch = waiter.winch[0];
+
+  if (lua_istable(L, 3)) {
+    lua_pushvalue(L, 3);
+  } else {
+    lua_createtable(L, n, 0);
+  }
+
+  // no way to watch the terminal, so fall back to polling termbox
+  if (tty < 0 && running && (timeout < 0 || timeout > WAIT_POLL_MS))
+    timeout = WAIT_POLL_MS;
+
+  // replayed events count as terminal input, once they're due
+  replay_ms = replay_wait_ms();
+  if (replay_ms >= 0 && (timeout < 0 || timeout > replay_ms))
+    timeout = replay_ms;
+
+  start = now_us();
+
+#ifdef __linux__
+  struct epoll_event events[WAIT_MAX_FDS + 2];
+
+  sync_epoll_fds(L, fds, n);
+  ret = epoll_wait(waiter.epfd, events, WAIT_MAX_FDS + 2, timeout < 0 ? -1 : timeout);
+
+  for (i = 0; i < ret; i++) {
+    if (events[i].data.fd == winch) {
+      drain_winch();
+      tty_ready = 1;
+    } else if (events[i].data.fd == tty) {
+      tty_ready = 1;
+    } else {
+      lua_pushinteger(L, events[i].data.fd);
+      lua_rawseti(L, -2, ++count);
+    }
+  }
+#else
+  struct pollfd pfds[WAIT_MAX_FDS + 2];
+  int npfds = 0;
+
+  for (i = 0; i < n; i++) {
+    pfds[npfds].fd = fds[i];
+    pfds[npfds++].events = POLLIN;
+  }
+  if (tty >= 0) {
+    pfds[npfds].fd = tty;
+    pfds[npfds++].events = POLLIN;
+  }
+  if (winch >= 0) {
+    pfds[npfds].fd = winch;
+    pfds[npfds++].events = POLLIN;
+  }
+
+  ret = poll(pfds, npfds, timeout < 0 ? -1 : timeout);
+
+  for (i = 0; i < npfds && ret > 0; i++) {
+    if (!pfds[i].revents) continue;
+    if (pfds[i].fd == winch) {
+      drain_winch();
+      tty_ready = 1;
+    } else if (pfds[i].fd == tty) {
+      tty_ready = 1;
+    } else {
+      lua_pushinteger(L, pfds[i].fd);
+      lua_rawseti(L, -2, ++count);
+    }
+  }
+#endif
+
+  stats.wait_us += now_us() - start;
+
+  if (tty < 0 && running) tty_ready = 1;
+  if (trace.replaying && replay_wait_ms() == 0) tty_ready = 1;
+
+  if (ret < 0) {
+    if (errno != EINTR) return luaL_error(L, "wait failed: %s", strerror(errno));
+    tty_ready = 1; // interrupted, maybe by a resize, so have a look anyway
+  }
+
+  // clear whatever was left over from a previous call
+  for (i = luaL_len(L, -1); i > count; i--) {
+    lua_pushnil(L);
+    lua_rawseti(L, -2, i);
+  }
+
+  lua_pushboolean(L, tty_ready);
+  lua_insert(L, -2);
+  lua_pushinteger(L, count);
+  return 3;
+}
+
+///////////////////
+// timers
+
+// timers live in a pool of slots, with a binary min-heap of slot numbers
+// ordered by deadline on top, so adding, cancelling or firing one is
+// O(log n) however many there are. handles carry the slot's generation, so
+// a stale one can't cancel whatever timer reused its slot.
+#define TIMER_SLOT_BITS 24
+
+struct timer {
+  double due;      // now_us() deadline
+  double interval; // us between runs, 0 for one-off timers
+  int ref;         // callback, in the registry
+  int pos;         // in the heap, -1 if the slot is free
+  lua_Integer gen;
+};
+
+static struct {
+  struct timer *slots;
+  int *heap;
+  int *free; // stack of free slots
+  int nslots, nheap, nfree, cap;
+} timers;
+
+// the frame scheduler runs its callback once something changed, but no
+// sooner than interval us after the last frame
+static struct {
+  int ref;
+  int invalidated;
+  double interval;
+  double last;
+} frame = { LUA_NOREF, 0, 0, 0 };
+
+static lua_Integer timer_handle(int slot) {
+  return (timers.slots[slot].gen << TIMER_SLOT_BITS) | slot;
+}
+
+static void timer_place(int pos, int slot) {
+  timers.heap[pos] = slot;
+  timers.slots[slot].pos = pos;
+}
+
+static void timer_sift_up(int pos) {
+  int slot = timers.heap[pos], parent;
+  double due = timers.slots[slot].due;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (timers.slots[timers.heap[parent]].due <= due) break;
+    timer_place(pos, timers.heap[parent]);
+    pos = parent;
+  }
+  timer_place(pos, slot);
+}
+
+static void timer_sift_down(int pos) {
+  int slot = timers.heap[pos], child;
+  double due = timers.slots[slot].due;
+
+  while ((child = pos * 2 + 1) < timers.nheap) {
+    if (child + 1 < timers.nheap && timers.slots[timers.heap[child + 1]].due < timers.slots[timers.heap[child]].due)
+      child++;
+    if (due <= timers.slots[timers.heap[child]].due) break;
+    timer_place(pos, timers.heap[child]);
+    pos = child;
+  }
+  timer_place(pos, slot);
+}
+
+static int add_timer(lua_State *L, double delay, double interval) {
+  int slot, cap;
+  struct timer *t;
+
+  if (timers.nfree == 0 && timers.nslots == timers.cap) {
+    cap = timers.cap ? timers.cap * 2 : 16;
+    if (cap > 1 << TIMER_SLOT_BITS) return luaL_error(L, "too many timers");
+
+    struct timer *slots = realloc(timers.slots, cap * sizeof(struct timer));
+    if (slots) timers.slots = slots;
+    int *heap = realloc(timers.heap, cap * sizeof(int));
+    if (heap) timers.heap = heap;
+    int *free_slots = realloc(timers.free, cap * sizeof(int));
+    if (free_slots) timers.free = free_slots;
+    if (!slots || !heap || !free_slots) return luaL_error(L, "out of memory");
+
+    timers.cap = cap;
+  }
+
+  if (timers.nfree > 0) {
+    slot = timers.free[--timers.nfree];
+  } else {
+    slot = timers.nslots++;
+    timers.slots[slot].gen = 0;
+  }
+  t = &timers.slots[slot];
+
+  lua_pushvalue(L, 2);
+  t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  t->due = now_us() + delay;
+  t->interval = interval;
+  t->gen++;
+
+  timers.heap[timers.nheap] = slot;
+  timer_sift_up(timers.nheap++);
+  return slot;
+}
+
+static void remove_timer(lua_State *L, int slot) {
+  struct timer *t = &timers.slots[slot];
+  int pos = t->pos, last = timers.heap[--timers.nheap];
+
+  if (pos < timers.nheap) {
+    timer_place(pos, last);
+    timer_sift_down(pos);
+    timer_sift_up(timers.slots[last].pos);
+  }
+
+  luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+  t->ref = LUA_NOREF;
+  t->pos = -1;
+  timers.free[timers.nfree++] = slot;
+}
+
+// returns the slot for a handle, or -1 if the timer already ran or was cancelled
+static int find_timer(lua_Integer handle) {
+  int slot = handle & ((1 << TIMER_SLOT_BITS) - 1);
+  if (handle <= 0 || slot >= timers.nslots) return -1;
+  if (timers.slots[slot].pos < 0 || timers.slots[slot].gen != handle >> TIMER_SLOT_BITS) return -1;
+  return slot;
+}
+
+// a frame that didn't draw what was dirty (eg. there's nothing loaded to
+// draw it) leaves those rows behind, and another one is only due once
+// something else changes. otherwise it'd be due again right away.
+static int frame_pending(void) {
+  if (frame.ref == LUA_NOREF) return 0;
+  return frame.invalidated || (running && force_render + count_dirty_rows() > undrawn_rows);
+}
+
+// after(ms, fn) -> handle
+// calls fn once, ms from now. timers only run from run_timers().
+static int l_tb_after(lua_State *L) {
+  double ms = luaL_checknumber(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_pushinteger(L, timer_handle(add_timer(L, ms * 1000, 0)));
+  return 1;
+}
+
+// every(ms, fn) -> handle
+// calls fn every ms until it's cancelled, or fn returns true. runs that were
+// missed (eg. while blocked on something else) are dropped, not caught up.
+static int l_tb_every(lua_State *L) {
+  double ms = luaL_checknumber(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  luaL_argcheck(L, ms > 0, 1, "interval must be positive");
+  lua_pushinteger(L, timer_handle(add_timer(L, ms * 1000, ms * 1000)));
+  return 1;
+}
+
+// cancel(handle) -> true if the timer was still pending
+static int l_tb_cancel(lua_State *L) {
+  int slot = find_timer(luaL_checkinteger(L, 1));
+  if (slot >= 0) remove_timer(L, slot);
+  lua_pushboolean(L, slot >= 0);
+  return 1;
+}
+
+static int l_tb_clear_timers(lua_State *L) {
+  while (timers.nheap > 0) remove_timer(L, timers.heap[0]);
+  return 0;
+}
+
+// on_frame(fn [, interval_ms])
+// sets the function that draws a frame. run_timers() calls it once the
+// screen needs to be drawn again, which is when invalidate() was called or
+// something was written to the back buffer, but at most once every
+// interval_ms (0 by default).
+static int l_tb_on_frame(lua_State *L) {
+  luaL_unref(L, LUA_REGISTRYINDEX, frame.ref);
+  frame.ref = LUA_NOREF;
+  frame.interval = luaL_optnumber(L, 2, 0) * 1000;
+
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_pushvalue(L, 1);
+    frame.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  return 0;
+}
+
+// invalidate() asks for a frame to be drawn
+static int l_tb_invalidate(lua_State *L) {
+  frame.invalidated = 1;
+  return 0;
+}
+
+// run_timers() -> count
+// calls every timer that's due, then the frame callback if a frame is due.
+// timers added meanwhile wait for the next call, even if they're due now.
+static int l_tb_run_timers(lua_State *L) {
+  double now = now_us();
+  int count = 0, slot;
+  lua_Integer handle;
+  struct timer *t;
+
+  while (timers.nheap > 0 && timers.slots[timers.heap[0]].due <= now) {
+    slot = timers.heap[0];
+    t = &timers.slots[slot];
+    handle = timer_handle(slot);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref);
+    if (t->interval > 0) {
+      t->due = t->due + t->interval > now ? t->due + t->interval : now + t->interval;
+      timer_sift_down(0);
+    } else {
+      remove_timer(L, slot);
+    }
+
+    lua_call(L, 0, 1);
+    count++;
+
+    // returning true stops a repeating timer, unless it cancelled itself
+    if (lua_toboolean(L, -1) && (slot = find_timer(handle)) >= 0) remove_timer(L, slot);
+    lua_pop(L, 1);
+  }
+
+  if (frame_pending() && now >= frame.last + frame.interval) {
+    frame.invalidated = 0;
+    frame.last = now;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, frame.ref);
+    lua_call(L, 0, 0);
+    undrawn_rows = force_render + count_dirty_rows();
+  }
+
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+// next_timer() -> ms until the next timer or frame is due, or nil if nothing
+// is scheduled. meant to be passed as the timeout to wait().
+static int l_tb_next_timer(lua_State *L) {
+  double due = -1, now = now_us();
+
+  if (timers.nheap > 0) due = timers.slots[timers.heap[0]].due;
+  if (frame_pending() && (due < 0 || frame.last + frame.interval < due))
+    due = frame.last + frame.interval;
+
+  if (due < 0) return 0;
+  lua_pushinteger(L, due > now ? (lua_Integer)((due - now + 999) / 1000) : 0);
+  return 1;
+}
+
+static int l_tb_init(lua_State *L) {
+  int ret = tb_init();
+  if (ret == 0) { running = 1; sync_view(); }
+  lua_pushinteger(L, ret);
+  return 1;
+}
+
+static int l_tb_init_with(lua_State *L) {
+  uint16_t flags = luaL_checkunsigned(L, 1);
+  int ret = tb_init_with(flags);
+  if (ret == 0) { running = 1; sync_view(); }
+  lua_pushinteger(L, ret);
+  return 1;
+}
+
+static int l_tb_shutdown(lua_State *L) {
+  mouse_enabled = 0;
+  running = 0;
+  stop_waiting();
+  tb_shutdown();
+  stop_headless();
+  forget_last_frame();
+  memset(&screen_view, 0, sizeof(screen_view));
+  return 0;
+}
+
+static int l_tb_width(lua_State *L) {
+  lua_pushinteger(L, tb_width());
+  return 1;
+}
+
+static int l_tb_height(lua_State *L) {
+  lua_pushinteger(L, tb_height());
+  return 1;
+}
+
+static int l_tb_clear_screen(lua_State *L) {
+  tb_clear_screen();
+  mark_all_rows();
+  forget_last_frame(); // the whole screen gets redrawn
+  return 0;
+}
+
+static int l_tb_clear_buffer(lua_State *L) {
+  tb_clear_buffer();
+  mark_all_rows();
+  return 0;
+}
+
+static int l_tb_set_clear_attributes(lua_State *L) {
+  uint16_t fg = luaL_checkunsigned(L, 1);
+  uint16_t bg = luaL_checkunsigned(L, 2);
+
+  lua_pop(L, 2);
+  tb_set_clear_attributes(fg, bg);
+  return 0;
+}
+
+static int l_tb_resize(lua_State *L) {
+  tb_resize();
+  sync_view();
+  return 0;
+}
+
+static void render(int only_dirty) {
+  double start, end, written = -1, bytes = -1;
+
+  if (frame_stats_enabled) count_changed_cells(only_dirty);
+  if (frame_stats_enabled || trace.recording) written = thread_bytes_written();
+
+  start = now_us();
+  tb_render();
+  end = now_us();
+  record_render(end - start);
+  clear_dirty_rows();
+
+  if (written >= 0) {
+    double after = thread_bytes_written();
+    if (after > written) bytes = after - written;
+    if (frame_stats_enabled && bytes > 0) stats.bytes_written += bytes;
+  }
+
+  if (trace.measuring) trace_render(end, end - start, bytes);
+}
+
+static int l_tb_render(lua_State *L) {
+  render(0);
+  return 0;
+}
+
+// render_dirty() -> number of rows drawn on since the last render.
+// same as render(), except nothing is done at all if that number is 0.
+// termbox still compares every row once it renders, since its front buffer
+// is private, but idle frames no longer cost a scan and a write.
+static int l_tb_render_dirty(lua_State *L) {
+  int rows = count_dirty_rows();
+
+  if (rows > 0 || force_render) render(1);
+  lua_pushinteger(L, rows);
+  return 1;
+}
+
+// mark_dirty(x, y, w, h) flags the rows in the rect as changed, for code that
+// writes to the back buffer through screen_view(). damage is kept per row,
+// so x and w only matter for telling whether the rect is empty.
+static int l_tb_mark_dirty(lua_State *L) {
+  int x = luaL_optinteger(L, 1, 0);
+  int y = luaL_optinteger(L, 2, 0);
+  int w = luaL_optinteger(L, 3, tb_width() - x);
+  int h = luaL_optinteger(L, 4, tb_height() - y);
+
+  if (w > 0 && x < tb_width() && x + w > 0) mark_rows(y, h);
+  return 0;
+}
+
+static int l_tb_set_cursor(lua_State *L) {
+  int cx = luaL_checkinteger(L, 1);
+  int cy = luaL_checkinteger(L, 2);
+
+  lua_pop(L, 2);
+  tb_set_cursor(cx, cy);
+  force_render = 1;
+  return 0;
+}
+
+static int l_tb_show_cursor(lua_State *L) {
+  tb_show_cursor();
+  force_render = 1;
+  return 0;
+}
+
+static int l_tb_hide_cursor(lua_State *L) {
+  tb_hide_cursor();
+  force_render = 1;
+  return 0;
+}
+
+static int l_tb_cell(lua_State *L) {
+  int x = luaL_checkinteger(L, 1);
+  int y = luaL_checkinteger(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+
+/* TODO: allow less than 3 members by default values */
+  lua_getfield(L, 3, "ch");
+  lua_getfield(L, 3, "fg");
+  lua_getfield(L, 3, "bg");
+
+  const struct tb_cell cell = {
+    .ch = luaL_checkstring(L, -3)[0],
+    .fg = luaL_checkinteger(L, -2),
+    .bg = luaL_checkinteger(L, -1),
+  };
+
+  lua_pop(L, 6);
+  tb_cell(x, y, &cell);
+  mark_rows(y, 1);
+  stats.cells_written++;
+  return 0;
+}
+
+static uint32_t normalize_char(const char * str) {
+  uint32_t ch;
+
+  // str might be a number (char code), a unicode string or an actual char
+  // we'll start checking with the most probable scenario: a regular char
+  if (!str[1]) {
+    ch = str[0];
+  } else if (str[1] >= '0' && str[1] <= '9') { // looks like a number
+    ch = atoi(str);
+  } else {
+    tb_utf8_char_to_unicode(&ch, str);
+  }
+
+  return ch;
+}
+
+static int l_tb_char(lua_State* L) {
+  int x       = luaL_checkinteger(L, 1);
+  int y       = luaL_checkinteger(L, 2);
+  uint16_t fg = luaL_checkunsigned(L, 3);
+  uint16_t bg = luaL_checkunsigned(L, 4);
+  const char * str = luaL_checkstring(L, 5);
+
+  uint32_t ch = normalize_char(str);
+  tb_char(x, y, fg, bg, ch);
+  mark_rows(y, 1);
+  stats.cells_written++;
+
+  lua_pop(L, 5);
+  return 0;
+}
+
+static int l_tb_string(lua_State *L) {
+  int x = luaL_checkinteger(L, 1);
+  int y = luaL_checkinteger(L, 2);
+  int fg = luaL_checkinteger(L, 3);
+  int bg = luaL_checkinteger(L, 4);
+  const char * str = luaL_checkstring(L, 5);
+
+  int len;
+  if (lua_gettop(L) == 6) {
+    len = tb_string_with_limit(x, y, fg, bg, (char *)str, luaL_checkinteger(L, 6));
+  } else {
+    len = tb_string(x, y, fg, bg, (char *)str);
+  }
+
+  mark_rows(y, 1);
+  stats.cells_written += len;
+  lua_pushinteger(L, len);
+  return 1;
+}
+
+static int l_tb_enable_mouse(lua_State *L) {
+  if (!mouse_enabled) tb_enable_mouse();
+  mouse_enabled = 1;
+  return 0;
+}
+
+static int l_tb_disable_mouse(lua_State *L) {
+  if (mouse_enabled) tb_disable_mouse();
+  mouse_enabled = 0;
+  return 0;
+}
+
+static int l_tb_enable_focus_tracking(lua_State *L) {
+  if (!focus_tracking_enabled) tb_enable_focus_tracking();
+  focus_tracking_enabled = 1;
+  return 0;
+}
+
+static int l_tb_disable_focus_tracking(lua_State *L) {
+  if (focus_tracking_enabled) tb_disable_focus_tracking();
+  focus_tracking_enabled = 0;
+  return 0;
+}
+
+static int l_tb_toggle_mouse(lua_State *L) {
+  return mouse_enabled ? l_tb_disable_mouse(L) : l_tb_enable_mouse(L);
+}
+
+static int l_tb_select_output_mode(lua_State *L) {
+  int mode = luaL_checkinteger(L, 1);
+
+  lua_pop(L, 1);
+  lua_pushinteger(L, tb_select_output_mode(mode));
+  return 1;
+}
+
+// event table keys, in the order populate_event() sets them
+enum {
+  EV_TYPE, EV_KEY, EV_META, EV_CH, EV_X, EV_Y, EV_CLICKS, EV_W, EV_H, EV_FIELDS
+};
+
+static const char * event_fields[EV_FIELDS] = {
+  "type", "key", "meta", "ch", "x", "y", "clicks", "w", "h"
+};
+
+// number of integers per event in the packed drain_events() layout
+#define EVENT_STRIDE 8
+
+// sets field to the value on top of the stack (or nil if has_value is 0)
+static void set_event_field(lua_State *L, int idx, int field, int has_value) {
+  if (!has_value) lua_pushnil(L);
+  lua_pushstring(L, event_fields[field]);
+  lua_insert(L, -2);
+  lua_rawset(L, idx);
+}
+
+// fills the table at idx with ev. every field is written on every call,
+// so nothing is left over from a previous event of a different type.
+static void populate_event(lua_State *L, int idx, const struct tb_event *ev) {
+  int is_mouse  = ev->type == TB_EVENT_MOUSE;
+  int is_resize = ev->type == TB_EVENT_RESIZE;
+
+  lua_pushnumber(L, ev->type);
+  set_event_field(L, idx, EV_TYPE, 1);
+
+  lua_pushnumber(L, ev->key);
+  set_event_field(L, idx, EV_KEY, 1);
+
+  lua_pushnumber(L, ev->meta);
+  set_event_field(L, idx, EV_META, 1); // ctrl/alt/shift or motion in mouse events
+
+  if (ev->type == TB_EVENT_KEY) {
+    char_len = tb_utf8_unicode_to_char(utf8_char, ev->ch);
+    utf8_char[char_len] = '\0';
+    lua_pushstring(L, utf8_char);
+  }
+  set_event_field(L, idx, EV_CH, ev->type == TB_EVENT_KEY);
+
+  if (is_mouse) lua_pushnumber(L, ev->x);
+  set_event_field(L, idx, EV_X, is_mouse);
+
+  if (is_mouse) lua_pushnumber(L, ev->y);
+  set_event_field(L, idx, EV_Y, is_mouse);
+
+  if (is_mouse) lua_pushnumber(L, ev->h);
+  set_event_field(L, idx, EV_CLICKS, is_mouse); // click count
+
+  if (is_resize) lua_pushnumber(L, ev->w);
+  set_event_field(L, idx, EV_W, is_resize);
+
+  if (is_resize) lua_pushnumber(L, ev->h);
+  set_event_field(L, idx, EV_H, is_resize);
+
+  if (is_resize) sync_view();
+}
+
+static int l_tb_peek_event(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int timeout = luaL_checkinteger(L, 2);
+
+  int ret = timed_peek_event(&event, timeout);
+  populate_event(L, 1, &event);
+
+  lua_pop(L, 2);
+  lua_pushinteger(L, ret);
+  return 1;
+}
+
+static int l_tb_poll_event(lua_State *L){
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  int ret = timed_poll_event(&event);
+  populate_event(L, 1, &event);
+
+  lua_pop(L, 1);
+  lua_pushinteger(L, ret);
+  return 1;
+}
+
+// waits up to timeout ms for the first event, then pulls every event that is
+// already pending (up to max) into arr without waiting again. by default each
+// arr[i] is an event table, reused if present. if packed is true, arr is
+// filled with EVENT_STRIDE integers per event instead:
+// type, meta, key, ch, x, y, w, h (h being the click count for mouse events).
+// returns the number of events read, or -1 on error.
+static int l_tb_drain_events(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int max     = luaL_checkinteger(L, 2);
+  int timeout = luaL_optinteger(L, 3, 0);
+  int packed  = lua_toboolean(L, 4);
+  int count   = 0, ret;
+
+  while (count < max) {
+    ret = timed_peek_event(&event, count == 0 ? timeout : 0);
+    if (ret <= 0) {
+      if (ret < 0 && count == 0) count = -1;
+      break;
+    }
+
+    if (packed) {
+      int base = count * EVENT_STRIDE;
+      lua_pushinteger(L, event.type); lua_rawseti(L, 1, base + 1);
+      lua_pushinteger(L, event.meta); lua_rawseti(L, 1, base + 2);
+      lua_pushinteger(L, event.key);  lua_rawseti(L, 1, base + 3);
+      lua_pushinteger(L, event.ch);   lua_rawseti(L, 1, base + 4);
+      lua_pushinteger(L, event.x);    lua_rawseti(L, 1, base + 5);
+      lua_pushinteger(L, event.y);    lua_rawseti(L, 1, base + 6);
+      lua_pushinteger(L, event.w);    lua_rawseti(L, 1, base + 7);
+      lua_pushinteger(L, event.h);    lua_rawseti(L, 1, base + 8);
+      if (event.type == TB_EVENT_RESIZE) sync_view();
+
+    } else {
+      lua_rawgeti(L, 1, count + 1);
+      if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, EV_FIELDS);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 1, count + 1);
+      }
+
+      populate_event(L, lua_gettop(L), &event);
+      lua_pop(L, 1);
+    }
+
+    count++;
+  }
+
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+static int l_tb_utf8_char_length(lua_State *L) {
+  char c = luaL_checkstring(L, 1)[0];
+
+  lua_pop(L, 1);
+  lua_pushinteger(L, tb_utf8_char_length(c));
+  return 1;
+}
+
+static int l_tb_utf8_char_to_unicode(lua_State *L) {
+  const char * str = luaL_checkstring(L, 1);
+  uint32_t ch = normalize_char(str);
+  lua_pop(L, 1);
+  lua_pushinteger(L, ch);
+  return 1;
+}
+
+static int l_tb_utf8_unicode_to_char(lua_State *L) {
+  const char * str = luaL_checkstring(L, 1);
+
+  uint32_t ch = normalize_char(str);
+  char *out = NULL;
+
+  lua_pop(L, 1);
+  lua_pushinteger(L, tb_utf8_unicode_to_char(out, ch));
+  return 1;
+}
+
+static int l_tb_is_char_wide(lua_State *L) {
+  const char * str = luaL_checkstring(L, 1);
+  uint32_t ch = normalize_char(str);
+
+  lua_pop(L, 1);
+  lua_pushinteger(L, tb_unicode_is_char_wide(ch));
+  return 1;
+}
+
+///////////////////
+// text measurement
+
+#define DEFAULT_TAB_WIDTH 8
+
+#define RANGE_COUNT(r) ((int)(sizeof(r) / sizeof((r)[0])))
+
+// number of columns a codepoint takes on screen on its own: 0, 1 or 2.
+// termbox renders by its own wide char table, so whatever it takes as wide
+// counts as such too.
+static inline int char_width(uint32_t ch) {
+  int w;
+
+  if (ch < 0x300) return 1;
+  w = PROP_WIDTH(char_props(ch));
+  if (w == 1 && tb_unicode_is_char_wide(ch)) w = 2;
+  return w;
+}
+
+// decodes the char at str + i, returning its length in bytes. a sequence cut
+// short by the end of str is taken as a single, broken char.
+static inline int decode_char(const char *str, size_t len, size_t i, uint32_t *ch) {
+  int n;
+
+  if ((unsigned char)str[i] < 0x80) {
+    *ch = str[i];
+    return 1;
+  }
+
+  n = tb_utf8_char_length(str[i]);
+
+  if (i + n > len) {
+    *ch = 0xFFFD;
+    return 1;
+  }
+
+  tb_utf8_char_to_unicode(ch, str + i);
+  return n;
+}
+
+// walks a text one char at a time, telling where each extended grapheme
+// cluster (uax #29) starts: a base char plus the marks, joiners, modifiers
+// and such that go with it, which is what the user sees as one character.
+struct cluster_state {
+  int prev;  // break class of the last char, -1 before the first one
+  int pict;  // 1 after a pictograph and its extends, 2 once a ZWJ follows
+  int ri;    // regional indicators in a row, up to the last char
+  int emoji; // the current cluster started with a pictograph
+  int cols;  // columns the current cluster takes so far
+  int start; // the last char started a new cluster
+};
+
+#define CLUSTER_START { -1, 0, 0, 0, 0, 0 }
+
+// whether there's a cluster boundary between the last char fed to st and
+// the next one, with props p
+static inline int cluster_break(const struct cluster_state *st, uint8_t p) {
+  int prev = st->prev, cur = PROP_BREAK(p);
+
+  if (prev < 0) return 1;
+  if (prev == GB_CR && cur == GB_LF) return 0;                                   // GB3
+  if (prev == GB_CR || prev == GB_LF || prev == GB_CONTROL) return 1;            // GB4
+  if (cur == GB_CR || cur == GB_LF || cur == GB_CONTROL) return 1;               // GB5
+  if (prev == GB_L && (cur == GB_L || cur == GB_V || cur == GB_LV || cur == GB_LVT)) return 0; // GB6
+  if ((prev == GB_LV || prev == GB_V) && (cur == GB_V || cur == GB_T)) return 0; // GB7
+  if ((prev == GB_LVT || prev == GB_T) && cur == GB_T) return 0;                 // GB8
+  if (cur == GB_EXTEND || cur == GB_ZWJ || cur == GB_SPACING_MARK) return 0;     // GB9, 9a
+  if (prev == GB_PREPEND) return 0;                                              // GB9b
+  if (st->pict == 2 && (p & PROP_PICTOGRAPH)) return 0;                          // GB11
+  if (prev == GB_RI && cur == GB_RI) return st->ri % 2 == 0;                     // GB12, 13
+  return 1;
+}
+
+// feeds ch to the walk, setting st->start if it begins a new cluster.
+// returns the columns it adds to its cluster: extends and joined emoji take
+// none, a VS16 makes a pictograph two columns wide, and a pair of regional
+// indicators (a flag) is two columns, one per char.
+static int cluster_next(struct cluster_state *st, uint32_t ch) {
+  uint8_t p = char_props(ch);
+  int cur = PROP_BREAK(p), joined = st->pict == 2 && (p & PROP_PICTOGRAPH), w;
+
+  st->start = cluster_break(st, p);
+  if (st->start) {
+    w = char_width(ch);
+    st->emoji = (p & PROP_PICTOGRAPH) != 0;
+    st->cols = 0;
+  } else if (ch == 0xFE0F) {
+    w = st->emoji && st->cols == 1;
+  } else if (cur == GB_EXTEND || cur == GB_ZWJ || joined) {
+    w = 0;
+  } else {
+    w = char_width(ch);
+  }
+
+  if (p & PROP_PICTOGRAPH) st->pict = 1;
+  else if (cur == GB_ZWJ && st->pict == 1) st->pict = 2;
+  else if (cur != GB_EXTEND || st->pict != 1) st->pict = 0;
+
+  st->ri = cur == GB_RI ? st->ri + 1 : 0;
+  st->prev = cur;
+  st->cols += w;
+  return w;
+}
+
+struct cluster {
+  int chars; // codepoints in it
+  int cols;
+  int emoji; // starts with a pictograph or regional indicator
+};
+
+// finds the end of the cluster starting at str + i, returning its offset
+static size_t next_cluster(const char *str, size_t len, size_t i, struct cluster *c) {
+  struct cluster_state st = CLUSTER_START, next;
+  uint32_t ch;
+  int n, w;
+
+  n = decode_char(str, len, i, &ch);
+  c->cols = cluster_next(&st, ch);
+  c->chars = 1;
+  c->emoji = st.emoji || st.prev == GB_RI;
+
+  for (i += n; i < len; i += n) {
+    n = decode_char(str, len, i, &ch);
+    next = st;
+    w = cluster_next(&next, ch);
+    if (next.start) break;
+
+    st = next;
+    c->cols += w;
+    c->chars++;
+  }
+
+  return i;
+}
+
+// returns how many leading bytes of str are ascii other than tab, which is
+// the common case where bytes, chars and columns are all the same thing
+static size_t ascii_run(const char *str, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i tabs = _mm_set1_epi8('\t');
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+    int mask = _mm_movemask_epi8(chunk) | _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, tabs));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#else
+  // eight bytes at a time: any high bit set, or any byte equal to a tab
+  const uint64_t high = 0x8080808080808080ULL, ones = 0x0101010101010101ULL;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word, tabs;
+    memcpy(&word, str + i, 8);
+    tabs = word ^ (ones * '\t');
+    if ((word & high) || ((tabs - ones) & ~tabs & high)) break;
+  }
+#endif
+
+  while (i < len && (unsigned char)str[i] < 0x80 && str[i] != '\t') i++;
+  return i;
+}
+
+struct text_pos {
+  size_t bytes;
+  int chars;
+  int cols;
+};
+
+// walks len bytes of utf-8 text, expanding tabs to the next multiple of
+// tab_width. if max_cols is not negative, stops right before the first
+// cluster that would end past max_cols. returns where it stopped, in bytes, chars
+// (codepoints) and columns.
+static struct text_pos measure_text(const char *str, size_t len, int max_cols, int tab_width) {
+  struct text_pos pos = { 0, 0, 0 };
+  struct cluster c;
+  size_t run, n;
+  int w;
+
+  while (pos.bytes < len) {
+    run = ascii_run(str + pos.bytes, len - pos.bytes);
+    if (run > 0 && pos.bytes + run < len && (unsigned char)str[pos.bytes + run] >= 0x80) {
+      run--; // the last one may start a cluster with what follows
+    }
+
+    if (run > 0) {
+      if (max_cols >= 0 && pos.cols + run > (size_t)max_cols) {
+        run = max_cols - pos.cols;
+        pos.bytes += run; pos.chars += run; pos.cols += run;
+        break;
+      }
+
+      pos.bytes += run; pos.chars += run; pos.cols += run;
+      continue;
+    }
+
+    if (str[pos.bytes] == '\t') {
+      n = 1;
+      c.chars = 1;
+      w = tab_width - (pos.cols % tab_width);
+    } else {
+      n = next_cluster(str, len, pos.bytes, &c) - pos.bytes;
+      w = c.cols;
+    }
+
+    if (max_cols >= 0 && pos.cols + w > max_cols) break;
+
+    pos.bytes += n; pos.chars += c.chars; pos.cols += w;
+  }
+
+  return pos;
+}
+
+static int check_tab_width(lua_State *L, int arg) {
+  int tab_width = luaL_optinteger(L, arg, DEFAULT_TAB_WIDTH);
+  luaL_argcheck(L, tab_width > 0, arg, "tab width must be positive");
+  return tab_width;
+}
+
+// text_width(str [, tab_width]) -> columns
+static int l_tb_text_width(lua_State *L) {
+  size_t len;
+  const char * str = luaL_checklstring(L, 1, &len);
+  int tab_width = check_tab_width(L, 2);
+
+  lua_pushinteger(L, measure_text(str, len, -1, tab_width).cols);
+  return 1;
+}
+
+// clip_to_width(str, max_cols [, tab_width]) -> chars, bytes, cols
+// for the longest prefix of str that fits in max_cols columns.
+static int l_tb_clip_to_width(lua_State *L) {
+  size_t len;
+  const char * str = luaL_checklstring(L, 1, &len);
+  int max_cols = luaL_checkinteger(L, 2);
+  int tab_width = check_tab_width(L, 3);
+
+  struct text_pos pos = measure_text(str, len, max_cols < 0 ? 0 : max_cols, tab_width);
+  lua_pushinteger(L, pos.chars);
+  lua_pushinteger(L, pos.bytes);
+  lua_pushinteger(L, pos.cols);
+  return 3;
+}
+
+// col_to_index(str, col [, tab_width]) -> chars, bytes
+// before the char displayed at column col (counting from 0). a col falling
+// in the middle of a wide char or tab maps to that char.
+static int l_tb_col_to_index(lua_State *L) {
+  size_t len;
+  const char * str = luaL_checklstring(L, 1, &len);
+  int col = luaL_checkinteger(L, 2);
+  int tab_width = check_tab_width(L, 3);
+
+  struct text_pos pos = measure_text(str, len, col < 0 ? 0 : col, tab_width);
+  lua_pushinteger(L, pos.chars);
+  lua_pushinteger(L, pos.bytes);
+  return 2;
+}
+
+// expand_tabs(str [, tab_width]) -> str with tabs replaced by spaces
+static int l_tb_expand_tabs(lua_State *L) {
+  size_t len, start = 0;
+  const char * str = luaL_checklstring(L, 1, &len);
+  int tab_width = check_tab_width(L, 2);
+  const char * tab = memchr(str, '\t', len);
+  int cols = 0, n;
+
+  if (!tab) { // nothing to do, hand back the same string
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+
+  while (tab) {
+    size_t at = tab - str;
+    cols += measure_text(str + start, at - start, -1, tab_width).cols;
+    luaL_addlstring(&b, str + start, at - start);
+
+    for (n = tab_width - (cols % tab_width); n > 0; n--, cols++) {
+      luaL_addchar(&b, ' ');
+    }
+
+    start = at + 1;
+    tab = memchr(str + start, '\t', len - start);
+  }
+
+  luaL_addlstring(&b, str + start, len - start);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+///////////////////
+// grapheme clusters
+
+// the string and the offset of the next cluster are kept as upvalues
+static int graphemes_next(lua_State *L) {
+  size_t len, i = lua_tointeger(L, lua_upvalueindex(2)), end;
+  const char * str = lua_tolstring(L, lua_upvalueindex(1), &len);
+  struct cluster c;
+
+  if (i >= len) return 0;
+
+  end = next_cluster(str, len, i, &c);
+  lua_pushinteger(L, end);
+  lua_replace(L, lua_upvalueindex(2));
+
+  lua_pushinteger(L, i + 1);
+  lua_pushinteger(L, end);
+  lua_pushinteger(L, c.cols);
+  lua_pushboolean(L, c.emoji);
+  return 4;
+}
+
+// graphemes(str [, i]) -> iterator yielding the start and end byte of each
+// cluster from byte i on, plus the columns it takes and whether it's an emoji:
+//   for i, j, cols, emoji in graphemes(str) do print(str:sub(i, j)) end
+static int l_tb_graphemes(lua_State *L) {
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+
+  luaL_checkstring(L, 1);
+  luaL_argcheck(L, i > 0, 2, "position must be positive");
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, i - 1);
+  lua_pushcclosure(L, graphemes_next, 2);
+  return 1;
+}
+
+// grapheme_count(str) -> clusters, cols, emojis
+static int l_tb_grapheme_count(lua_State *L) {
+  size_t len, i = 0;
+  const char * str = luaL_checklstring(L, 1, &len);
+  int count = 0, cols = 0, emojis = 0;
+  struct cluster c;
+
+  while (i < len) {
+    i = next_cluster(str, len, i, &c);
+    count++;
+    cols += c.cols;
+    emojis += c.emoji;
+  }
+
+  lua_pushinteger(L, count);
+  lua_pushinteger(L, cols);
+  lua_pushinteger(L, emojis);
+  return 3;
+}
+
+// byte offset where cluster n (from 0) starts, or len if there aren't that
+// many. if count is given, it's set to the number of clusters skipped.
+static size_t cluster_offset(const char *str, size_t len, lua_Integer n, lua_Integer *count) {
+  size_t i = 0;
+  lua_Integer skipped = 0;
+  struct cluster c;
+
+  for (; i < len && skipped < n; skipped++) i = next_cluster(str, len, i, &c);
+  if (count) *count = skipped;
+  return i;
+}
+
+// grapheme_sub(str, i [, j]) -> the clusters from i to j, like string.sub
+// does with bytes. negative positions count from the end.
+static int l_tb_grapheme_sub(lua_State *L) {
+  size_t len, from, to;
+  const char * str = luaL_checklstring(L, 1, &len);
+  lua_Integer i = luaL_checkinteger(L, 2), j = luaL_optinteger(L, 3, -1), count = 0;
+
+  if (i < 0 || j < 0) cluster_offset(str, len, (lua_Integer)len, &count);
+  if (i < 0) i = count + i + 1;
+  if (j < 0) j = count + j + 1;
+  if (i < 1) i = 1;
+  if (j < i) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+
+  from = cluster_offset(str, len, i - 1, NULL);
+  to = from + cluster_offset(str + from, len - from, j - i + 1, NULL);
+  lua_pushlstring(L, str + from, to - from);
+  return 1;
+}
+
+// is_emoji(cp) -> whether codepoint cp is a pictograph or regional indicator
+static int l_tb_is_emoji(lua_State *L) {
+  uint8_t p = char_props(luaL_checkinteger(L, 1));
+
+  lua_pushboolean(L, (p & PROP_PICTOGRAPH) || PROP_BREAK(p) == GB_RI);
+  return 1;
+}
+
+///////////////////
+// normalization
+
+// canonical composition and decomposition (nfc and nfd), with the tables in
+// unicode_tables.h. hangul syllables are worked out instead of looked up.
+
+#define HANGUL_S_BASE  0xAC00
+#define HANGUL_L_BASE  0x1100
+#define HANGUL_V_BASE  0x1161
+#define HANGUL_T_BASE  0x11A7
+#define HANGUL_L_COUNT 19
+#define HANGUL_V_COUNT 21
+#define HANGUL_T_COUNT 28
+#define HANGUL_N_COUNT (HANGUL_V_COUNT * HANGUL_T_COUNT)
+#define HANGUL_S_COUNT (HANGUL_L_COUNT * HANGUL_N_COUNT)
+
+// decodes the utf-8 sequence at s + i, returning its length, or 0 if it's
+// broken, overlong, a surrogate or past U+10FFFF
+static int decode_strict(const unsigned char *s, size_t len, size_t i, uint32_t *ch) {
+  uint32_t min;
+  int n, k;
+
+  if (s[i] < 0x80) { *ch = s[i]; return 1; }
+  else if (s[i] >= 0xC2 && s[i] <= 0xDF) { n = 2; min = 0x80; *ch = s[i] & 0x1F; }
+  else if (s[i] >= 0xE0 && s[i] <= 0xEF) { n = 3; min = 0x800; *ch = s[i] & 0x0F; }
+  else if (s[i] >= 0xF0 && s[i] <= 0xF4) { n = 4; min = 0x10000; *ch = s[i] & 0x07; }
+  else return 0;
+
+  if (i + n > len) return 0;
+  for (k = 1; k < n; k++) {
+    if ((s[i + k] & 0xC0) != 0x80) return 0;
+    *ch = (*ch << 6) | (s[i + k] & 0x3F);
+  }
+
+  if (*ch < min || *ch > 0x10FFFF || (*ch >= 0xD800 && *ch <= 0xDFFF)) return 0;
+  return n;
+}
+
+// appends the full canonical decomposition of ch to out, returning its length
+static int decompose_char(uint32_t ch, uint32_t *out) {
+  int lo = 0, hi = RANGE_COUNT(decompositions) - 1, mid;
+
+  if (ch >= HANGUL_S_BASE && ch < HANGUL_S_BASE + HANGUL_S_COUNT) {
+    uint32_t s = ch - HANGUL_S_BASE, t = s % HANGUL_T_COUNT;
+    out[0] = HANGUL_L_BASE + s / HANGUL_N_COUNT;
+    out[1] = HANGUL_V_BASE + (s % HANGUL_N_COUNT) / HANGUL_T_COUNT;
+    if (t == 0) return 2;
+    out[2] = HANGUL_T_BASE + t;
+    return 3;
+  }
+
+  while (ch >= decompositions[0].cp && lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (ch > decompositions[mid].cp) lo = mid + 1;
+    else if (ch < decompositions[mid].cp) hi = mid - 1;
+    else {
+      memcpy(out, decomposition_data + decompositions[mid].offset, decompositions[mid].len * sizeof(uint32_t));
+      return decompositions[mid].len;
+    }
+  }
+
+  out[0] = ch;
+  return 1;
+}
+
+// the char a and b compose into, or 0 if they don't
+static uint32_t compose_pair(uint32_t a, uint32_t b) {
+  int lo = 0, hi = RANGE_COUNT(compositions) - 1, mid;
+
+  if (a >= HANGUL_L_BASE && a < HANGUL_L_BASE + HANGUL_L_COUNT
+    && b >= HANGUL_V_BASE && b < HANGUL_V_BASE + HANGUL_V_COUNT) {
+    return HANGUL_S_BASE + ((a - HANGUL_L_BASE) * HANGUL_V_COUNT + b - HANGUL_V_BASE) * HANGUL_T_COUNT;
+  }
+
+  if (a >= HANGUL_S_BASE && a < HANGUL_S_BASE + HANGUL_S_COUNT && (a - HANGUL_S_BASE) % HANGUL_T_COUNT == 0
+    && b > HANGUL_T_BASE && b < HANGUL_T_BASE + HANGUL_T_COUNT) {
+    return a + b - HANGUL_T_BASE;
+  }
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (a > compositions[mid].first || (a == compositions[mid].first && b > compositions[mid].second)) lo = mid + 1;
+    else if (a < compositions[mid].first || b < compositions[mid].second) hi = mid - 1;
+    else return compositions[mid].composite;
+  }
+
+  return 0;
+}
+
+// decomposes len bytes of str into chars, in canonical order. returns how
+// many there are, or -1 if str isn't valid utf-8.
+static int decompose_text(const char *str, size_t len, uint32_t *chars) {
+  const unsigned char * s = (const unsigned char *)str;
+  size_t i = 0;
+  int count = 0, k, n, c;
+  uint32_t ch, tmp;
+
+  while (i < len) {
+    if (!(n = decode_strict(s, len, i, &ch))) return -1;
+    count += decompose_char(ch, chars + count);
+    i += n;
+  }
+
+  // marks in a row are sorted by combining class, keeping the order of equal ones
+  for (n = 1; n < count; n++) {
+    if (!(c = combining_class(chars[n]))) continue;
+    for (k = n; k > 0 && combining_class(chars[k - 1]) > c; k--) {
+      tmp = chars[k]; chars[k] = chars[k - 1]; chars[k - 1] = tmp;
+    }
+  }
+
+  return count;
+}
+
+// composes chars in canonical order back in place, returning how many are left
+static int compose_text(uint32_t *chars, int count) {
+  int i, out = 0, starter = -1, last = 0, c;
+  uint32_t composed;
+
+  for (i = 0; i < count; i++) {
+    c = combining_class(chars[i]);
+
+    // a char right after the starter, or with a higher class than the last
+    // one left in between, may combine with it
+    if (starter >= 0 && (out == starter + 1 || (last != 0 && last < c))
+      && (composed = compose_pair(chars[starter], chars[i]))) {
+      chars[starter] = composed;
+      continue;
+    }
+
+    if (c == 0) starter = out;
+    last = c;
+    chars[out++] = chars[i];
+  }
+
+  return out;
+}
+
+static int normalize(lua_State *L, int compose) {
+  size_t len, i;
+  const char * str = luaL_checklstring(L, 1, &len);
+  uint32_t * chars;
+  char utf8[8];
+  int count;
+
+  if (ascii_run(str, len) == len) { // ascii is already normalized
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  if (len > INT_MAX / DECOMPOSITION_MAX / sizeof(uint32_t)) return luaL_error(L, "string too long");
+  chars = lua_newuserdata(L, len * DECOMPOSITION_MAX * sizeof(uint32_t));
+
+  if ((count = decompose_text(str, len, chars)) < 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  if (compose) count = compose_text(chars, count);
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (i = 0; i < (size_t)count; i++) {
+    luaL_addlstring(&b, utf8, tb_utf8_unicode_to_char(utf8, chars[i]));
+  }
+
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// nfc(str) -> str in normalization form C (composed), or nil if it isn't
+// valid utf-8
+static int l_tb_nfc(lua_State *L) {
+  return normalize(L, 1);
+}
+
+// nfd(str) -> str in normalization form D (decomposed), or nil if it isn't
+// valid utf-8
+static int l_tb_nfd(lua_State *L) {
+  return normalize(L, 0);
+}
+
+///////////////////
+// wrapped line index
+
+// keeps a copy of a text along with the byte offset where each visual row
+// starts when wrapped at a given width. a line ending in a newline breaks
+// there if it fits in width - 1 columns (leaving room for the cursor),
+// otherwise it wraps at width columns.
+struct wrap_index {
+  char *text;
+  size_t len, cap;
+
+  size_t *rows;      // start offset of each row
+  int nrows, rows_cap;
+
+  int width;
+  int tab_width;
+  int stale;         // width changed, rebuild everything on next access
+};
+
+#define WRAP_INDEX "luabox.wrap_index"
+
+static int wrap_reserve(struct wrap_index *idx, size_t len, int nrows) {
+  if (len > idx->cap) {
+    size_t cap = idx->cap ? idx->cap : 256;
+    while (cap < len) cap *= 2;
+    char * text = realloc(idx->text, cap);
+    if (!text) return 0;
+    idx->text = text;
+    idx->cap  = cap;
+  }
+
+  if (nrows > idx->rows_cap) {
+    int cap = idx->rows_cap ? idx->rows_cap : 64;
+    while (cap < nrows) cap *= 2;
+    size_t * rows = realloc(idx->rows, cap * sizeof(size_t));
+    if (!rows) return 0;
+    idx->rows     = rows;
+    idx->rows_cap = cap;
+  }
+
+  return 1;
+}
+
+// returns where the row after the one starting at start begins
+static size_t wrap_next(const char *text, size_t len, size_t start, int width, int tab_width) {
+  const char * nl = memchr(text + start, '\n', len - start);
+  size_t seg_len = (nl ? (size_t)(nl - text) : len) - start;
+  struct text_pos fit = measure_text(text + start, seg_len, width, tab_width);
+
+  if (fit.bytes == seg_len && (!nl || fit.cols < width)) {
+    start += seg_len + (nl ? 1 : 0); // whole line fits, skip its newline
+  } else if (fit.bytes > 0) {
+    start += fit.bytes;
+  } else { // not even one cluster fits, take it anyway to move forward
+    struct cluster c;
+    start = next_cluster(text, start + seg_len, start, &c);
+  }
+
+  return start;
+}
+
+// wraps everything from the start of the last row onwards. appending only
+// ever changes the last row, so everything before it stays as it is.
+static int wrap_update(struct wrap_index *idx) {
+  size_t start;
+
+  if (idx->stale) {
+    idx->nrows = 0;
+    idx->stale = 0;
+  }
+
+  start = idx->nrows > 0 ? idx->rows[--idx->nrows] : 0;
+
+  while (start < idx->len) {
+    if (!wrap_reserve(idx, 0, idx->nrows + 1)) return 0;
+    idx->rows[idx->nrows++] = start;
+    start = wrap_next(idx->text, idx->len, start, idx->width, idx->tab_width);
+  }
+
+  return 1;
+}
+
+static struct wrap_index * check_wrap_index(lua_State *L, int arg) {
+  struct wrap_index * idx = luaL_checkudata(L, arg, WRAP_INDEX);
+  if (idx->stale && !wrap_update(idx)) luaL_error(L, "out of memory");
+  return idx;
+}
+
+static void wrap_append(lua_State *L, struct wrap_index *idx, const char *str, size_t len) {
+  if (!wrap_reserve(idx, idx->len + len, 0)) luaL_error(L, "out of memory");
+  memcpy(idx->text + idx->len, str, len);
+  idx->len += len;
+  if (!wrap_update(idx)) luaL_error(L, "out of memory");
+}
+
+// wrap_index(text, width [, tab_width]) -> index
+static int l_tb_wrap_index(lua_State *L) {
+  size_t len;
+  const char * str = luaL_checklstring(L, 1, &len);
+  int width = luaL_checkinteger(L, 2);
+  int tab_width = check_tab_width(L, 3);
+
+  struct wrap_index * idx = lua_newuserdata(L, sizeof(struct wrap_index));
+  memset(idx, 0, sizeof(struct wrap_index));
+  idx->width = width > 0 ? width : 1;
+  idx->tab_width = tab_width;
+
+  luaL_getmetatable(L, WRAP_INDEX);
+  lua_setmetatable(L, -2);
+
+  wrap_append(L, idx, str, len);
+  return 1;
+}
+
+static int l_wrap_gc(lua_State *L) {
+  struct wrap_index * idx = luaL_checkudata(L, 1, WRAP_INDEX);
+  free(idx->text);
+  free(idx->rows);
+  idx->text = NULL;
+  idx->rows = NULL;
+  return 0;
+}
+
+// index:append(str) rewraps just the last row plus whatever was added
+static int l_wrap_append(lua_State *L) {
+  struct wrap_index * idx = check_wrap_index(L, 1);
+  size_t len;
+  const char * str = luaL_checklstring(L, 2, &len);
+
+  wrap_append(L, idx, str, len);
+  return 0;
+}
+
+static int l_wrap_set_text(lua_State *L) {
+  struct wrap_index * idx = luaL_checkudata(L, 1, WRAP_INDEX);
+  size_t len;
+  const char * str = luaL_checklstring(L, 2, &len);
+
+  idx->len = 0;
+  idx->nrows = 0;
+  idx->stale = 0;
+  wrap_append(L, idx, str, len);
+  return 0;
+}
+
+// index:set_width(width) is cheap: rows are rebuilt on the next query
+static int l_wrap_set_width(lua_State *L) {
+  struct wrap_index * idx = luaL_checkudata(L, 1, WRAP_INDEX);
+  int width = luaL_checkinteger(L, 2);
+  if (width < 1) width = 1;
+
+  if (width != idx->width) {
+    idx->width = width;
+    idx->stale = 1;
+  }
+
+  return 0;
+}
+
+static int l_wrap_rows(lua_State *L) {
+  struct wrap_index * idx = check_wrap_index(L, 1);
+  lua_pushinteger(L, idx->nrows);
+  return 1;
+}
+
+// returns the byte offsets (0 based) where the row starts and ends, not
+// counting the newline that ended it, if any
+static void wrap_row_bounds(struct wrap_index *idx, int row, size_t *start, size_t *stop) {
+  *start = idx->rows[row];
+  *stop  = row + 1 < idx->nrows ? idx->rows[row + 1] : idx->len;
+  if (*stop > *start && idx->text[*stop - 1] == '\n') (*stop)--;
+}
+
+// index:row(n) -> start, stop byte offsets of row n (0 based, stop exclusive)
+static int l_wrap_row(lua_State *L) {
+  struct wrap_index * idx = check_wrap_index(L, 1);
+  int row = luaL_checkinteger(L, 2);
+  size_t start, stop;
+
+  if (row < 0 || row >= idx->nrows) return 0;
+
+  wrap_row_bounds(idx, row, &start, &stop);
+  lua_pushinteger(L, start);
+  lua_pushinteger(L, stop);
+  return 2;
+}
+
+// index:line(n) -> text shown in row n (0 based)
+static int l_wrap_line(lua_State *L) {
+  struct wrap_index * idx = check_wrap_index(L, 1);
+  int row = luaL_checkinteger(L, 2);
+  size_t start, stop;
+
+  if (row < 0 || row >= idx->nrows) return 0;
+
+  wrap_row_bounds(idx, row, &start, &stop);
+  lua_pushlstring(L, idx->text + start, stop - start);
+  return 1;
+}
+
+// index:row_at(offset) -> row containing byte offset (0 based)
+static int l_wrap_row_at(lua_State *L) {
+  struct wrap_index * idx = check_wrap_index(L, 1);
+  lua_Integer offset = luaL_checkinteger(L, 2);
+  int lo = 0, hi = idx->nrows - 1, mid;
+
+  if (idx->nrows == 0 || offset < 0) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+
+  // last row starting at or before offset
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (idx->rows[mid] <= (size_t)offset) lo = mid;
+    else hi = mid - 1;
+  }
+
+  lua_pushinteger(L, lo);
+  return 1;
+}
+
+static int l_wrap_text(lua_State *L) {
+  struct wrap_index * idx = luaL_checkudata(L, 1, WRAP_INDEX);
+  lua_pushlstring(L, idx->text, idx->len);
+  return 1;
+}
+
+static int l_wrap_len(lua_State *L) {
+  struct wrap_index * idx = luaL_checkudata(L, 1, WRAP_INDEX);
+  lua_pushinteger(L, idx->len);
+  return 1;
+}
+
+static const struct luaL_Reg l_wrap_index[] = {
+  {"__gc",      l_wrap_gc},
+  {"append",    l_wrap_append},
+  {"set_text",  l_wrap_set_text},
+  {"set_width", l_wrap_set_width},
+  {"rows",      l_wrap_rows},
+  {"row",       l_wrap_row},
+  {"line",      l_wrap_line},
+  {"row_at",    l_wrap_row_at},
+  {"text",      l_wrap_text},
+  {"len",       l_wrap_len},
+  {NULL, NULL}
+};
+
+///////////////////
+// text buffer
+
+// an editable text kept as a piece table: the text is a sequence of pieces,
+// each a range of an append-only arena, held in a treap ordered by position.
+// every node knows the bytes, chars and newlines in its subtree, so finding
+// a char offset, byte offset or line is O(log n) and an edit cuts at most
+// two pieces. the arena keeps the offset of each newline in it, and the
+// chars before every TEXT_BLOCK bytes, so counting inside a piece (which
+// can be a whole file) never walks more than one block.
+//
+// the rows each line takes when wrapped are kept in a second treap, with a
+// node per line in order, so an edit adds and drops lines where it happened
+// without moving the ones after it.
+//
+// positions are char offsets from 0, like the cursor in EditableTextBox.
+// nothing is ever removed from the arena, so an edit is undone by putting
+// back the pieces it took out: each one is stored as the pieces detached
+// and the number of chars attached in their place, and undo and redo both
+// just swap the two.
+#define TEXT_BUFFER "luabox.text_buffer"
+#define TEXT_BLOCK 1024
+
+struct piece {
+  size_t start, bytes, chars, nls;      // this piece
+  size_t sum_bytes, sum_chars, sum_nls; // its whole subtree
+  unsigned prio;
+  struct piece *left, *right;
+};
+
+struct line_node {
+  int rows;                          // or -1 if not measured yet
+  unsigned prio;
+  size_t lines, sum_rows, unknown;   // its whole subtree
+  struct line_node *left, *right;
+};
+
+struct text_edit {
+  size_t pos;
+  size_t attached;
+  struct piece *detached;
+};
+
+struct text_step {
+  lua_Integer cursor, anchor; // to go back to, anchor is -1 if none
+  struct text_edit *edits;
+  int nedits, cap;
+};
+
+struct step_stack {
+  struct text_step *steps;
+  int count, cap;
+};
+
+struct text_buffer {
+  char *arena;
+  size_t len, cap;
+  size_t *nl;          // offset of each newline in the arena
+  size_t nnl, nl_cap;
+  size_t *blocks;      // chars before each TEXT_BLOCK bytes of the arena
+  size_t blocks_cap;
+
+  struct piece *root;
+  unsigned seed;
+
+  struct step_stack undo, redo;
+  int open;            // edits go into the last undo step
+
+  // rows each line takes when wrapped at width
+  int width, tab_width;
+  struct line_node *line_root;
+
+  char *scratch;       // the line being wrapped
+  size_t scratch_cap;
+  size_t *row_starts;  // and where its rows start
+  int row_starts_cap;
+};
+
+static inline int is_lead_byte(char c) {
+  return (c & 0xC0) != 0x80;
+}
+
+static size_t count_chars(const char *str, size_t len) {
+  size_t i, count = 0;
+  for (i = 0; i < len; i++) count += is_lead_byte(str[i]);
+  return count;
+}
+
+// byte offset of the char k chars into str
+static size_t skip_chars(const char *str, size_t len, size_t k) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if (is_lead_byte(str[i]) && k-- == 0) return i;
+  }
+  return len;
+}
+
+static size_t count_nls(const char *str, size_t len) {
+  const char * end = str + len;
+  size_t count = 0;
+  while ((str = memchr(str, '\n', end - str))) {
+    str++;
+    count++;
+  }
+  return count;
+}
+
+static size_t arena_chars_before(const struct text_buffer *buf, size_t at) {
+  size_t block = at / TEXT_BLOCK;
+  return buf->blocks[block] + count_chars(buf->arena + block * TEXT_BLOCK, at % TEXT_BLOCK);
+}
+
+static size_t arena_nls_before(const struct text_buffer *buf, size_t at) {
+  size_t lo = 0, hi = buf->nnl, mid;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (buf->nl[mid] < at) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// the arena offset k chars after start
+static size_t arena_skip_chars(const struct text_buffer *buf, size_t start, size_t k) {
+  size_t first = arena_chars_before(buf, start), target = first + k;
+  size_t lo = start / TEXT_BLOCK, hi = buf->len / TEXT_BLOCK, mid, at, count;
+
+  // last block with at most target chars before it
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (buf->blocks[mid] <= target) lo = mid;
+    else hi = mid - 1;
+  }
+
+  at = lo * TEXT_BLOCK;
+  count = buf->blocks[lo];
+  if (at < start) {
+    at = start;
+    count = first;
+  }
+
+  for (; at < buf->len; at++) {
+    if (!is_lead_byte(buf->arena[at])) continue;
+    if (count == target) return at;
+    count++;
+  }
+  return buf->len;
+}
+
+static int arena_append(struct text_buffer *buf, const char *str, size_t len) {
+  size_t i, cap, nblocks = (buf->len + len) / TEXT_BLOCK + 1;
+  size_t nls = count_nls(str, len);
+
+  if (buf->len + len > buf->cap) {
+    cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + len) cap *= 2;
+    char * arena = realloc(buf->arena, cap);
+    if (!arena) return 0;
+    buf->arena = arena;
+    buf->cap = cap;
+  }
+
+  if (buf->nnl + nls > buf->nl_cap) {
+    cap = buf->nl_cap ? buf->nl_cap : 256;
+    while (cap < buf->nnl + nls) cap *= 2;
+    size_t * nl = realloc(buf->nl, cap * sizeof(size_t));
+    if (!nl) return 0;
+    buf->nl = nl;
+    buf->nl_cap = cap;
+  }
+
+  if (nblocks > buf->blocks_cap) {
+    cap = buf->blocks_cap ? buf->blocks_cap : 16;
+    while (cap < nblocks) cap *= 2;
+    size_t * blocks = realloc(buf->blocks, cap * sizeof(size_t));
+    if (!blocks) return 0;
+    buf->blocks = blocks;
+    buf->blocks_cap = cap;
+  }
+
+  for (i = 0; i < len; i++) {
+    if (str[i] == '\n') buf->nl[buf->nnl++] = buf->len + i;
+  }
+
+  // blocks up to the one holding the old end are already counted
+  i = buf->len / TEXT_BLOCK + 1;
+  if (buf->len == 0) buf->blocks[0] = 0;
+
+  if (len > 0) memcpy(buf->arena + buf->len, str, len);
+  buf->len += len;
+
+  for (; i < nblocks; i++) {
+    buf->blocks[i] = buf->blocks[i - 1] + count_chars(buf->arena + (i - 1) * TEXT_BLOCK, TEXT_BLOCK);
+  }
+
+  return 1;
+}
+
+static inline size_t sum_chars(const struct piece *p) { return p ? p->sum_chars : 0; }
+static inline size_t sum_bytes(const struct piece *p) { return p ? p->sum_bytes : 0; }
+static inline size_t sum_nls(const struct piece *p)   { return p ? p->sum_nls : 0; }
+
+static void pull(struct piece *p) {
+  p->sum_bytes = p->bytes + sum_bytes(p->left) + sum_bytes(p->right);
+  p->sum_chars = p->chars + sum_chars(p->left) + sum_chars(p->right);
+  p->sum_nls   = p->nls   + sum_nls(p->left)   + sum_nls(p->right);
+}
+
+static void set_piece(const struct text_buffer *buf, struct piece *p, size_t start, size_t bytes) {
+  p->start = start;
+  p->bytes = bytes;
+  p->chars = arena_chars_before(buf, start + bytes) - arena_chars_before(buf, start);
+  p->nls   = arena_nls_before(buf, start + bytes) - arena_nls_before(buf, start);
+  pull(p);
+}
+
+static unsigned next_prio(struct text_buffer *buf) {
+  buf->seed ^= buf->seed << 13; // xorshift
+  buf->seed ^= buf->seed >> 17;
+  buf->seed ^= buf->seed << 5;
+  return buf->seed;
+}
+
+static struct piece * new_piece(struct text_buffer *buf, size_t start, size_t bytes) {
+  struct piece * p = calloc(1, sizeof(struct piece));
+  if (!p) return NULL;
+
+  p->prio = next_prio(buf);
+  set_piece(buf, p, start, bytes);
+  return p;
+}
+
+static void free_pieces(struct piece *p) {
+  if (!p) return;
+  free_pieces(p->left);
+  free_pieces(p->right);
+  free(p);
+}
+
+static struct piece * merge_pieces(struct piece *a, struct piece *b) {
+  if (!a) return b;
+  if (!b) return a;
+
+  if (a->prio > b->prio) {
+    a->right = merge_pieces(a->right, b);
+    pull(a);
+    return a;
+  }
+
+  b->left = merge_pieces(a, b->left);
+  pull(b);
+  return b;
+}
+
+// splits t into its first k chars and the rest, cutting the piece k falls
+// in if needed. returns 0 if out of memory, in which case l and r still
+// hold everything in order, only not split at k.
+static int split_pieces(struct text_buffer *buf, struct piece *t, size_t k, struct piece **l, struct piece **r) {
+  struct piece * tail;
+  size_t left, at;
+  int ok;
+
+  if (!t) {
+    *l = *r = NULL;
+    return 1;
+  }
+
+  left = sum_chars(t->left);
+  if (k <= left) {
+    ok = split_pieces(buf, t->left, k, l, &t->left);
+    pull(t);
+    *r = t;
+    return ok;
+  }
+
+  if (k >= left + t->chars) {
+    ok = split_pieces(buf, t->right, k - left - t->chars, &t->right, r);
+    pull(t);
+    *l = t;
+    return ok;
+  }
+
+  at = arena_skip_chars(buf, t->start, k - left);
+  tail = new_piece(buf, at, t->start + t->bytes - at);
+  if (!tail) {
+    *l = t;
+    *r = NULL;
+    return 0;
+  }
+
+  *r = merge_pieces(tail, t->right);
+  t->right = NULL;
+  set_piece(buf, t, t->start, at - t->start);
+  *l = t;
+  return 1;
+}
+
+// grows the piece ending at pos by bytes just appended to the arena, if it
+// was the last thing there. typing goes through here, so a run of keys
+// makes a single piece instead of one per key.
+static int extend_piece(struct piece *t, size_t pos, size_t end, size_t bytes, size_t chars, size_t nls) {
+  size_t left;
+  int found;
+
+  if (!t) return 0;
+
+  left = sum_chars(t->left);
+  if (pos <= left) {
+    found = extend_piece(t->left, pos, end, bytes, chars, nls);
+  } else if (pos > left + t->chars) {
+    found = extend_piece(t->right, pos - left - t->chars, end, bytes, chars, nls);
+  } else if (pos == left + t->chars && t->start + t->bytes == end) {
+    t->bytes += bytes;
+    t->chars += chars;
+    t->nls += nls;
+    found = 1;
+  } else {
+    found = 0;
+  }
+
+  if (found) pull(t);
+  return found;
+}
+
+static size_t text_chars(const struct text_buffer *buf) {
+  return sum_chars(buf->root);
+}
+
+static size_t text_lines(const struct text_buffer *buf) {
+  return sum_nls(buf->root) + 1;
+}
+
+// byte offset of char pos
+static size_t byte_of_pos(const struct text_buffer *buf, size_t pos) {
+  const struct piece * t = buf->root;
+  size_t bytes = 0, left;
+
+  while (t) {
+    left = sum_chars(t->left);
+    if (pos < left) {
+      t = t->left;
+      continue;
+    }
+
+    pos -= left;
+    bytes += sum_bytes(t->left);
+    if (pos <= t->chars) return bytes + arena_skip_chars(buf, t->start, pos) - t->start;
+
+    pos -= t->chars;
+    bytes += t->bytes;
+    t = t->right;
+  }
+
+  return bytes;
+}
+
+// char offset of the char byte offset at falls in
+static size_t pos_of_byte(const struct text_buffer *buf, size_t at) {
+  const struct piece * t = buf->root;
+  size_t chars = 0, left;
+
+  while (t) {
+    left = sum_bytes(t->left);
+    if (at < left) {
+      t = t->left;
+      continue;
+    }
+
+    at -= left;
+    chars += sum_chars(t->left);
+    if (at <= t->bytes) {
+      return chars + arena_chars_before(buf, t->start + at) - arena_chars_before(buf, t->start)
+        - (at < t->bytes && !is_lead_byte(buf->arena[t->start + at]));
+    }
+
+    at -= t->bytes;
+    chars += t->chars;
+    t = t->right;
+  }
+
+  return chars;
+}
+
+// the line (from 0) char pos is in
+static size_t line_of_pos(const struct text_buffer *buf, size_t pos) {
+  const struct piece * t = buf->root;
+  size_t nls = 0, left, at;
+
+  while (t) {
+    left = sum_chars(t->left);
+    if (pos < left) {
+      t = t->left;
+      continue;
+    }
+
+    pos -= left;
+    nls += sum_nls(t->left);
+    if (pos <= t->chars) {
+      at = arena_skip_chars(buf, t->start, pos);
+      return nls + arena_nls_before(buf, at) - arena_nls_before(buf, t->start);
+    }
+
+    pos -= t->chars;
+    nls += t->nls;
+    t = t->right;
+  }
+
+  return nls;
+}
+
+// char and byte offsets where line starts, or where the text ends if there
+// aren't that many lines
+static void line_start(const struct text_buffer *buf, size_t line, size_t *pos, size_t *byte) {
+  const struct piece * t = buf->root;
+  size_t chars = 0, bytes = 0, at;
+
+  if (line >= text_lines(buf)) {
+    *pos = text_chars(buf);
+    *byte = sum_bytes(buf->root);
+    return;
+  }
+
+  while (t && line > 0) {
+    if (line <= sum_nls(t->left)) {
+      t = t->left;
+      continue;
+    }
+
+    line -= sum_nls(t->left);
+    chars += sum_chars(t->left);
+    bytes += sum_bytes(t->left);
+
+    if (line <= t->nls) { // right after a newline in this piece
+      at = buf->nl[arena_nls_before(buf, t->start) + line - 1] + 1;
+      chars += arena_chars_before(buf, at) - arena_chars_before(buf, t->start);
+      bytes += at - t->start;
+      break;
+    }
+
+    line -= t->nls;
+    chars += t->chars;
+    bytes += t->bytes;
+    t = t->right;
+  }
+
+  *pos = chars;
+  *byte = bytes;
+}
+
+// same as line_start, in bytes only, which saves counting chars
+static size_t line_byte(const struct text_buffer *buf, size_t line) {
+  const struct piece * t = buf->root;
+  size_t bytes = 0;
+
+  if (line >= text_lines(buf)) return sum_bytes(buf->root);
+
+  while (t && line > 0) {
+    if (line <= sum_nls(t->left)) {
+      t = t->left;
+      continue;
+    }
+
+    line -= sum_nls(t->left);
+    bytes += sum_bytes(t->left);
+    if (line <= t->nls) return bytes + buf->nl[arena_nls_before(buf, t->start) + line - 1] + 1 - t->start;
+
+    line -= t->nls;
+    bytes += t->bytes;
+    t = t->right;
+  }
+
+  return bytes;
+}
+
+// copies bytes from..to of the text in t to out
+static void copy_pieces(const struct text_buffer *buf, const struct piece *t, size_t from, size_t to, char *out) {
+  size_t left, end, start, stop;
+
+  if (!t || from >= to) return;
+
+  left = sum_bytes(t->left);
+  end = left + t->bytes;
+  if (from < left) copy_pieces(buf, t->left, from, to < left ? to : left, out);
+
+  start = from > left ? from : left;
+  stop = to < end ? to : end;
+  if (start < stop) memcpy(out + start - from, buf->arena + t->start + start - left, stop - start);
+
+  if (to > end) {
+    copy_pieces(buf, t->right, from > end ? from - end : 0, to - end, out + (from > end ? 0 : end - from));
+  }
+}
+
+// looks in t for a byte set in set: the first one from byte from on, or
+// the last one before it if back is set. offsets are from the start of t.
+static int scan_pieces(const struct text_buffer *buf, const struct piece *t, size_t from, int back, const char *set, size_t *at) {
+  size_t left, end, i;
+
+  if (!t) return 0;
+
+  left = sum_bytes(t->left);
+  end = left + t->bytes;
+
+  if (!back) {
+    if (from < left && scan_pieces(buf, t->left, from, back, set, at)) return 1;
+    for (i = from > left ? from - left : 0; i < t->bytes; i++) {
+      if (set[(unsigned char)buf->arena[t->start + i]]) {
+        *at = left + i;
+        return 1;
+      }
+    }
+    if (scan_pieces(buf, t->right, from > end ? from - end : 0, back, set, at)) {
+      *at += end;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (from > end && scan_pieces(buf, t->right, from - end, back, set, at)) {
+    *at += end;
+    return 1;
+  }
+  for (i = from < end ? (from > left ? from - left : 0) : t->bytes; i-- > 0; ) {
+    if (set[(unsigned char)buf->arena[t->start + i]]) {
+      *at = left + i;
+      return 1;
+    }
+  }
+  return from > 0 && scan_pieces(buf, t->left, from < left ? from : left, back, set, at);
+}
+
+static char * buffer_scratch(struct text_buffer *buf, size_t len) {
+  if (len > buf->scratch_cap) {
+    size_t cap = buf->scratch_cap ? buf->scratch_cap : 256;
+    while (cap < len) cap *= 2;
+    char * scratch = realloc(buf->scratch, cap);
+    if (!scratch) return NULL;
+    buf->scratch = scratch;
+    buf->scratch_cap = cap;
+  }
+  return buf->scratch;
+}
+
+static void push_range(lua_State *L, struct text_buffer *buf, size_t from, size_t to) {
+  char * out = buffer_scratch(buf, to - from);
+  if (!out && to > from) luaL_error(L, "out of memory");
+  copy_pieces(buf, buf->root, from, to, out);
+  lua_pushlstring(L, out, to - from);
+}
+
+static int wrap_width(const struct text_buffer *buf) {
+  return buf->width > 0 ? buf->width : INT_MAX;
+}
+
+// copies line to the scratch buffer, newline included, and finds where
+// each of its rows starts. returns the number of rows, at least one, or 0
+// if out of memory.
+static int try_wrap_line(struct text_buffer *buf, size_t line, size_t *len) {
+  size_t from = line_byte(buf, line), to = line_byte(buf, line + 1), start = 0;
+  int nrows = 0;
+  char * text;
+
+  *len = to - from;
+
+  text = buffer_scratch(buf, *len);
+  if (!text && *len > 0) return 0;
+  copy_pieces(buf, buf->root, from, to, text);
+
+  do {
+    if (nrows == buf->row_starts_cap) {
+      int cap = buf->row_starts_cap ? buf->row_starts_cap * 2 : 64;
+      size_t * starts = realloc(buf->row_starts, cap * sizeof(size_t));
+      if (!starts) return 0;
+      buf->row_starts = starts;
+      buf->row_starts_cap = cap;
+    }
+
+    buf->row_starts[nrows++] = start;
+    if (start < *len) start = wrap_next(text, *len, start, wrap_width(buf), buf->tab_width);
+  } while (start < *len);
+
+  return nrows;
+}
+
+static int wrap_line(lua_State *L, struct text_buffer *buf, size_t line, size_t *len) {
+  int nrows = try_wrap_line(buf, line, len);
+  if (!nrows) luaL_error(L, "out of memory");
+  return nrows;
+}
+
+static inline size_t node_lines(const struct line_node *n)   { return n ? n->lines : 0; }
+static inline size_t node_rows(const struct line_node *n)    { return n ? n->sum_rows : 0; }
+static inline size_t node_unknown(const struct line_node *n) { return n ? n->unknown : 0; }
+
+static void pull_line(struct line_node *n) {
+  n->lines    = 1 + node_lines(n->left) + node_lines(n->right);
+  n->sum_rows = (n->rows < 0 ? 0 : n->rows) + node_rows(n->left) + node_rows(n->right);
+  n->unknown  = (n->rows < 0) + node_unknown(n->left) + node_unknown(n->right);
+}
+
+static void free_lines(struct line_node *n) {
+  if (!n) return;
+  free_lines(n->left);
+  free_lines(n->right);
+  free(n);
+}
+
+static struct line_node * merge_lines(struct line_node *a, struct line_node *b) {
+  if (!a) return b;
+  if (!b) return a;
+
+  if (a->prio > b->prio) {
+    a->right = merge_lines(a->right, b);
+    pull_line(a);
+    return a;
+  }
+
+  b->left = merge_lines(a, b->left);
+  pull_line(b);
+  return b;
+}
+
+// splits t into its first k lines and the rest
+static void split_lines(struct line_node *t, size_t k, struct line_node **l, struct line_node **r) {
+  if (!t) {
+    *l = *r = NULL;
+  } else if (k <= node_lines(t->left)) {
+    split_lines(t->left, k, l, &t->left);
+    pull_line(t);
+    *r = t;
+  } else {
+    split_lines(t->right, k - node_lines(t->left) - 1, &t->right, r);
+    pull_line(t);
+    *l = t;
+  }
+}
+
+// n lines not measured yet, or NULL if out of memory
+static struct line_node * unknown_lines(struct text_buffer *buf, size_t n) {
+  struct line_node *root = NULL, *node;
+
+  while (n-- > 0) {
+    if (!(node = calloc(1, sizeof(struct line_node)))) {
+      free_lines(root);
+      return NULL;
+    }
+
+    node->rows = -1;
+    node->prio = next_prio(buf);
+    pull_line(node);
+    root = merge_lines(root, node);
+  }
+
+  return root;
+}
+
+static void forget_rows(struct line_node *n) {
+  if (!n) return;
+  forget_rows(n->left);
+  forget_rows(n->right);
+  n->rows = -1;
+  pull_line(n);
+}
+
+static void set_line_rows(struct line_node *t, size_t line, int rows) {
+  size_t left = node_lines(t->left);
+
+  if (line < left) set_line_rows(t->left, line, rows);
+  else if (line > left) set_line_rows(t->right, line - left - 1, rows);
+  else t->rows = rows;
+
+  pull_line(t);
+}
+
+// the first line not measured yet, or the number of lines if there's none
+static size_t first_unknown(const struct line_node *t) {
+  size_t line = 0;
+
+  while (t) {
+    if (node_unknown(t->left) > 0) {
+      t = t->left;
+      continue;
+    }
+
+    line += node_lines(t->left);
+    if (t->rows < 0) return line;
+    line++;
+    t = t->right;
+  }
+
+  return line;
+}
+
+// rows of the lines before line, which have to be measured already
+static size_t prefix_rows(const struct line_node *t, size_t line) {
+  size_t rows = 0, left;
+
+  while (t) {
+    left = node_lines(t->left);
+    if (line <= left) {
+      t = t->left;
+      continue;
+    }
+
+    rows += node_rows(t->left) + t->rows;
+    line -= left + 1;
+    t = t->right;
+  }
+
+  return rows;
+}
+
+// measures the lines in t before line stop that weren't yet, first being
+// t's first line. returns 0 if out of memory, leaving the rest unknown.
+static int measure_lines(struct text_buffer *buf, struct line_node *t, size_t first, size_t stop) {
+  size_t line, len;
+  int ok, rows;
+
+  if (!t || t->unknown == 0 || first >= stop) return 1;
+
+  line = first + node_lines(t->left);
+  ok = measure_lines(buf, t->left, first, stop);
+  if (ok && line < stop && t->rows < 0) {
+    if ((rows = try_wrap_line(buf, line, &len)) > 0) t->rows = rows;
+    else ok = 0;
+  }
+  if (ok) ok = measure_lines(buf, t->right, line + 1, stop);
+
+  pull_line(t);
+  return ok;
+}
+
+// lines line..line + removed were replaced by the ones in added, which are
+// all unknown. they're made before the edit, as nothing can fail after it.
+static void replace_lines(struct text_buffer *buf, size_t line, size_t removed, struct line_node *added) {
+  struct line_node *l, *mid, *r;
+
+  split_lines(buf->line_root, line, &l, &r);
+  split_lines(r, removed + 1, &mid, &r);
+  free_lines(mid);
+  buf->line_root = merge_lines(merge_lines(l, added), r);
+}
+
+// rows before line, measuring the lines before it that weren't yet
+static size_t rows_before(lua_State *L, struct text_buffer *buf, size_t line) {
+  if (!measure_lines(buf, buf->line_root, 0, line)) luaL_error(L, "out of memory");
+  return prefix_rows(buf->line_root, line);
+}
+
+// the line row is in, with the rows before it in *before. past the end,
+// the last line.
+static size_t line_at_row(lua_State *L, struct text_buffer *buf, size_t row, size_t *before) {
+  const struct line_node * t = buf->line_root;
+  size_t unknown, line = 0, left, more = 64;
+
+  // measure lines in order, twice as many each time, until they reach row
+  // or there are no more
+  while ((unknown = first_unknown(buf->line_root)) < text_lines(buf) &&
+         prefix_rows(buf->line_root, unknown) <= row) {
+    if (!measure_lines(buf, buf->line_root, 0, unknown + more)) luaL_error(L, "out of memory");
+    more *= 2;
+  }
+
+  if (row >= prefix_rows(buf->line_root, unknown)) {
+    line = text_lines(buf) - 1;
+    *before = prefix_rows(buf->line_root, line);
+    return line;
+  }
+
+  // every line up to the one row is in is measured now
+  *before = 0;
+  while (t) {
+    left = node_rows(t->left);
+    if (row < left) {
+      t = t->left;
+      continue;
+    }
+
+    line += node_lines(t->left);
+    *before += left;
+    row -= left;
+    if (row < (size_t)t->rows) break;
+
+    line++;
+    *before += t->rows;
+    row -= t->rows;
+    t = t->right;
+  }
+
+  return line;
+}
+
+// end of row i of the line in scratch, not counting its newline
+static size_t row_end(const struct text_buffer *buf, int i, int nrows, size_t len) {
+  size_t end = i + 1 < nrows ? buf->row_starts[i + 1] : len;
+  if (end > buf->row_starts[i] && buf->scratch[end - 1] == '\n') end--;
+  return end;
+}
+
+static struct text_step * push_step(struct step_stack *stack) {
+  if (stack->count == stack->cap) {
+    int cap = stack->cap ? stack->cap * 2 : 64;
+    struct text_step * steps = realloc(stack->steps, cap * sizeof(struct text_step));
+    if (!steps) return NULL;
+    stack->steps = steps;
+    stack->cap = cap;
+  }
+
+  struct text_step * step = &stack->steps[stack->count++];
+  memset(step, 0, sizeof(struct text_step));
+  return step;
+}
+
+static void free_step(struct text_step *step) {
+  int i;
+  for (i = 0; i < step->nedits; i++) free_pieces(step->edits[i].detached);
+  free(step->edits);
+}
+
+static void clear_steps(struct step_stack *stack) {
+  while (stack->count > 0) free_step(&stack->steps[--stack->count]);
+}
+
+static void free_text_buffer(struct text_buffer *buf) {
+  clear_steps(&buf->undo);
+  clear_steps(&buf->redo);
+  free(buf->undo.steps);
+  free(buf->redo.steps);
+  free_pieces(buf->root);
+  free(buf->arena);
+  free(buf->nl);
+  free(buf->blocks);
+  free_lines(buf->line_root);
+  free(buf->scratch);
+  free(buf->row_starts);
+  memset(buf, 0, sizeof(struct text_buffer));
+}
+
+// makes room for one more edit in the open undo step, opening a new one if
+// there isn't any. nothing else can fail once the text has changed.
+static struct text_step * undo_step(struct text_buffer *buf, size_t pos) {
+  struct text_step * step;
+
+  if (!buf->open) {
+    step = push_step(&buf->undo);
+    if (!step) return NULL;
+    step->cursor = pos;
+    step->anchor = -1;
+    buf->open = 1;
+  }
+
+  step = &buf->undo.steps[buf->undo.count - 1];
+  if (step->nedits == step->cap) {
+    int cap = step->cap ? step->cap * 2 : 4;
+    struct text_edit * edits = realloc(step->edits, cap * sizeof(struct text_edit));
+    if (!edits) return NULL;
+    step->edits = edits;
+    step->cap = cap;
+  }
+
+  return step;
+}
+
+// puts pieces where the n chars at pos were and returns those in *out.
+// returns 0 if out of memory, leaving the text as it was.
+static int replace_range(struct text_buffer *buf, size_t pos, size_t n, struct piece *pieces, struct piece **out) {
+  struct piece *l, *mid, *r;
+  struct line_node * lines = unknown_lines(buf, sum_nls(pieces) + 1);
+  size_t line = line_of_pos(buf, pos);
+
+  if (!lines) return 0;
+
+  if (!split_pieces(buf, buf->root, pos, &l, &r)) {
+    buf->root = merge_pieces(l, r);
+    free_lines(lines);
+    return 0;
+  }
+
+  if (!split_pieces(buf, r, n, &mid, &r)) {
+    buf->root = merge_pieces(merge_pieces(l, mid), r);
+    free_lines(lines);
+    return 0;
+  }
+
+  buf->root = merge_pieces(merge_pieces(l, pieces), r);
+  replace_lines(buf, line, sum_nls(mid), lines);
+  *out = mid;
+  return 1;
+}
+
+// swaps what an edit attached for what it detached, undoing or redoing it
+static int swap_edit(struct text_buffer *buf, struct text_edit *edit) {
+  struct piece * mid;
+  size_t chars = sum_chars(edit->detached);
+  if (!replace_range(buf, edit->pos, edit->attached, edit->detached, &mid)) return 0;
+  edit->attached = chars;
+  edit->detached = mid;
+  return 1;
+}
+
+static void text_insert(lua_State *L, struct text_buffer *buf, size_t pos, const char *str, size_t len) {
+  struct text_step * step = undo_step(buf, pos);
+  struct piece *p, *none;
+  size_t end = buf->len, chars = count_chars(str, len), nls = count_nls(str, len);
+
+  if (!step || !arena_append(buf, str, len)) luaL_error(L, "out of memory");
+
+  if (nls == 0 && extend_piece(buf->root, pos, end, len, chars, 0)) {
+    set_line_rows(buf->line_root, line_of_pos(buf, pos), -1);
+  } else {
+    p = new_piece(buf, end, len);
+    if (!p || !replace_range(buf, pos, 0, p, &none)) {
+      free(p);
+      luaL_error(L, "out of memory");
+    }
+  }
+
+  step->edits[step->nedits++] = (struct text_edit){ pos, chars, NULL };
+  clear_steps(&buf->redo);
+}
+
+static void text_delete(lua_State *L, struct text_buffer *buf, size_t pos, size_t n) {
+  struct text_step * step = undo_step(buf, pos);
+  struct piece * removed;
+
+  if (!step || !replace_range(buf, pos, n, NULL, &removed)) luaL_error(L, "out of memory");
+
+  step->edits[step->nedits++] = (struct text_edit){ pos, 0, removed };
+  clear_steps(&buf->redo);
+}
+
+static struct text_buffer * check_text_buffer(lua_State *L, int arg) {
+  return luaL_checkudata(L, arg, TEXT_BUFFER);
+}
+
+static size_t check_pos(lua_State *L, struct text_buffer *buf, int arg) {
+  lua_Integer pos = luaL_checkinteger(L, arg);
+  if (pos < 0) return 0;
+  if ((size_t)pos > text_chars(buf)) return text_chars(buf);
+  return pos;
+}
+
+// text_buffer([text [, width [, tab_width]]]) -> buffer, wrapping rows at
+// width columns, or not at all if width is missing
+static int l_tb_text_buffer(lua_State *L) {
+  size_t len = 0;
+  const char * str = luaL_optlstring(L, 1, "", &len);
+  int width = luaL_optinteger(L, 2, 0);
+  int tab_width = check_tab_width(L, 3);
+  struct piece * p;
+
+  struct text_buffer * buf = lua_newuserdata(L, sizeof(struct text_buffer));
+  memset(buf, 0, sizeof(struct text_buffer));
+  buf->seed = 2463534242u;
+  buf->width = width > 0 ? width : 0;
+  buf->tab_width = tab_width;
+  luaL_getmetatable(L, TEXT_BUFFER);
+  lua_setmetatable(L, -2);
+
+  if (!arena_append(buf, str, len)) luaL_error(L, "out of memory");
+  if (len > 0) {
+    p = new_piece(buf, 0, len);
+    if (!p) luaL_error(L, "out of memory");
+    buf->root = p;
+  }
+
+  if (!(buf->line_root = unknown_lines(buf, text_lines(buf)))) luaL_error(L, "out of memory");
+  return 1;
+}
+
+static int l_text_gc(lua_State *L) {
+  free_text_buffer(check_text_buffer(L, 1));
+  return 0;
+}
+
+// buffer:insert(pos, str) -> chars inserted
+static int l_text_insert(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  size_t pos = check_pos(L, buf, 2), len;
+  const char * str = luaL_checklstring(L, 3, &len);
+
+  if (len > 0) text_insert(L, buf, pos, str, len);
+  lua_pushinteger(L, count_chars(str, len));
+  return 1;
+}
+
+// buffer:delete(pos, n) -> chars deleted, which is fewer than n near the end
+static int l_text_delete(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  size_t pos = check_pos(L, buf, 2);
+  lua_Integer n = luaL_checkinteger(L, 3);
+
+  if (n < 0) n = 0;
+  if ((size_t)n > text_chars(buf) - pos) n = text_chars(buf) - pos;
+
+  if (n > 0) text_delete(L, buf, pos, n);
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+static int l_text_chars(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_pushinteger(L, text_chars(buf));
+  return 1;
+}
+
+static int l_text_bytes(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_pushinteger(L, sum_bytes(buf->root));
+  return 1;
+}
+
+static int l_text_lines(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_pushinteger(L, text_lines(buf));
+  return 1;
+}
+
+static int l_text_text(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  push_range(L, buf, 0, sum_bytes(buf->root));
+  return 1;
+}
+
+// buffer:sub(from, to) -> text between char offsets from and to
+static int l_text_sub(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  size_t from = check_pos(L, buf, 2), to = check_pos(L, buf, 3);
+
+  if (to < from) to = from;
+  push_range(L, buf, byte_of_pos(buf, from), byte_of_pos(buf, to));
+  return 1;
+}
+
+// buffer:char_at(pos) -> the char right after pos, or '' at the end
+static int l_text_char_at(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_Integer pos = luaL_checkinteger(L, 2);
+
+  if (pos < 0 || (size_t)pos >= text_chars(buf)) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+
+  push_range(L, buf, byte_of_pos(buf, pos), byte_of_pos(buf, pos + 1));
+  return 1;
+}
+
+// buffer:byte_offset(pos) -> bytes before char pos
+static int l_text_byte_offset(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_pushinteger(L, byte_of_pos(buf, check_pos(L, buf, 2)));
+  return 1;
+}
+
+// buffer:char_offset(byte) -> chars before the one byte falls in
+static int l_text_char_offset(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_Integer at = luaL_checkinteger(L, 2);
+  lua_pushinteger(L, pos_of_byte(buf, at < 0 ? 0 : at));
+  return 1;
+}
+
+// buffer:line_of(pos) -> line, col (in chars), both from 0
+static int l_text_line_of(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  size_t pos = check_pos(L, buf, 2), line = line_of_pos(buf, pos), start, byte;
+
+  line_start(buf, line, &start, &byte);
+  lua_pushinteger(L, line);
+  lua_pushinteger(L, pos - start);
+  return 2;
+}
+
+// buffer:line_start(line) -> pos where line starts, or where the text ends
+static int l_text_line_start(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_Integer line = luaL_checkinteger(L, 2);
+  size_t pos, byte;
+
+  line_start(buf, line < 0 ? 0 : line, &pos, &byte);
+  lua_pushinteger(L, pos);
+  return 1;
+}
+
+// buffer:line_end(line) -> pos right before the newline ending line
+static int l_text_line_end(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_Integer line = luaL_checkinteger(L, 2);
+  size_t pos, byte;
+
+  if (line < 0) line = 0;
+  line_start(buf, line + 1, &pos, &byte);
+  lua_pushinteger(L, (size_t)line + 1 < text_lines(buf) ? pos - 1 : pos);
+  return 1;
+}
+
+// buffer:line(n) -> text of line n, without its newline
+static int l_text_line(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_Integer line = luaL_checkinteger(L, 2);
+  size_t pos, from, to;
+
+  if (line < 0 || (size_t)line >= text_lines(buf)) return 0;
+
+  line_start(buf, line, &pos, &from);
+  line_start(buf, line + 1, &pos, &to);
+  if ((size_t)line + 1 < text_lines(buf)) to--;
+  push_range(L, buf, from, to);
+  return 1;
+}
+
+// buffer:find(pos, chars [, back]) -> pos of the first char from pos on
+// that is one of chars, or of the last one before pos if back is true, or
+// nil if there's none. chars are ascii, and a leading ^ matches any char
+// but those instead, as in a lua pattern.
+static int l_text_find(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  size_t pos = check_pos(L, buf, 2), len, i, at;
+  const char * chars = luaL_checklstring(L, 3, &len);
+  int back = lua_toboolean(L, 4), negate = len > 0 && chars[0] == '^';
+  char set[256];
+
+  memset(set, negate, sizeof(set));
+  for (i = negate; i < len; i++) {
+    luaL_argcheck(L, (unsigned char)chars[i] < 0x80, 3, "chars must be ascii");
+    set[(unsigned char)chars[i]] = !negate;
+  }
+
+  // ascii bytes are never part of another char, and with ^ the lead byte
+  // of a multibyte one matches going forward, or any of them going back
+  if (!scan_pieces(buf, buf->root, byte_of_pos(buf, pos), back, set, &at)) return 0;
+  lua_pushinteger(L, pos_of_byte(buf, at));
+  return 1;
+}
+
+// buffer:checkpoint(cursor [, anchor]) starts a new undo step, unless
+// nothing changed since the last one. undoing it brings back the text as it
+// is now, along with cursor and anchor.
+static int l_text_checkpoint(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_Integer cursor = luaL_checkinteger(L, 2);
+  lua_Integer anchor = luaL_optinteger(L, 3, -1);
+  struct text_step * step = NULL;
+
+  if (buf->open && buf->undo.count > 0 && buf->undo.steps[buf->undo.count - 1].nedits == 0) {
+    step = &buf->undo.steps[buf->undo.count - 1];
+  } else {
+    step = push_step(&buf->undo);
+    if (!step) return luaL_error(L, "out of memory");
+  }
+
+  step->cursor = cursor;
+  step->anchor = anchor;
+  buf->open = 1;
+  return 0;
+}
+
+// undoes or redoes the last step in from, moving it to the other stack with
+// the given cursor and anchor in place of the ones it had
+static int swap_step(lua_State *L, struct text_buffer *buf, struct step_stack *from, struct step_stack *to, int reverse) {
+  lua_Integer cursor = luaL_checkinteger(L, 2);
+  lua_Integer anchor = luaL_optinteger(L, 3, -1);
+  struct text_step step, * dest;
+  int i;
+
+  // checkpoints with nothing after them are just dropped
+  while (from->count > 0 && from->steps[from->count - 1].nedits == 0) {
+    free_step(&from->steps[--from->count]);
+  }
+
+  buf->open = 0;
+  if (from->count == 0) return 0;
+
+  if (!(dest = push_step(to))) return luaL_error(L, "out of memory");
+  to->count--; // only reserved for now
+
+  step = from->steps[--from->count];
+  for (i = 0; i < step.nedits; i++) {
+    if (!swap_edit(buf, &step.edits[reverse ? step.nedits - 1 - i : i])) break;
+  }
+
+  if (i < step.nedits) { // put back what was swapped and leave it there
+    while (i-- > 0) swap_edit(buf, &step.edits[reverse ? step.nedits - 1 - i : i]);
+    from->steps[from->count++] = step;
+    return luaL_error(L, "out of memory");
+  }
+
+  lua_pushinteger(L, step.cursor);
+  if (step.anchor >= 0) lua_pushinteger(L, step.anchor);
+  else lua_pushnil(L);
+
+  step.cursor = cursor;
+  step.anchor = anchor;
+  to->steps[to->count++] = step;
+  return 2;
+}
+
+// buffer:undo(cursor [, anchor]) -> cursor, anchor as they were before the
+// last step, or nothing if there's nothing to undo
+static int l_text_undo(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  return swap_step(L, buf, &buf->undo, &buf->redo, 1);
+}
+
+// buffer:redo(cursor [, anchor]) -> cursor, anchor as they were before the
+// step was undone, or nothing if there's nothing to redo
+static int l_text_redo(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  return swap_step(L, buf, &buf->redo, &buf->undo, 0);
+}
+
+// buffer:history() -> steps that can be undone, steps that can be redone
+static int l_text_history(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  int i, undo = 0;
+  for (i = 0; i < buf->undo.count; i++) undo += buf->undo.steps[i].nedits > 0;
+  lua_pushinteger(L, undo);
+  lua_pushinteger(L, buf->redo.count);
+  return 2;
+}
+
+static int l_text_clear_history(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  clear_steps(&buf->undo);
+  clear_steps(&buf->redo);
+  buf->open = 0;
+  return 0;
+}
+
+// buffer:set_wrap(width [, tab_width]). rows are measured again as needed.
+static int l_text_set_wrap(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  int width = luaL_checkinteger(L, 2);
+  int tab_width = check_tab_width(L, 3);
+
+  if (width < 0) width = 0;
+  if (width != buf->width || tab_width != buf->tab_width) {
+    buf->width = width;
+    buf->tab_width = tab_width;
+    forget_rows(buf->line_root);
+  }
+
+  return 0;
+}
+
+// buffer:rows() -> total rows when wrapped
+static int l_text_rows(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+
+  if (!measure_lines(buf, buf->line_root, 0, text_lines(buf))) return luaL_error(L, "out of memory");
+  lua_pushinteger(L, node_rows(buf->line_root));
+  return 1;
+}
+
+// buffer:rows_at(first, count) -> { text, pos, chars, ... } for up to count
+// rows from row first on, with the pos and length in chars of each. a row
+// ending in a newline doesn't include it.
+static int l_text_rows_at(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_Integer first = luaL_checkinteger(L, 2);
+  lua_Integer count = luaL_checkinteger(L, 3);
+  size_t line, nlines = text_lines(buf), pos, byte, len, start, end, before;
+  int i, nrows, n = 0;
+
+  if (first < 0) first = 0;
+  lua_createtable(L, count > 0 ? count * 3 : 0, 0);
+  if (count <= 0) return 1;
+
+  line = line_at_row(L, buf, first, &before);
+  line_start(buf, line, &pos, &byte);
+  i = first - before;
+
+  for (; line < nlines && n < count; line++, i = 0, pos += count_chars(buf->scratch, len)) {
+    nrows = wrap_line(L, buf, line, &len);
+
+    for (; i < nrows && n < count; i++, n++) {
+      start = buf->row_starts[i];
+      end = row_end(buf, i, nrows, len);
+
+      lua_pushlstring(L, buf->scratch + start, end - start);
+      lua_rawseti(L, -2, n * 3 + 1);
+      lua_pushinteger(L, pos + count_chars(buf->scratch, start));
+      lua_rawseti(L, -2, n * 3 + 2);
+      lua_pushinteger(L, count_chars(buf->scratch + start, end - start));
+      lua_rawseti(L, -2, n * 3 + 3);
+    }
+  }
+
+  return 1;
+}
+
+// buffer:pos_to_row(pos) -> row, col where the char after pos is shown. a
+// pos right where a row wraps is shown at the end of that row.
+static int l_text_pos_to_row(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  size_t pos = check_pos(L, buf, 2), line = line_of_pos(buf, pos);
+  size_t start, byte, len, at, row = rows_before(L, buf, line);
+  int i, nrows = wrap_line(L, buf, line, &len);
+
+  line_start(buf, line, &start, &byte);
+  at = skip_chars(buf->scratch, len, pos - start);
+  for (i = 0; i + 1 < nrows && at > row_end(buf, i, nrows, len); i++);
+
+  lua_pushinteger(L, row + i);
+  lua_pushinteger(L, measure_text(buf->scratch + buf->row_starts[i], at - buf->row_starts[i], -1, buf->tab_width).cols);
+  return 2;
+}
+
+// buffer:row_col_to_pos(row, col) -> pos of the char shown at col in row,
+// or the end of the row if it's shorter. past the last row, the end.
+static int l_text_row_col_to_pos(lua_State *L) {
+  struct text_buffer * buf = check_text_buffer(L, 1);
+  lua_Integer row = luaL_checkinteger(L, 2);
+  lua_Integer col = luaL_checkinteger(L, 3);
+  size_t line, pos, byte, len, start, end, before;
+  int i, nrows;
+
+  if (row < 0) row = 0;
+  line = line_at_row(L, buf, row, &before);
+  i = row - before;
+  nrows = wrap_line(L, buf, line, &len);
+  line_start(buf, line, &pos, &byte);
+
+  if (i >= nrows) {
+    lua_pushinteger(L, text_chars(buf));
+    return 1;
+  }
+
+  start = buf->row_starts[i];
+  end = row_end(buf, i, nrows, len);
+  lua_pushinteger(L, pos + count_chars(buf->scratch, start)
+    + measure_text(buf->scratch + start, end - start, col < 0 ? 0 : col, buf->tab_width).chars);
+  return 1;
+}
+
+static const struct luaL_Reg l_text_buffer[] = {
+  {"__gc",            l_text_gc},
+  {"__len",           l_text_chars},
+  {"insert",          l_text_insert},
+  {"delete",          l_text_delete},
+  {"chars",           l_text_chars},
+  {"bytes",           l_text_bytes},
+  {"lines",           l_text_lines},
+  {"text",            l_text_text},
+  {"sub",             l_text_sub},
+  {"char_at",         l_text_char_at},
+  {"byte_offset",     l_text_byte_offset},
+  {"char_offset",     l_text_char_offset},
+  {"line_of",         l_text_line_of},
+  {"line_start",      l_text_line_start},
+  {"line_end",        l_text_line_end},
+  {"line",            l_text_line},
+  {"find",            l_text_find},
+  {"checkpoint",      l_text_checkpoint},
+  {"undo",            l_text_undo},
+  {"redo",            l_text_redo},
+  {"history",         l_text_history},
+  {"clear_history",   l_text_clear_history},
+  {"set_wrap",        l_text_set_wrap},
+  {"rows",            l_text_rows},
+  {"rows_at",         l_text_rows_at},
+  {"pos_to_row",      l_text_pos_to_row},
+  {"row_col_to_pos",  l_text_row_col_to_pos},
+  {NULL, NULL}
+};
+
+///////////////////
+// bulk cell access
+
+// a grid of cells we can draw into: either the termbox back buffer, which we
+// fetch again on every call since it moves on resize, or a surface's own cells
+struct cellbuf {
+  struct tb_cell *cells;
+  int width;
+  int height;
+  unsigned char *dirty; // row flags, only for the screen
+};
+
+static struct cellbuf screen_buffer(void) {
+  struct cellbuf buf = { tb_cell_buffer(), tb_width(), tb_height(), screen_dirty_rows() };
+  return buf;
+}
+
+// clips the x/y/w/h rect against buf, storing how many columns and rows were
+// cut from the top left corner. returns 0 if nothing is left to draw.
+static int clip_rect(const struct cellbuf *buf, int *x, int *y, int *w, int *h, int *skip_x, int *skip_y) {
+  *skip_x = *x < 0 ? -*x : 0;
+  *skip_y = *y < 0 ? -*y : 0;
+
+  *x += *skip_x; *w -= *skip_x;
+  *y += *skip_y; *h -= *skip_y;
+
+  if (*x + *w > buf->width)  *w = buf->width - *x;
+  if (*y + *h > buf->height) *h = buf->height - *y;
+
+  return buf->cells != NULL && *w > 0 && *h > 0;
+}
+
+static inline void put_cell(struct cellbuf *buf, int x, int y, uint32_t ch, uint32_t fg, uint32_t bg) {
+  if (x < 0 || y < 0 || x >= buf->width || y >= buf->height || !buf->cells) return;
+
+  struct tb_cell * cell = &buf->cells[y * buf->width + x];
+  if (buf->dirty) buf->dirty[y] = 1;
+  cell->ch = ch;
+  cell->fg = fg;
+  cell->bg = bg;
+  stats.cells_written++;
+}
+
+// draws len bytes of utf-8 text at x/y, advancing two columns for wide chars
+// and stopping before a cluster that wouldn't fit within max_cols. a cell
+// holds a single codepoint, so the chars of a cluster that take no room
+// (marks, joined emoji, modifiers) aren't drawn, and a VS16 is drawn as a
+// space. the column after a wide char is left alone, since termbox skips it
+// when rendering. returns the number of columns used.
+static int put_text(struct cellbuf *buf, int x, int y, uint32_t fg, uint32_t bg, const char *str, size_t len, int max_cols) {
+  struct cluster_state st;
+  struct cluster c;
+  int cols = 0, n, w;
+  uint32_t ch;
+  size_t i = 0, end;
+
+  while (i < len && cols < max_cols) {
+    // most text is plain ascii, where every char is a cluster of its own
+    if ((unsigned char)str[i] < 0x80 && (i + 1 == len || (unsigned char)str[i + 1] < 0x80)) {
+      put_cell(buf, x + cols, y, str[i], fg, bg);
+      cols++;
+      i++;
+      continue;
+    }
+
+    end = next_cluster(str, len, i, &c);
+    if (cols + c.cols > max_cols) break;
+
+    st = (struct cluster_state)CLUSTER_START;
+    for (; i < end; i += n) {
+      n = decode_char(str, len, i, &ch);
+      if ((w = cluster_next(&st, ch)) == 0) continue;
+
+      put_cell(buf, x + cols, y, ch == 0xFE0F ? ' ' : ch, fg, bg);
+      cols += w;
+    }
+  }
+
+  return cols;
+}
+
+// writes a w*h rect of cells at x/y. src is either a packed string of
+// struct tb_cell records (as returned by snapshot) or a flat array of
+// {ch, fg, bg, ch, fg, bg, ...} triples, both in row-major order.
+// cells with a nil or zero char are left untouched.
+static int blit_cells(lua_State *L, struct cellbuf *buf, int arg) {
+  int x = luaL_checkinteger(L, arg);
+  int y = luaL_checkinteger(L, arg + 1);
+  int w = luaL_checkinteger(L, arg + 2);
+  int h = luaL_checkinteger(L, arg + 3);
+  int src_w = w, skip_x, skip_y, row, col, written = 0;
+  struct tb_cell cell, *dst;
+
+  luaL_argcheck(L, w >= 0 && h >= 0, arg + 2, "invalid size");
+
+  if (lua_type(L, arg + 4) == LUA_TSTRING) {
+    size_t len;
+    const char * src = lua_tolstring(L, arg + 4, &len);
+    luaL_argcheck(L, len >= (size_t)w * h * sizeof(struct tb_cell), arg + 4, "buffer too short");
+
+    if (clip_rect(buf, &x, &y, &w, &h, &skip_x, &skip_y)) {
+      if (buf->dirty) memset(buf->dirty + y, 1, h);
+      for (row = 0; row < h; row++) {
+        const char * line = src + ((size_t)(row + skip_y) * src_w + skip_x) * sizeof(struct tb_cell);
+        dst = &buf->cells[(y + row) * buf->width + x];
+
+        for (col = 0; col < w; col++) {
+          // strings carry no alignment guarantees, so copy instead of casting
+          memcpy(&cell, line + col * sizeof(struct tb_cell), sizeof(struct tb_cell));
+          if (!cell.ch) continue;
+          dst[col] = cell;
+          written++;
+        }
+      }
+    }
+
+  } else {
+    luaL_checktype(L, arg + 4, LUA_TTABLE);
+
+    if (clip_rect(buf, &x, &y, &w, &h, &skip_x, &skip_y)) {
+      if (buf->dirty) memset(buf->dirty + y, 1, h);
+      for (row = 0; row < h; row++) {
+        int idx = ((row + skip_y) * src_w + skip_x) * 3 + 1;
+        dst = &buf->cells[(y + row) * buf->width + x];
+
+        for (col = 0; col < w; col++, idx += 3) {
+          lua_rawgeti(L, arg + 4, idx);
+          lua_rawgeti(L, arg + 4, idx + 1);
+          lua_rawgeti(L, arg + 4, idx + 2);
+
+          if (lua_type(L, -3) == LUA_TNUMBER) {
+            cell.ch = lua_tointeger(L, -3);
+          } else if (lua_type(L, -3) == LUA_TSTRING) {
+            cell.ch = normalize_char(lua_tostring(L, -3));
+          } else {
+            cell.ch = 0;
+          }
+
+          if (cell.ch) {
+            cell.fg = lua_tointeger(L, -2);
+            cell.bg = lua_tointeger(L, -1);
+            dst[col] = cell;
+            written++;
+          }
+
+          lua_pop(L, 3);
+        }
+      }
+    }
+  }
+
+  stats.cells_written += written;
+  lua_pushinteger(L, written);
+  return 1;
+}
+
+static int l_tb_blit(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return blit_cells(L, &buf, 1);
+}
+
+// copies the w*h rect at sx/sy in src to dx/dy in dst, clipping it to both.
+// src and dst may be the same buffer, even with overlapping rects.
+static void copy_rect(struct cellbuf *dst, int dx, int dy, const struct cellbuf *src, int sx, int sy, int w, int h) {
+  int skip_x, skip_y, row;
+
+  // clip the source first, then the destination, moving both by the same amount
+  if (!clip_rect(src, &sx, &sy, &w, &h, &skip_x, &skip_y)) return;
+  dx += skip_x; dy += skip_y;
+
+  if (!clip_rect(dst, &dx, &dy, &w, &h, &skip_x, &skip_y)) return;
+  sx += skip_x; sy += skip_y;
+
+  if (dst->dirty) memset(dst->dirty + dy, 1, h);
+
+  // walk rows bottom-up when moving down so we don't read what we just wrote
+  for (row = 0; row < h; row++) {
+    int r = (dst == src && dy > sy) ? h - 1 - row : row;
+    memmove(&dst->cells[(dy + r) * dst->width + dx],
+            &src->cells[(sy + r) * src->width + sx],
+            w * sizeof(struct tb_cell));
+  }
+
+  stats.cells_written += w * h;
+}
+
+// copies the x/y/w/h rect to dx/dy. regions may overlap.
+static int copy_cells(lua_State *L, struct cellbuf *buf, int arg) {
+  int x  = luaL_checkinteger(L, arg);
+  int y  = luaL_checkinteger(L, arg + 1);
+  int w  = luaL_checkinteger(L, arg + 2);
+  int h  = luaL_checkinteger(L, arg + 3);
+  int dx = luaL_checkinteger(L, arg + 4);
+  int dy = luaL_checkinteger(L, arg + 5);
+
+  copy_rect(buf, dx, dy, buf, x, y, w, h);
+  return 0;
+}
+
+static int l_tb_copy(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return copy_cells(L, &buf, 1);
+}
+
+// shifts the contents of the x/y/w/h rect up by dy rows (down if dy is
+// negative), filling the rows scrolled into view with spaces in fg/bg.
+static int scroll_cells(lua_State *L, struct cellbuf *buf, int arg) {
+  int x  = luaL_checkinteger(L, arg);
+  int y  = luaL_checkinteger(L, arg + 1);
+  int w  = luaL_checkinteger(L, arg + 2);
+  int h  = luaL_checkinteger(L, arg + 3);
+  int dy = luaL_checkinteger(L, arg + 4);
+  uint32_t fg = luaL_optinteger(L, arg + 5, TB_DEFAULT);
+  uint32_t bg = luaL_optinteger(L, arg + 6, TB_DEFAULT);
+  int skip_x, skip_y, shift, row, col, from, to;
+
+  if (!clip_rect(buf, &x, &y, &w, &h, &skip_x, &skip_y) || dy == 0) return 0;
+
+  shift = dy > 0 ? dy : -dy;
+  if (shift < h) {
+    if (dy > 0) copy_rect(buf, x, y, buf, x, y + shift, w, h - shift);
+    else        copy_rect(buf, x, y + shift, buf, x, y, w, h - shift);
+  } else {
+    shift = h;
+  }
+
+  from = dy > 0 ? y + h - shift : y;
+  to   = from + shift;
+  for (row = from; row < to; row++) {
+    for (col = x; col < x + w; col++) put_cell(buf, col, row, ' ', fg, bg);
+  }
+
+  return 0;
+}
+
+static int l_tb_scroll(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return scroll_cells(L, &buf, 1);
+}
+
+// fills the x/y/w/h rect with ch in fg/bg. the first row is filled cell by
+// cell and copied to the rest, so the stores are as wide as memcpy can make
+// them.
+static void fill_rect(struct cellbuf *buf, int x, int y, int w, int h, uint32_t ch, uint32_t fg, uint32_t bg) {
+  int skip_x, skip_y, row, col;
+  struct tb_cell cell, *first;
+
+  if (!clip_rect(buf, &x, &y, &w, &h, &skip_x, &skip_y)) return;
+
+  cell.ch = ch; cell.fg = fg; cell.bg = bg;
+  first = &buf->cells[y * buf->width + x];
+  for (col = 0; col < w; col++) first[col] = cell;
+  for (row = 1; row < h; row++) memcpy(first + row * buf->width, first, w * sizeof(struct tb_cell));
+
+  if (buf->dirty) memset(buf->dirty + y, 1, h);
+  stats.cells_written += w * h;
+}
+
+// fills the x/y/w/h rect with ch (a space by default) in fg/bg
+static int fill_cells(lua_State *L, struct cellbuf *buf, int arg) {
+  int x = luaL_checkinteger(L, arg);
+  int y = luaL_checkinteger(L, arg + 1);
+  int w = luaL_checkinteger(L, arg + 2);
+  int h = luaL_checkinteger(L, arg + 3);
+  uint32_t ch = lua_isnoneornil(L, arg + 4) ? ' ' : normalize_char(luaL_checkstring(L, arg + 4));
+  uint32_t fg = luaL_optinteger(L, arg + 5, TB_DEFAULT);
+  uint32_t bg = luaL_optinteger(L, arg + 6, TB_DEFAULT);
+
+  fill_rect(buf, x, y, w, h, ch, fg, bg);
+  return 0;
+}
+
+static int l_tb_fill(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return fill_cells(L, &buf, 1);
+}
+
+// box drawing sets, as top left, top, top right, left, right, bottom left,
+// bottom and bottom right
+static const struct {
+  const char *name;
+  uint32_t glyphs[8];
+} border_styles[] = {
+  { "single",  { 0x250c, 0x2500, 0x2510, 0x2502, 0x2502, 0x2514, 0x2500, 0x2518 } },
+  { "double",  { 0x2554, 0x2550, 0x2557, 0x2551, 0x2551, 0x255a, 0x2550, 0x255d } },
+  { "rounded", { 0x256d, 0x2500, 0x256e, 0x2502, 0x2502, 0x2570, 0x2500, 0x256f } },
+  { "heavy",   { 0x250f, 0x2501, 0x2513, 0x2503, 0x2503, 0x2517, 0x2501, 0x251b } },
+  { "block",   { 0x2588, 0x2588, 0x2588, 0x2588, 0x2588, 0x2588, 0x2588, 0x2588 } },
+  { "half",    { 0x2597, 0x2584, 0x2596, 0x2590, 0x258c, 0x259d, 0x2580, 0x2598 } },
+  { "ascii",   { '+', '-', '+', '|', '|', '+', '-', '+' } },
+};
+
+// draws the edges of the x/y/w/h rect, leaving the inside alone
+static void draw_border(struct cellbuf *buf, int x, int y, int w, int h, const uint32_t *glyphs, uint32_t fg, uint32_t bg) {
+  int right = x + w - 1, bottom = y + h - 1;
+
+  if (w <= 0 || h <= 0) return;
+
+  fill_rect(buf, x + 1, y, w - 2, 1, glyphs[1], fg, bg);
+  fill_rect(buf, x, y + 1, 1, h - 2, glyphs[3], fg, bg);
+  put_cell(buf, x, y, glyphs[0], fg, bg);
+
+  if (w > 1) {
+    fill_rect(buf, right, y + 1, 1, h - 2, glyphs[4], fg, bg);
+    put_cell(buf, right, y, glyphs[2], fg, bg);
+  }
+
+  if (h > 1) {
+    fill_rect(buf, x + 1, bottom, w - 2, 1, glyphs[6], fg, bg);
+    put_cell(buf, x, bottom, glyphs[5], fg, bg);
+    if (w > 1) put_cell(buf, right, bottom, glyphs[7], fg, bg);
+  }
+}
+
+// draws a border around the x/y/w/h rect. style is the name of one of the
+// border_styles ("single" by default), or a string with eight chars in the
+// same order as there.
+static int border_cells(lua_State *L, struct cellbuf *buf, int arg) {
+  int x = luaL_checkinteger(L, arg);
+  int y = luaL_checkinteger(L, arg + 1);
+  int w = luaL_checkinteger(L, arg + 2);
+  int h = luaL_checkinteger(L, arg + 3);
+  size_t len, pos = 0;
+  const char * style = luaL_optlstring(L, arg + 4, "single", &len);
+  uint32_t fg = luaL_optinteger(L, arg + 5, TB_DEFAULT);
+  uint32_t bg = luaL_optinteger(L, arg + 6, TB_DEFAULT);
+  uint32_t glyphs[8];
+  int i, n;
+
+  for (i = 0; i < RANGE_COUNT(border_styles); i++) {
+    if (strcmp(style, border_styles[i].name) == 0) {
+      draw_border(buf, x, y, w, h, border_styles[i].glyphs, fg, bg);
+      return 0;
+    }
+  }
+
+  for (i = 0; i < 8 && pos < len; i++) {
+    n = tb_utf8_char_length(style[pos]);
+    if (pos + n > len) break;
+    tb_utf8_char_to_unicode(&glyphs[i], style + pos);
+    pos += n;
+  }
+
+  if (i < 8 || pos < len) return luaL_argerror(L, arg + 4, "unknown border style");
+  draw_border(buf, x, y, w, h, glyphs, fg, bg);
+  return 0;
+}
+
+static int l_tb_border(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return border_cells(L, &buf, 1);
+}
+
+// recolors the x/y/w/h rect with fg/bg, keeping its chars, eg. to dim what's
+// behind a popup or cast a shadow next to it. a nil fg or bg is left as is.
+static int shade_cells(lua_State *L, struct cellbuf *buf, int arg) {
+  int x = luaL_checkinteger(L, arg);
+  int y = luaL_checkinteger(L, arg + 1);
+  int w = luaL_checkinteger(L, arg + 2);
+  int h = luaL_checkinteger(L, arg + 3);
+  int set_fg = !lua_isnoneornil(L, arg + 4);
+  int set_bg = !lua_isnoneornil(L, arg + 5);
+  uint32_t fg = set_fg ? (uint32_t)luaL_checkinteger(L, arg + 4) : 0;
+  uint32_t bg = set_bg ? (uint32_t)luaL_checkinteger(L, arg + 5) : 0;
+  int skip_x, skip_y, row, col;
+  struct tb_cell * cell;
+
+  if (!clip_rect(buf, &x, &y, &w, &h, &skip_x, &skip_y)) return 0;
+
+  for (row = y; row < y + h; row++) {
+    cell = &buf->cells[row * buf->width + x];
+    for (col = 0; col < w; col++, cell++) {
+      if (set_fg) cell->fg = fg;
+      if (set_bg) cell->bg = bg;
+    }
+  }
+
+  if (buf->dirty) memset(buf->dirty + y, 1, h);
+  stats.cells_written += w * h;
+  return 0;
+}
+
+static int l_tb_shade(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return shade_cells(L, &buf, 1);
+}
+
+// returns the x/y/w/h rect as a packed string that can be passed to blit.
+// cells that fall outside the buffer are zeroed, so they're skipped by blit.
+static int snapshot_cells(lua_State *L, struct cellbuf *buf, int arg) {
+  int x = luaL_checkinteger(L, arg);
+  int y = luaL_checkinteger(L, arg + 1);
+  int w = luaL_checkinteger(L, arg + 2);
+  int h = luaL_checkinteger(L, arg + 3);
+  int out_w = w, skip_x, skip_y, row;
+
+  luaL_argcheck(L, w >= 0 && h >= 0, arg + 2, "invalid size");
+
+  size_t size = (size_t)w * h * sizeof(struct tb_cell);
+  struct tb_cell * out = calloc(1, size ? size : 1);
+  if (!out) return luaL_error(L, "out of memory");
+
+  if (clip_rect(buf, &x, &y, &w, &h, &skip_x, &skip_y)) {
+    for (row = 0; row < h; row++) {
+      memcpy(&out[(row + skip_y) * out_w + skip_x],
+             &buf->cells[(y + row) * buf->width + x],
+             w * sizeof(struct tb_cell));
+    }
+  }
+
+  lua_pushlstring(L, (const char *)out, size);
+  free(out);
+  return 1;
+}
+
+static int l_tb_snapshot(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return snapshot_cells(L, &buf, 1);
+}
+
+// draws a list of differently colored text spans left to right, starting at
+// x/y and clipped to max_width columns (or the right edge of the buffer, if
+// max_width is nil or negative). spans is either a flat array of
+// {text, fg, bg, text, fg, bg, ...} or an array of {text, fg, bg} tables.
+// returns the total number of columns used.
+static int draw_runs(lua_State *L, struct cellbuf *buf, int arg) {
+  int x   = luaL_checkinteger(L, arg);
+  int y   = luaL_checkinteger(L, arg + 1);
+  int max = luaL_optinteger(L, arg + 2, -1);
+  luaL_checktype(L, arg + 3, LUA_TTABLE);
+
+  int spans = arg + 3, cols = 0, i, n, nested;
+  size_t len;
+
+  if (max < 0 || max > buf->width - x) max = buf->width - x;
+
+  lua_rawgeti(L, spans, 1);
+  nested = lua_istable(L, -1);
+  lua_pop(L, 1);
+
+  n = luaL_len(L, spans);
+  for (i = 1; i <= n && cols < max; i += nested ? 1 : 3) {
+    if (nested) {
+      lua_rawgeti(L, spans, i);
+      if (!lua_istable(L, -1)) { lua_pop(L, 1); break; }
+      lua_rawgeti(L, -1, 1);
+      lua_rawgeti(L, -2, 2);
+      lua_rawgeti(L, -3, 3);
+    } else {
+      lua_rawgeti(L, spans, i);
+      lua_rawgeti(L, spans, i + 1);
+      lua_rawgeti(L, spans, i + 2);
+    }
+
+    const char * text = lua_tolstring(L, -3, &len);
+    if (text) {
+      cols += put_text(buf, x + cols, y, lua_tointeger(L, -2), lua_tointeger(L, -1), text, len, max - cols);
+    }
+
+    lua_pop(L, nested ? 4 : 3);
+  }
+
+  lua_pushinteger(L, cols);
+  return 1;
+}
+
+static int l_tb_runs(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return draw_runs(L, &buf, 1);
+}
+
+// returns a pointer to the luabox_view struct for use with LuaJIT's FFI,
+// plus the current buffer pointer and size for one-off access.
+static int l_tb_screen_view(lua_State *L) {
+  sync_view();
+  lua_pushlightuserdata(L, &screen_view);
+  lua_pushlightuserdata(L, screen_view.cells);
+  lua_pushinteger(L, screen_view.width);
+  lua_pushinteger(L, screen_view.height);
+  return 4;
+}
+
+// C declaration matching this build's struct tb_cell, meant to be fed to
+// ffi.cdef(). field widths depend on how termbox was built.
+static const char * cell_cdef(void) {
+  static char cdef[128];
+  struct tb_cell cell;
+
+  snprintf(cdef, sizeof(cdef), "struct tb_cell { uint%d_t ch; uint%d_t fg; uint%d_t bg; };",
+    (int)sizeof(cell.ch) * 8, (int)sizeof(cell.fg) * 8, (int)sizeof(cell.bg) * 8);
+
+  return cdef;
+}
+
+// and the one for screen_view(), which needs struct tb_cell declared first
+#define VIEW_CDEF "struct luabox_view { struct tb_cell *cells; int width; int height; unsigned char *dirty; };"
+
+///////////////////
+// owners
+
+// which widget last drew each cell of the screen, so a mouse event can be
+// routed to whatever is on top at x/y with a single lookup instead of hit
+// testing the whole tree. ids are integers picked by the caller, 0 being no
+// one. the map follows the screen's size, keeping what still fits when it
+// changes, and one copy of it can be set aside while a popup is shown.
+static struct owner_map {
+  int *ids;
+  int width, height;
+} owners, saved_owners;
+
+static void resize_owner_map(struct owner_map *map, int width, int height) {
+  int *ids, row, cols;
+
+  if (map->width == width && map->height == height) return;
+  if (width <= 0 || height <= 0) {
+    free(map->ids);
+    map->ids = NULL;
+    map->width = map->height = 0;
+    return;
+  }
+
+  if (!(ids = calloc((size_t)width * height, sizeof(int)))) return;
+  cols = width < map->width ? width : map->width;
+  for (row = 0; row < height && row < map->height; row++)
+    memcpy(ids + row * width, map->ids + row * map->width, cols * sizeof(int));
+
+  free(map->ids);
+  map->ids = ids;
+  map->width = width;
+  map->height = height;
+}
+
+// the screen's owner map, resized to it if needed. NULL if it can't be.
+static struct owner_map * screen_owners(void) {
+  resize_owner_map(&owners, tb_width(), tb_height());
+  return owners.ids ? &owners : NULL;
+}
+
+// set_owner(x, y, w, h, id) marks the cells in the rect as drawn by id
+static int l_tb_set_owner(lua_State *L) {
+  int x  = luaL_checkinteger(L, 1);
+  int y  = luaL_checkinteger(L, 2);
+  int w  = luaL_checkinteger(L, 3);
+  int h  = luaL_checkinteger(L, 4);
+  int id = luaL_checkinteger(L, 5);
+  struct owner_map * map = screen_owners();
+  int row, col, *ids;
+
+  if (!map) return 0;
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > map->width)  w = map->width - x;
+  if (y + h > map->height) h = map->height - y;
+
+  for (row = y; row < y + h; row++) {
+    ids = map->ids + row * map->width + x;
+    for (col = 0; col < w; col++) ids[col] = id;
+  }
+
+  return 0;
+}
+
+// hit(x, y) -> id of whoever drew the cell last, or nil if no one did
+static int l_tb_hit(lua_State *L) {
+  int x = luaL_checkinteger(L, 1);
+  int y = luaL_checkinteger(L, 2);
+  struct owner_map * map = screen_owners();
+  int id;
+
+  if (!map || x < 0 || y < 0 || x >= map->width || y >= map->height) return 0;
+  if (!(id = map->ids[y * map->width + x])) return 0;
+
+  lua_pushinteger(L, id);
+  return 1;
+}
+
+// clear_owners() forgets who drew what, eg. before redrawing everything
+static int l_tb_clear_owners(lua_State *L) {
+  struct owner_map * map = screen_owners();
+  if (map) memset(map->ids, 0, (size_t)map->width * map->height * sizeof(int));
+  return 0;
+}
+
+// save_owners() sets aside a copy of the map, restore_owners() puts it back
+// (eg. together with the cells under a popup that's being hidden). returns
+// false if there was nothing saved or the screen changed size since.
+static int l_tb_save_owners(lua_State *L) {
+  struct owner_map * map = screen_owners();
+
+  resize_owner_map(&saved_owners, map ? map->width : 0, map ? map->height : 0);
+  if (map && saved_owners.ids)
+    memcpy(saved_owners.ids, map->ids, (size_t)map->width * map->height * sizeof(int));
+  return 0;
+}
+
+static int l_tb_restore_owners(lua_State *L) {
+  struct owner_map * map = screen_owners();
+
+  if (!map || !saved_owners.ids || saved_owners.width != map->width || saved_owners.height != map->height) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  memcpy(map->ids, saved_owners.ids, (size_t)map->width * map->height * sizeof(int));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+///////////////////
+// format templates
+
+// longest padding or precision we honor, so number fields fit on the stack
+#define FORMAT_MAX_WIDTH 256
+#define FORMAT "luabox.format"
+
+// a run of literal text or a single printf-like conversion
+struct fmt_part {
+  const char * text; // literal text (conv == 0)
+  size_t len;
+  char conv;         // s, d, i, u, x, X, o, f, F, e, E, g or G
+  char left;         // '-' flag given: pad on the right
+  int width;         // minimum columns, or -1
+  int precision;     // max columns for %s, as in printf for numbers, or -1
+  char spec[48];     // the conversion rebuilt for snprintf (numbers only)
+};
+
+struct fmt_color {
+  int set;
+  uint32_t fg;
+  uint32_t bg;
+};
+
+// a parsed template. parts, colors and the text parts point to all live in
+// the same userdata block, right after this header.
+struct format {
+  int nparts;
+  int nfields;
+  struct fmt_part * parts;
+  struct fmt_color * colors; // per field, set by tmpl:color()
+};
+
+static int parse_number(const char *fmt, size_t len, size_t *pos) {
+  int num = 0;
+  while (*pos < len && fmt[*pos] >= '0' && fmt[*pos] <= '9') {
+    if (num < FORMAT_MAX_WIDTH) num = num * 10 + (fmt[*pos] - '0');
+    (*pos)++;
+  }
+  return num > FORMAT_MAX_WIDTH ? FORMAT_MAX_WIDTH : num;
+}
+
+// reads the part of fmt that starts at *pos, which is either literal text or
+// a single conversion, and moves *pos past it. "%%" is read as a literal "%",
+// and anything that isn't a valid conversion is taken literally as well.
+// returns 0 once the end of fmt is reached.
+static int parse_format_part(const char *fmt, size_t len, size_t *pos, struct fmt_part *part) {
+  size_t start = *pos, i = start;
+  char flags[8];
+  int nflags = 0, is_int;
+
+  if (start >= len) return 0;
+  memset(part, 0, sizeof(*part));
+
+  if (fmt[i] != '%' || i + 1 >= len || fmt[i + 1] == '%') {
+    if (fmt[i] == '%') { // "%%" or a trailing "%"
+      part->text = fmt + i;
+      part->len = 1;
+      *pos = i + (i + 1 < len ? 2 : 1);
+      return 1;
+    }
+
+    while (i < len && fmt[i] != '%') i++;
+    part->text = fmt + start;
+    part->len = i - start;
+    *pos = i;
+    return 1;
+  }
+
+  i++; // past the %
+  while (i < len && nflags < (int)sizeof(flags) - 1 && strchr("-0+ #", fmt[i])) {
+    if (fmt[i] == '-') part->left = 1;
+    flags[nflags++] = fmt[i++];
+  }
+  flags[nflags] = 0;
+
+  part->width = (i < len && fmt[i] >= '0' && fmt[i] <= '9') ? parse_number(fmt, len, &i) : -1;
+  part->precision = -1;
+  if (i < len && fmt[i] == '.') {
+    i++;
+    part->precision = parse_number(fmt, len, &i);
+  }
+
+  if (i >= len || !strchr("sdiuxXofFeEgG", fmt[i])) { // not a conversion after all
+    part->text = fmt + start;
+    part->len = 1;
+    *pos = start + 1;
+    return 1;
+  }
+
+  part->conv = fmt[i];
+  part->text = fmt + start;
+  part->len = i + 1 - start;
+  *pos = i + 1;
+
+  if (part->conv != 's') {
+    is_int = strchr("diuxXo", part->conv) != NULL;
+    snprintf(part->spec, sizeof(part->spec), "%%%s%.0d%s%.0d%s%c",
+      flags,
+      part->width > 0 ? part->width : 0,
+      part->precision >= 0 ? "." : "",
+      part->precision > 0 ? part->precision : 0,
+      is_int ? "ll" : "",
+      part->conv);
+  }
+
+  return 1;
+}
+
+static void put_padding(struct cellbuf *buf, int x, int y, uint32_t fg, uint32_t bg, int cols) {
+  int i;
+  for (i = 0; i < cols; i++) put_cell(buf, x + i, y, ' ', fg, bg);
+}
+
+// draws a single conversion using the value at idx, within max_cols columns.
+// nothing is allocated: numbers are printed into a buffer on the stack and
+// strings are drawn right from Lua's copy. returns the number of columns used.
+static int draw_field(lua_State *L, struct cellbuf *buf, int x, int y, uint32_t fg, uint32_t bg, const struct fmt_part *part, int idx, int max_cols) {
+  char num[FORMAT_MAX_WIDTH * 2 + 64];
+  const char * str = num;
+  size_t len = 0;
+  int cols, pad, n;
+
+  if (max_cols <= 0) return 0;
+
+  if (part->conv == 's') {
+    switch (lua_type(L, idx)) {
+      case LUA_TSTRING:
+        str = lua_tolstring(L, idx, &len);
+        break;
+      case LUA_TNUMBER: { // formatted here, since lua_tolstring would intern a new string
+        lua_Number val = lua_tonumber(L, idx);
+        n = (val == (lua_Number)(long long)val)
+          ? snprintf(num, sizeof(num), "%lld", (long long)val)
+          : snprintf(num, sizeof(num), "%.14g", (double)val);
+        len = n > 0 ? n : 0;
+        break;
+      }
+      case LUA_TBOOLEAN:
+        str = lua_toboolean(L, idx) ? "true" : "false";
+        len = strlen(str);
+        break;
+      default:
+        str = lua_isnoneornil(L, idx) ? "nil" : luaL_typename(L, idx);
+        len = strlen(str);
+    }
+
+    // tabs are drawn as a single cell, so measure them as one column
+    struct text_pos fit = measure_text(str, len, part->precision, 1);
+    len  = fit.bytes;
+    cols = fit.cols;
+
+  } else {
+    lua_Number val = lua_tonumber(L, idx);
+    n = strchr("diuxXo", part->conv)
+      ? snprintf(num, sizeof(num), part->spec, (long long)val)
+      : snprintf(num, sizeof(num), part->spec, (double)val);
+    if (n < 0) n = 0;
+    if (n >= (int)sizeof(num)) n = sizeof(num) - 1;
+    len = cols = n;
+  }
+
+  pad = part->width > cols ? part->width - cols : 0;
+  if (pad > max_cols) pad = max_cols;
+
+  if (!part->left) {
+    put_padding(buf, x, y, fg, bg, pad);
+    cols = pad + put_text(buf, x + pad, y, fg, bg, str, len, max_cols - pad);
+  } else {
+    cols = put_text(buf, x, y, fg, bg, str, len, max_cols);
+    if (pad > max_cols - cols) pad = max_cols - cols;
+    put_padding(buf, x + cols, y, fg, bg, pad);
+    cols += pad;
+  }
+
+  return cols;
+}
+
+// stringf(x, y, fg, bg, fmt, ...) -> columns used
+// like format(fmt):draw(...), but parsing fmt as it goes
+static int draw_stringf(lua_State *L, struct cellbuf *buf, int arg) {
+  int x  = luaL_checkinteger(L, arg);
+  int y  = luaL_checkinteger(L, arg + 1);
+  int fg = luaL_checkinteger(L, arg + 2);
+  int bg = luaL_checkinteger(L, arg + 3);
+  size_t len, pos = 0;
+  const char * fmt = luaL_checklstring(L, arg + 4, &len);
+  struct fmt_part part;
+  int cols = 0, val = arg + 5;
+
+  while (parse_format_part(fmt, len, &pos, &part)) {
+    if (part.conv) {
+      cols += draw_field(L, buf, x + cols, y, fg, bg, &part, val++, buf->width - x - cols);
+    } else {
+      cols += put_text(buf, x + cols, y, fg, bg, part.text, part.len, buf->width - x - cols);
+    }
+  }
+
+  lua_pushinteger(L, cols);
+  return 1;
+}
+
+static int l_tb_stringf(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return draw_stringf(L, &buf, 1);
+}
+
+// format(fmt) -> template
+// parses fmt once, so drawing it later doesn't. conversions are the usual
+// %s, %d, %x, %f and so on, with -, 0, +, space and # flags, width and
+// precision. for %s, width and precision are counted in columns.
+static int l_tb_format(lua_State *L) {
+  size_t len, pos = 0;
+  const char * fmt = luaL_checklstring(L, 1, &len);
+  struct fmt_part part;
+  struct format * tmpl;
+  char * text;
+  int nparts = 0, nfields = 0, i;
+
+  while (parse_format_part(fmt, len, &pos, &part)) {
+    nparts++;
+    if (part.conv) nfields++;
+  }
+
+  tmpl = lua_newuserdata(L, sizeof(struct format)
+    + nparts  * sizeof(struct fmt_part)
+    + nfields * sizeof(struct fmt_color)
+    + len + 1);
+
+  tmpl->nparts  = nparts;
+  tmpl->nfields = nfields;
+  tmpl->parts   = (struct fmt_part *)(tmpl + 1);
+  tmpl->colors  = (struct fmt_color *)(tmpl->parts + nparts);
+  text = (char *)(tmpl->colors + nfields);
+
+  // parse our own copy, so the literal parts point into it
+  memcpy(text, fmt, len + 1);
+  for (i = 0, pos = 0; i < nparts; i++) {
+    parse_format_part(text, len, &pos, &tmpl->parts[i]);
+  }
+  memset(tmpl->colors, 0, nfields * sizeof(struct fmt_color));
+
+  luaL_getmetatable(L, FORMAT);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static struct format * check_format(lua_State *L, int arg) {
+  return luaL_checkudata(L, arg, FORMAT);
+}
+
+// draws the template at arg (followed by x, y, fg, bg and the field values).
+// a value may also be a {value, fg, bg} table to color just that field.
+static int draw_format(lua_State *L, struct cellbuf *buf, int arg) {
+  struct format * tmpl = check_format(L, arg);
+  int x  = luaL_checkinteger(L, arg + 1);
+  int y  = luaL_checkinteger(L, arg + 2);
+  uint32_t fg = luaL_checkinteger(L, arg + 3);
+  uint32_t bg = luaL_checkinteger(L, arg + 4);
+  int cols = 0, field = 0, i, val, top;
+  uint32_t field_fg, field_bg;
+
+  for (i = 0; i < tmpl->nparts; i++) {
+    const struct fmt_part * part = &tmpl->parts[i];
+
+    if (!part->conv) {
+      cols += put_text(buf, x + cols, y, fg, bg, part->text, part->len, buf->width - x - cols);
+      continue;
+    }
+
+    val = arg + 5 + field;
+    top = lua_gettop(L);
+    field_fg = tmpl->colors[field].set ? tmpl->colors[field].fg : fg;
+    field_bg = tmpl->colors[field].set ? tmpl->colors[field].bg : bg;
+
+    if (lua_istable(L, val)) {
+      lua_rawgeti(L, val, 1);
+      lua_rawgeti(L, val, 2);
+      lua_rawgeti(L, val, 3);
+      if (!lua_isnil(L, -2)) field_fg = lua_tointeger(L, -2);
+      if (!lua_isnil(L, -1)) field_bg = lua_tointeger(L, -1);
+      val = top + 1;
+    }
+
+    cols += draw_field(L, buf, x + cols, y, field_fg, field_bg, part, val, buf->width - x - cols);
+    lua_settop(L, top);
+    field++;
+  }
+
+  lua_pushinteger(L, cols);
+  return 1;
+}
+
+// tmpl:draw(x, y, fg, bg, ...) -> columns used
+static int l_format_draw(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return draw_format(L, &buf, 1);
+}
+
+// tmpl:color(n, fg, bg) sets the colors of the nth field (1 based) for
+// every draw. without fg and bg, the field goes back to the template's colors.
+static int l_format_color(lua_State *L) {
+  struct format * tmpl = check_format(L, 1);
+  int n = luaL_checkinteger(L, 2);
+
+  luaL_argcheck(L, n >= 1 && n <= tmpl->nfields, 2, "no such field");
+
+  struct fmt_color * color = &tmpl->colors[n - 1];
+  color->set = !lua_isnoneornil(L, 3);
+  color->fg  = luaL_optinteger(L, 3, 0);
+  color->bg  = luaL_optinteger(L, 4, TB_DEFAULT);
+  return 0;
+}
+
+// tmpl:fields() -> number of values draw() expects
+static int l_format_fields(lua_State *L) {
+  lua_pushinteger(L, check_format(L, 1)->nfields);
+  return 1;
+}
+
+static const struct luaL_Reg l_format[] = {
+  {"draw",   l_format_draw},
+  {"color",  l_format_color},
+  {"fields", l_format_fields},
+  {NULL, NULL}
+};
+
+///////////////////
+// ansi escapes
+
+// turns output with ansi escapes in it (eg. from make or git --color) into
+// lines of cells. the parser keeps its state between feeds, so chunks can
+// be cut anywhere, even in the middle of an escape or a utf-8 char. colors
+// are stored as they were given and mapped to termbox colors when drawn, so
+// they follow the output mode selected at that point. sgr (colors and
+// attributes), \r, \b, \t and erase in line are handled, other escapes are
+// skipped. lines are 1 based.
+#define ANSI "luabox.ansi"
+#define ANSI_MAX_PARAMS 16
+#define ANSI_READ_SIZE 65536
+
+// color specs: 0 is the default color, 1..16 the basic ones, or an xterm
+// index or rgb triple tagged with its kind. fg specs also carry attributes.
+#define ANSI_XTERM     0x01000000
+#define ANSI_RGB       0x02000000
+#define ANSI_KIND      0x03000000
+#define ANSI_BOLD      0x04000000
+#define ANSI_UNDERLINE 0x08000000
+#define ANSI_REVERSE   0x10000000
+#define ANSI_ATTRS     (ANSI_BOLD | ANSI_UNDERLINE | ANSI_REVERSE)
+
+enum {
+  ANSI_GROUND, ANSI_ESC, ANSI_ESC_INTER, ANSI_CSI, ANSI_STRING
+};
+
+struct ansi_cell {
+  uint32_t ch; // 0 for the column after a wide char
+  uint32_t fg, bg;
+};
+
+struct ansi {
+  struct ansi_cell *cells;
+  size_t len, cap;
+
+  size_t *starts;      // where each line begins. the last one is being written
+  size_t count, starts_cap;
+
+  size_t max_lines;    // lines kept, or 0 for all of them
+  size_t dropped;      // lines removed from the top so far
+  int width;           // lines longer than this wrap, if > 0
+  int col;
+
+  uint32_t fg, bg;     // specs for the next chars
+
+  int state;
+  int params[ANSI_MAX_PARAMS];
+  int nparams;
+  unsigned int colons; // params that came after a ':' rather than a ';'
+  int ignore;          // private or unknown csi, parsed but not run
+
+  uint32_t cp;         // utf-8 char being decoded
+  int need;            // continuation bytes it still needs
+};
+
+// xterm's default rgb values for the basic colors, and the termbox colors
+// they are drawn with
+static const uint32_t ansi_basic_rgb[16] = {
+  0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+  0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff
+};
+
+static const uint32_t ansi_basic[16] = {
+  TB_BLACK, TB_RED, TB_GREEN, TB_YELLOW, TB_BLUE, TB_MAGENTA, TB_CYAN, TB_LIGHT_GRAY,
+  TB_DARK_GRAY, TB_LIGHT_RED, TB_LIGHT_GREEN, TB_LIGHT_YELLOW, TB_LIGHT_BLUE,
+  TB_LIGHT_MAGENTA, TB_LIGHT_CYAN, TB_WHITE
+};
+
+static const uint8_t ansi_cube[6] = { 0, 95, 135, 175, 215, 255 };
+
+static struct ansi * check_ansi(lua_State *L, int arg) {
+  return luaL_checkudata(L, arg, ANSI);
+}
+
+static uint32_t xterm_rgb(uint8_t i) {
+  if (i < 16) return ansi_basic_rgb[i];
+  if (i >= 232) {
+    uint32_t v = 8 + 10 * (i - 232);
+    return v << 16 | v << 8 | v;
+  }
+
+  i -= 16;
+  return ansi_cube[i / 36] << 16 | ansi_cube[i / 6 % 6] << 8 | ansi_cube[i % 6];
+}
+
+static int rgb_distance(uint32_t a, uint32_t b) {
+  int dr = (int)(a >> 16 & 0xff) - (int)(b >> 16 & 0xff);
+  int dg = (int)(a >> 8 & 0xff)  - (int)(b >> 8 & 0xff);
+  int db = (int)(a & 0xff)       - (int)(b & 0xff);
+  return dr * dr + dg * dg + db * db;
+}
+
+static int nearest_basic(uint32_t rgb) {
+  int i, best = 0, d, best_d = INT_MAX;
+
+  for (i = 0; i < 16; i++) {
+    d = rgb_distance(rgb, ansi_basic_rgb[i]);
+    if (d < best_d) { best = i; best_d = d; }
+  }
+
+  return best;
+}
+
+static int cube_level(int v) {
+  return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40;
+}
+
+// closest xterm index, either in the 6x6x6 cube or on the gray ramp
+static uint8_t nearest_xterm(uint32_t rgb) {
+  int r = rgb >> 16 & 0xff, g = rgb >> 8 & 0xff, b = rgb & 0xff;
+  int cube = 16 + 36 * cube_level(r) + 6 * cube_level(g) + cube_level(b);
+  int avg  = (r + g + b) / 3;
+  int gray = avg > 238 ? 255 : avg < 8 ? 232 : 232 + (avg - 3) / 10;
+
+  if (gray > 255) gray = 255;
+  return rgb_distance(rgb, xterm_rgb(gray)) < rgb_distance(rgb, xterm_rgb(cube)) ? gray : cube;
+}
+
+static uint32_t ansi_color(uint32_t spec, uint32_t deflt, int mode) {
+  uint32_t val = spec & 0xffffff;
+
+  switch (spec & ANSI_KIND) {
+    case ANSI_RGB:
+#ifdef WITH_TRUECOLOR
+      if (mode == TB_OUTPUT_TRUECOLOR) return tb_rgb(val);
+#endif
+      if (mode == TB_OUTPUT_NORMAL) return ansi_basic[nearest_basic(val)];
+      val = nearest_xterm(val);
+      // fall through
+    case ANSI_XTERM:
+      if (val < 16) return ansi_basic[val];
+      if (mode == TB_OUTPUT_NORMAL) return ansi_basic[nearest_basic(xterm_rgb(val))];
+      return tb_rgb_from_xterm(val);
+    default:
+      return val ? ansi_basic[val - 1] : deflt;
+  }
+}
+
+static uint32_t ansi_fg(uint32_t spec, uint32_t deflt, int mode) {
+  uint32_t fg = ansi_color(spec, deflt, mode);
+  if (spec & ANSI_BOLD)      fg |= TB_BOLD;
+  if (spec & ANSI_UNDERLINE) fg |= TB_UNDERLINE;
+  if (spec & ANSI_REVERSE)   fg |= TB_REVERSE;
+  return fg;
+}
+
+static int ansi_reserve(struct ansi *a, size_t len, size_t count) {
+  if (len > a->cap) {
+    size_t cap = a->cap ? a->cap : 1024;
+    while (cap < len) cap *= 2;
+    struct ansi_cell * cells = realloc(a->cells, cap * sizeof(struct ansi_cell));
+    if (!cells) return 0;
+    a->cells = cells;
+    a->cap   = cap;
+  }
+
+  if (count > a->starts_cap) {
+    size_t cap = a->starts_cap ? a->starts_cap : 64;
+    while (cap < count) cap *= 2;
+    size_t * starts = realloc(a->starts, cap * sizeof(size_t));
+    if (!starts) return 0;
+    a->starts     = starts;
+    a->starts_cap = cap;
+  }
+
+  return 1;
+}
+
+static int ansi_newline(struct ansi *a) {
+  if (!ansi_reserve(a, 0, a->count + 1)) return 0;
+  a->starts[a->count++] = a->len;
+  a->col = 0;
+  return 1;
+}
+
+// makes room for cols columns at the cursor, padding the line with blanks
+// if it's shorter, and blanks out any wide char that gets cut in half.
+// returns the cell at the cursor, or NULL when out of memory.
+static struct ansi_cell * ansi_cells_at(struct ansi *a, int cols) {
+  size_t line = a->starts[a->count - 1];
+  size_t cur = a->len - line, end = a->col + cols, i;
+
+  if (a->col > 0 && (size_t)a->col < cur && a->cells[line + a->col].ch == 0)
+    a->cells[line + a->col - 1].ch = ' ';
+  if (end < cur && a->cells[line + end].ch == 0)
+    a->cells[line + end].ch = ' ';
+
+  if (end > cur) {
+    if (!ansi_reserve(a, line + end, 0)) return NULL;
+    for (i = a->len; i < line + a->col; i++) {
+      a->cells[i].ch = ' ';
+      a->cells[i].fg = a->cells[i].bg = 0;
+    }
+    a->len = line + end;
+  }
+
+  return a->cells + line + a->col;
+}
+
+static int ansi_put(struct ansi *a, uint32_t ch) {
+  int w = char_width(ch);
+  struct ansi_cell * cell;
+
+  if (w == 0) return 1; // nothing to combine it with in a cell
+  if (a->width > 0 && a->col + w > a->width && a->col > 0 && !ansi_newline(a)) return 0;
+  if (!(cell = ansi_cells_at(a, w))) return 0;
+
+  cell->ch = ch;
+  cell->fg = a->fg;
+  cell->bg = a->bg;
+  if (w == 2) {
+    cell[1].ch = 0;
+    cell[1].fg = a->fg;
+    cell[1].bg = a->bg;
+  }
+
+  a->col += w;
+  return 1;
+}
+
+// how many leading bytes of str are printable ascii, which is most of the
+// output and can be copied into cells as is
+static size_t printable_run(const char *str, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+    __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(chunk, del), _mm_cmpgt_epi8(chunk, space));
+    int mask = ~_mm_movemask_epi8(ok) & 0xffff;
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+
+  while (i < len && (unsigned char)(str[i] - 0x20) < 0x5f) i++;
+  return i;
+}
+
+static int ansi_put_ascii(struct ansi *a, const char *str, size_t len) {
+  struct ansi_cell * cell;
+  uint32_t fg = a->fg, bg = a->bg;
+  size_t n, i;
+
+  while (len > 0) {
+    if (a->width > 0 && a->col >= a->width && !ansi_newline(a)) return 0;
+
+    n = a->width > 0 && len > (size_t)(a->width - a->col) ? (size_t)(a->width - a->col) : len;
+    if (!(cell = ansi_cells_at(a, n))) return 0;
+
+    for (i = 0; i < n; i++) {
+      cell[i].ch = (unsigned char)str[i];
+      cell[i].fg = fg;
+      cell[i].bg = bg;
+    }
+
+    a->col += n;
+    str += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static void ansi_erase_line(struct ansi *a, int mode) {
+  size_t line = a->starts[a->count - 1], cur = a->len - line, i;
+  size_t to = (size_t)a->col < cur ? (size_t)a->col : cur;
+
+  if (mode == 0 || mode == 2) {
+    if (mode == 2) to = 0;
+    if (to > 0 && to < cur && a->cells[line + to].ch == 0) a->cells[line + to - 1].ch = ' ';
+    a->len = line + to;
+  } else if (mode == 1) {
+    if (to < cur) to++; // up to and including the cursor
+    for (i = 0; i < to; i++) {
+      a->cells[line + i].ch = ' ';
+      a->cells[line + i].fg = a->cells[line + i].bg = 0;
+    }
+    if (to < cur && a->cells[line + to].ch == 0) a->cells[line + to].ch = ' ';
+  }
+}
+
+static int ansi_control(struct ansi *a, unsigned char c) {
+  switch (c) {
+    case '\n':
+      return ansi_newline(a);
+    case '\r':
+      a->col = 0;
+      break;
+    case '\b':
+      if (a->col > 0) a->col--;
+      break;
+    case '\t':
+      a->col = (a->col / DEFAULT_TAB_WIDTH + 1) * DEFAULT_TAB_WIDTH;
+      if (a->width > 0 && a->col > a->width) a->col = a->width;
+      break;
+  }
+
+  return 1;
+}
+
+// reads a 38/48 extended color from params: 5;n or 2;r;g;b, or the same
+// with colons, where 2 may have a color space id before r. returns the
+// number of params used and stores the spec, or 0 if it wasn't valid.
+static int ansi_ext_color(const int *params, int n, int colons, uint32_t *spec) {
+  int r, g, b;
+
+  if (n >= 2 && params[0] == 5) {
+    *spec = ANSI_XTERM | (params[1] & 0xff);
+    return colons ? n : 2;
+  }
+
+  if (n >= 4 && params[0] == 2) {
+    if (colons && n >= 5) params++; // skip the color space
+    r = params[1] > 255 ? 255 : params[1];
+    g = params[2] > 255 ? 255 : params[2];
+    b = params[3] > 255 ? 255 : params[3];
+    *spec = ANSI_RGB | r << 16 | g << 8 | b;
+    return colons ? n : 4;
+  }
+
+  *spec = 0;
+  return colons ? n : 1;
+}
+
+static void ansi_sgr(struct ansi *a) {
+  int i = 0, n = a->nparams ? a->nparams : 1, p, subs, used;
+  uint32_t spec;
+
+  while (i < n) {
+    p = a->params[i++];
+    for (subs = 0; i + subs < n && (a->colons >> (i + subs) & 1); subs++);
+
+    switch (p) {
+      case 0:  a->fg = a->bg = 0; break;
+      case 1:  a->fg |= ANSI_BOLD; break;
+      case 4:  if (subs && a->params[i] == 0) a->fg &= ~ANSI_UNDERLINE; else a->fg |= ANSI_UNDERLINE; break;
+      case 7:  a->fg |= ANSI_REVERSE; break;
+      case 21: a->fg |= ANSI_UNDERLINE; break; // double underline
+      case 22: a->fg &= ~ANSI_BOLD; break;
+      case 24: a->fg &= ~ANSI_UNDERLINE; break;
+      case 27: a->fg &= ~ANSI_REVERSE; break;
+      case 39: a->fg &= ANSI_ATTRS; break;
+      case 49: a->bg = 0; break;
+      case 38:
+      case 48:
+        used = subs ? ansi_ext_color(a->params + i, subs, 1, &spec)
+                    : ansi_ext_color(a->params + i, n - i, 0, &spec);
+        if (spec && p == 38) a->fg = (a->fg & ANSI_ATTRS) | spec;
+        if (spec && p == 48) a->bg = spec;
+        i += used;
+        subs = 0;
+        break;
+      default:
+        if (p >= 30 && p <= 37)   a->fg = (a->fg & ANSI_ATTRS) | (p - 30 + 1);
+        if (p >= 90 && p <= 97)   a->fg = (a->fg & ANSI_ATTRS) | (p - 90 + 9);
+        if (p >= 40 && p <= 47)   a->bg = p - 40 + 1;
+        if (p >= 100 && p <= 107) a->bg = p - 100 + 9;
+    }
+
+    i += subs;
+  }
+}
+
+static void ansi_csi_byte(struct ansi *a, unsigned char c) {
+  int *last = a->nparams ? &a->params[a->nparams - 1] : NULL;
+
+  if (c >= '0' && c <= '9') {
+    if (!last) {
+      a->params[0] = 0;
+      a->nparams = 1;
+      last = a->params;
+    }
+    if (*last < 65536) *last = *last * 10 + (c - '0');
+  } else if (c == ';' || c == ':') {
+    if (!last) {
+      a->params[0] = 0;
+      a->nparams = 1;
+    }
+    if (a->nparams < ANSI_MAX_PARAMS) {
+      if (c == ':') a->colons |= 1u << a->nparams;
+      a->params[a->nparams++] = 0;
+    }
+  } else if (c < 0x40) { // private markers and intermediates
+    a->ignore = 1;
+  } else { // final byte
+    a->state = ANSI_GROUND;
+    if (a->ignore) return;
+    if (c == 'm') ansi_sgr(a);
+    if (c == 'K') ansi_erase_line(a, a->nparams ? a->params[0] : 0);
+  }
+}
+
+// parses len bytes of str, carrying on from where the last feed stopped.
+// returns 0 when out of memory.
+static int ansi_feed(struct ansi *a, const char *str, size_t len) {
+  size_t i = 0, run;
+  unsigned char c;
+
+  while (i < len) {
+    if (a->state == ANSI_GROUND && !a->need) {
+      run = printable_run(str + i, len - i);
+      if (run > 0) {
+        if (!ansi_put_ascii(a, str + i, run)) return 0;
+        i += run;
+        continue;
+      }
+    }
+
+    c = str[i++];
+
+    if (a->need) {
+      if ((c & 0xc0) == 0x80) {
+        a->cp = a->cp << 6 | (c & 0x3f);
+        if (--a->need == 0) {
+          if (a->cp > 0x10ffff || (a->cp >= 0xd800 && a->cp <= 0xdfff)) a->cp = 0xfffd;
+          if (!ansi_put(a, a->cp)) return 0;
+        }
+        continue;
+      }
+
+      a->need = 0; // cut short, so c starts something else
+      if (!ansi_put(a, 0xfffd)) return 0;
+    }
+
+    if (c == 0x1b) {
+      a->state = ANSI_ESC;
+      continue;
+    }
+
+    if (a->state == ANSI_STRING) { // osc, dcs and such end with bel, or esc and a backslash
+      if (c == 0x07) a->state = ANSI_GROUND;
+      continue;
+    }
+
+    if (c < 0x20) {
+      if (!ansi_control(a, c)) return 0;
+      continue;
+    }
+
+    switch (a->state) {
+      case ANSI_GROUND:
+        if (c < 0x7f) { if (!ansi_put(a, c)) return 0; } // after a cut short utf-8 char
+        else if (c >= 0xc2 && c <= 0xdf) { a->cp = c & 0x1f; a->need = 1; }
+        else if (c >= 0xe0 && c <= 0xef) { a->cp = c & 0x0f; a->need = 2; }
+        else if (c >= 0xf0 && c <= 0xf4) { a->cp = c & 0x07; a->need = 3; }
+        else if (c >= 0x80 && !ansi_put(a, 0xfffd)) return 0;
+        break;
+
+      case ANSI_ESC:
+        a->state = ANSI_GROUND;
+        if (c == '[') {
+          a->state   = ANSI_CSI;
+          a->nparams = 0;
+          a->colons  = 0;
+          a->ignore  = 0;
+        } else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+          a->state = ANSI_STRING;
+        } else if (c >= 0x20 && c <= 0x2f) {
+          a->state = ANSI_ESC_INTER; // eg. esc ( B, which picks a charset
+        } else if (c == 'c') {
+          a->fg = a->bg = 0;
+        }
+        break;
+
+      case ANSI_ESC_INTER:
+        if (c >= 0x30) a->state = ANSI_GROUND;
+        break;
+
+      case ANSI_CSI:
+        ansi_csi_byte(a, c);
+        break;
+    }
+  }
+
+  return 1;
+}
+
+// number of lines, not counting an empty one after the last newline
+static size_t ansi_lines(struct ansi *a) {
+  return a->count - (a->len == a->starts[a->count - 1]);
+}
+
+// index of the first line shown, leaving max_lines after it
+static size_t ansi_first(struct ansi *a) {
+  size_t lines = ansi_lines(a);
+  return a->max_lines && lines > a->max_lines ? lines - a->max_lines : 0;
+}
+
+// drops lines over max_lines from the top. this only happens once there
+// are twice as many, so each cell gets moved once at most.
+static void ansi_trim(struct ansi *a) {
+  size_t drop, shift, i;
+
+  if (!a->max_lines || a->count <= a->max_lines * 2 + 1) return;
+
+  drop  = ansi_first(a);
+  shift = a->starts[drop];
+  memmove(a->cells, a->cells + shift, (a->len - shift) * sizeof(struct ansi_cell));
+  for (i = drop; i < a->count; i++) a->starts[i - drop] = a->starts[i] - shift;
+
+  a->count   -= drop;
+  a->len     -= shift;
+  a->dropped += drop;
+}
+
+static void ansi_line(struct ansi *a, size_t i, struct ansi_cell **cells, size_t *len) {
+  size_t end = i + 1 < a->count ? a->starts[i + 1] : a->len;
+  *cells = a->cells + a->starts[i];
+  *len   = end - a->starts[i];
+}
+
+// draws line i (0 based, counting dropped ones out) at x/y from column skip
+// on, for at most w columns. returns the number of columns drawn.
+static int ansi_draw_line(struct ansi *a, struct cellbuf *buf, size_t i, int x, int y, int w, int skip, uint32_t fg, uint32_t bg, int mode) {
+  struct ansi_cell * cells;
+  size_t len, at;
+  uint32_t fg_spec = 0, bg_spec = 0, fg_col = fg, bg_col = bg, ch;
+  int col;
+
+  ansi_line(a, i, &cells, &len);
+  if (skip < 0) skip = 0;
+
+  for (at = skip, col = 0; at < len && col < w; at++, col++) {
+    if (cells[at].fg != fg_spec) {
+      fg_spec = cells[at].fg;
+      fg_col  = ansi_fg(fg_spec, fg, mode);
+    }
+    if (cells[at].bg != bg_spec) {
+      bg_spec = cells[at].bg;
+      bg_col  = ansi_color(bg_spec, bg, mode);
+    }
+
+    ch = cells[at].ch;
+    if (ch == 0) {
+      if (col > 0) continue; // the column after a wide char is left alone
+      ch = ' ';
+    } else if (at + 1 < len && cells[at + 1].ch == 0 && col + 1 >= w) {
+      break; // wide char that doesn't fit
+    }
+
+    put_cell(buf, x + col, y, ch, fg_col, bg_col);
+  }
+
+  return col;
+}
+
+// ansi([width [, max_lines]]) -> parser, writing into a scrollback of
+// lines. lines wrap at width if given, and only the last max_lines are kept.
+static int l_tb_ansi(lua_State *L) {
+  int width = luaL_optinteger(L, 1, 0);
+  lua_Integer max_lines = luaL_optinteger(L, 2, 0);
+
+  struct ansi * a = lua_newuserdata(L, sizeof(struct ansi));
+  memset(a, 0, sizeof(struct ansi));
+  luaL_getmetatable(L, ANSI);
+  lua_setmetatable(L, -2);
+
+  a->width = width > 0 ? width : 0;
+  a->max_lines = max_lines > 0 ? max_lines : 0;
+  if (!ansi_newline(a)) return luaL_error(L, "out of memory");
+  return 1;
+}
+
+static int l_ansi_gc(lua_State *L) {
+  struct ansi * a = check_ansi(L, 1);
+  free(a->cells);
+  free(a->starts);
+  a->cells = NULL;
+  a->starts = NULL;
+  a->len = a->count = a->cap = a->starts_cap = 0;
+  return 0;
+}
+
+// parser:feed(chunk) -> number of lines
+static int l_ansi_feed(lua_State *L) {
+  struct ansi * a = check_ansi(L, 1);
+  size_t len;
+  const char * str = luaL_checklstring(L, 2, &len);
+
+  if (!a->starts) return luaL_error(L, "parser was freed");
+  if (!ansi_feed(a, str, len)) return luaL_error(L, "out of memory");
+  ansi_trim(a);
+
+  lua_pushinteger(L, ansi_lines(a) - ansi_first(a));
+  return 1;
+}
+
+// parser:load_fd(fd [, max_bytes]) -> bytes read, eof
+// feeds what can be read from fd until eof, or until it would block if it's
+// non blocking, like store:load_fd.
+static int l_ansi_load_fd(lua_State *L) {
+  struct ansi * a = check_ansi(L, 1);
+  int fd = luaL_checkinteger(L, 2);
+  lua_Number max = luaL_optnumber(L, 3, -1);
+  size_t limit = max < 0 ? (size_t)-1 : (size_t)max, total = 0, want;
+  char chunk[ANSI_READ_SIZE];
+  int eof = 0;
+  ssize_t n;
+
+  if (!a->starts) return luaL_error(L, "parser was freed");
+
+  while (total < limit) {
+    want = limit - total < sizeof(chunk) ? limit - total : sizeof(chunk);
+    n = read(fd, chunk, want);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (n < 0) return luaL_error(L, "read failed: %s", strerror(errno));
+    if (n == 0) {
+      eof = 1;
+      break;
+    }
+
+    if (!ansi_feed(a, chunk, n)) return luaL_error(L, "out of memory");
+    total += n;
+  }
+
+  ansi_trim(a);
+  lua_pushinteger(L, total);
+  lua_pushboolean(L, eof);
+  return 2;
+}
+
+// parser:lines() -> number of lines kept, and lines dropped from the top
+static int l_ansi_lines(lua_State *L) {
+  struct ansi * a = check_ansi(L, 1);
+  size_t first = a->starts ? ansi_first(a) : 0;
+
+  lua_pushinteger(L, a->starts ? ansi_lines(a) - first : 0);
+  lua_pushinteger(L, a->dropped + first);
+  return 2;
+}
+
+static int l_ansi_count(lua_State *L) {
+  struct ansi * a = check_ansi(L, 1);
+  lua_pushinteger(L, a->starts ? ansi_lines(a) - ansi_first(a) : 0);
+  return 1;
+}
+
+// parser:get(i) -> text of line i without the escapes, or nil
+static int l_ansi_get(lua_State *L) {
+  struct ansi * a = check_ansi(L, 1);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  struct ansi_cell * cells;
+  size_t first, len, at;
+  char str[7];
+  luaL_Buffer b;
+
+  if (!a->starts) return 0;
+  first = ansi_first(a);
+  if (i < 1 || (size_t)i > ansi_lines(a) - first) return 0;
+
+  ansi_line(a, first + i - 1, &cells, &len);
+  luaL_buffinit(L, &b);
+  for (at = 0; at < len; at++) {
+    if (cells[at].ch == 0) continue; // second half of a wide char
+    if (cells[at].ch < 0x80) {
+      luaL_addchar(&b, cells[at].ch);
+    } else {
+      luaL_addlstring(&b, str, tb_utf8_unicode_to_char(str, cells[at].ch));
+    }
+  }
+
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// parser:bytes() -> size of the cells, and of everything allocated
+static int l_ansi_bytes(lua_State *L) {
+  struct ansi * a = check_ansi(L, 1);
+  lua_pushinteger(L, a->len * sizeof(struct ansi_cell));
+  lua_pushinteger(L, a->cap * sizeof(struct ansi_cell) + a->starts_cap * sizeof(size_t));
+  return 2;
+}
+
+// parser:clear() removes all lines, keeping the current colors
+static int l_ansi_clear(lua_State *L) {
+  struct ansi * a = check_ansi(L, 1);
+  if (!a->starts) return 0;
+  a->dropped += ansi_lines(a);
+  a->len = a->col = 0;
+  a->count = 1;
+  a->starts[0] = 0;
+  return 0;
+}
+
+// parser:draw(x, y, w, h, first, fg, bg [, col])
+// draws lines first..first+h-1 on rows y..y+h-1, starting at column col
+// (0 by default) of each and cut to w columns. with a nil first the last h
+// lines are drawn, so the output follows the tail. fg and bg are used for
+// the default colors. only the text is drawn, the rest of each row is left
+// alone. returns the number of rows drawn.
+static int l_ansi_draw(lua_State *L) {
+  struct ansi * a = check_ansi(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  int w = luaL_checkinteger(L, 4);
+  int h = luaL_checkinteger(L, 5);
+  uint32_t fg = luaL_checkinteger(L, 7);
+  uint32_t bg = luaL_checkinteger(L, 8);
+  int skip = luaL_optinteger(L, 9, 0);
+
+  struct cellbuf screen = screen_buffer();
+  int mode = tb_select_output_mode(TB_OUTPUT_CURRENT);
+  size_t base, lines;
+  lua_Integer first, i;
+  int row;
+
+  if (!a->starts) return luaL_error(L, "parser was freed");
+  base  = ansi_first(a);
+  lines = ansi_lines(a) - base;
+
+  if (lua_isnoneornil(L, 6)) {
+    first = (lua_Integer)lines - h + 1;
+    if (first < 1) first = 1;
+  } else {
+    first = luaL_checkinteger(L, 6);
+  }
+
+  if (first < 1) { h += first - 1; y -= first - 1; first = 1; }
+
+  for (row = 0; row < h && w > 0; row++) {
+    i = first + row;
+    if ((size_t)i > lines) break;
+    if (y + row < 0 || y + row >= screen.height) continue;
+    ansi_draw_line(a, &screen, base + i - 1, x, y + row, w, skip, fg, bg, mode);
+  }
+
+  lua_pushinteger(L, row);
+  return 1;
+}
+
+// parses str on its own and draws its lines from x/y down, cut to max_cols.
+// returns the width of the widest line.
+static int draw_ansi_string(lua_State *L, struct cellbuf *buf, int arg) {
+  int x  = luaL_checkinteger(L, arg);
+  int y  = luaL_checkinteger(L, arg + 1);
+  uint32_t fg = luaL_checkinteger(L, arg + 2);
+  uint32_t bg = luaL_checkinteger(L, arg + 3);
+  size_t len, i;
+  const char * str = luaL_checklstring(L, arg + 4, &len);
+  int max = luaL_optinteger(L, arg + 5, buf->width - x);
+  int mode = tb_select_output_mode(TB_OUTPUT_CURRENT);
+  int cols = 0, n;
+
+  struct ansi a;
+  memset(&a, 0, sizeof(struct ansi));
+  if (!ansi_newline(&a) || !ansi_feed(&a, str, len)) {
+    free(a.cells);
+    free(a.starts);
+    return luaL_error(L, "out of memory");
+  }
+
+  for (i = 0; i < ansi_lines(&a); i++) {
+    n = ansi_draw_line(&a, buf, i, x, y + (int)i, max, 0, fg, bg, mode);
+    if (n > cols) cols = n;
+  }
+
+  free(a.cells);
+  free(a.starts);
+  lua_pushinteger(L, cols);
+  return 1;
+}
+
+// ansi_string(x, y, fg, bg, str [, max_cols]) -> columns, like string() but
+// with the colors and attributes set by the escapes in str
+static int l_tb_ansi_string(lua_State *L) {
+  struct cellbuf buf = screen_buffer();
+  return draw_ansi_string(L, &buf, 1);
+}
+
+static const struct luaL_Reg l_ansi[] = {
+  {"__gc",    l_ansi_gc},
+  {"__len",   l_ansi_count},
+  {"feed",    l_ansi_feed},
+  {"load_fd", l_ansi_load_fd},
+  {"lines",   l_ansi_lines},
+  {"get",     l_ansi_get},
+  {"bytes",   l_ansi_bytes},
+  {"clear",   l_ansi_clear},
+  {"draw",    l_ansi_draw},
+  {NULL, NULL}
+};
+
+///////////////////
+// surfaces
+
+// an offscreen grid of cells with the same drawing functions as the screen.
+// widgets can draw into one once and then composite it onto the back buffer
+// with draw_to(), which is a memcpy per row.
+#define SURFACE "luabox.surface"
+
+static struct cellbuf * check_surface(lua_State *L, int arg) {
+  return luaL_checkudata(L, arg, SURFACE);
+}
+
+static void clear_cells(struct cellbuf *buf, uint32_t ch, uint32_t fg, uint32_t bg) {
+  size_t i, count = (size_t)buf->width * buf->height;
+  struct tb_cell cell;
+
+  cell.ch = ch; cell.fg = fg; cell.bg = bg;
+  for (i = 0; i < count; i++) buf->cells[i] = cell;
+}
+
+static int resize_surface(struct cellbuf *buf, int width, int height) {
+  struct tb_cell * cells = malloc((size_t)(width ? width : 1) * (height ? height : 1) * sizeof(struct tb_cell));
+  if (!cells) return 0;
+
+  free(buf->cells);
+  buf->cells  = cells;
+  buf->width  = width;
+  buf->height = height;
+  clear_cells(buf, ' ', TB_DEFAULT, TB_DEFAULT);
+  return 1;
+}
+
+// surface(width, height) -> surface, cleared to spaces in default colors
+static int l_tb_surface(lua_State *L) {
+  int width  = luaL_checkinteger(L, 1);
+  int height = luaL_checkinteger(L, 2);
+
+  luaL_argcheck(L, width >= 0 && height >= 0, 1, "invalid size");
+
+  struct cellbuf * buf = lua_newuserdata(L, sizeof(struct cellbuf));
+  memset(buf, 0, sizeof(*buf));
+  luaL_getmetatable(L, SURFACE);
+  lua_setmetatable(L, -2);
+
+  if (!resize_surface(buf, width, height)) return luaL_error(L, "out of memory");
+  return 1;
+}
+
+static int l_surface_gc(lua_State *L) {
+  struct cellbuf * buf = check_surface(L, 1);
+  free(buf->cells);
+  buf->cells = NULL;
+  buf->width = buf->height = 0;
+  return 0;
+}
+
+static int l_surface_width(lua_State *L) {
+  lua_pushinteger(L, check_surface(L, 1)->width);
+  return 1;
+}
+
+static int l_surface_height(lua_State *L) {
+  lua_pushinteger(L, check_surface(L, 1)->height);
+  return 1;
+}
+
+// surface:resize(width, height) also clears it, unless the size is the same
+static int l_surface_resize(lua_State *L) {
+  struct cellbuf * buf = check_surface(L, 1);
+  int width  = luaL_checkinteger(L, 2);
+  int height = luaL_checkinteger(L, 3);
+
+  luaL_argcheck(L, width >= 0 && height >= 0, 2, "invalid size");
+
+  if (width == buf->width && height == buf->height) return 0;
+  if (!resize_surface(buf, width, height)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+// surface:clear([fg, bg [, ch]])
+static int l_surface_clear(lua_State *L) {
+  struct cellbuf * buf = check_surface(L, 1);
+  uint32_t fg = luaL_optinteger(L, 2, TB_DEFAULT);
+  uint32_t bg = luaL_optinteger(L, 3, TB_DEFAULT);
+  uint32_t ch = lua_isnoneornil(L, 4) ? ' ' : normalize_char(luaL_checkstring(L, 4));
+
+  clear_cells(buf, ch, fg, bg);
+  return 0;
+}
+
+static int l_surface_char(lua_State *L) {
+  struct cellbuf * buf = check_surface(L, 1);
+  int x       = luaL_checkinteger(L, 2);
+  int y       = luaL_checkinteger(L, 3);
+  uint32_t fg = luaL_checkunsigned(L, 4);
+  uint32_t bg = luaL_checkunsigned(L, 5);
+  const char * str = luaL_checkstring(L, 6);
+
+  put_cell(buf, x, y, normalize_char(str), fg, bg);
+  return 0;
+}
+
+// surface:string(x, y, fg, bg, str [, limit]) -> columns used
+static int l_surface_string(lua_State *L) {
+  struct cellbuf * buf = check_surface(L, 1);
+  int x  = luaL_checkinteger(L, 2);
+  int y  = luaL_checkinteger(L, 3);
+  int fg = luaL_checkinteger(L, 4);
+  int bg = luaL_checkinteger(L, 5);
+  size_t len;
+  const char * str = luaL_checklstring(L, 6, &len);
+  int max = luaL_optinteger(L, 7, buf->width - x);
+
+  lua_pushinteger(L, put_text(buf, x, y, fg, bg, str, len, max));
+  return 1;
+}
+
+// surface:ansi_string(x, y, fg, bg, str [, max_cols]) is ansi_string() onto
+// the surface
+static int l_surface_ansi_string(lua_State *L) {
+  return draw_ansi_string(L, check_surface(L, 1), 2);
+}
+
+static int l_surface_stringf(lua_State *L) {
+  return draw_stringf(L, check_surface(L, 1), 2);
+}
+
+// surface:format(tmpl, x, y, fg, bg, ...) is tmpl:draw(...) onto the surface
+static int l_surface_format(lua_State *L) {
+  return draw_format(L, check_surface(L, 1), 2);
+}
+
+static int l_surface_runs(lua_State *L) {
+  return draw_runs(L, check_surface(L, 1), 2);
+}
+
+static int l_surface_blit(lua_State *L) {
+  return blit_cells(L, check_surface(L, 1), 2);
+}
+
+static int l_surface_copy(lua_State *L) {
+  return copy_cells(L, check_surface(L, 1), 2);
+}
+
+static int l_surface_snapshot(lua_State *L) {
+  return snapshot_cells(L, check_surface(L, 1), 2);
+}
+
+static int l_surface_scroll(lua_State *L) {
+  return scroll_cells(L, check_surface(L, 1), 2);
+}
+
+static int l_surface_fill(lua_State *L) {
+  return fill_cells(L, check_surface(L, 1), 2);
+}
+
+static int l_surface_border(lua_State *L) {
+  return border_cells(L, check_surface(L, 1), 2);
+}
+
+static int l_surface_shade(lua_State *L) {
+  return shade_cells(L, check_surface(L, 1), 2);
+}
+
+// surface:draw_to(x, y [, sx, sy, sw, sh]) copies the surface (or just the
+// sw*sh rect at sx/sy in it) onto the back buffer at x/y
+static int l_surface_draw_to(lua_State *L) {
+  struct cellbuf * buf = check_surface(L, 1);
+  int x  = luaL_checkinteger(L, 2);
+  int y  = luaL_checkinteger(L, 3);
+  int sx = luaL_optinteger(L, 4, 0);
+  int sy = luaL_optinteger(L, 5, 0);
+  int sw = luaL_optinteger(L, 6, buf->width - sx);
+  int sh = luaL_optinteger(L, 7, buf->height - sy);
+  struct cellbuf screen = screen_buffer();
+
+  copy_rect(&screen, x, y, buf, sx, sy, sw, sh);
+  return 0;
+}
+
+// surface:capture(x, y) fills the surface with what the back buffer has at
+// x/y, eg. to put it back later with draw_to(x, y)
+static int l_surface_capture(lua_State *L) {
+  struct cellbuf * buf = check_surface(L, 1);
+  int x = luaL_optinteger(L, 2, 0);
+  int y = luaL_optinteger(L, 3, 0);
+  struct cellbuf screen = screen_buffer();
+
+  copy_rect(buf, 0, 0, &screen, x, y, buf->width, buf->height);
+  return 0;
+}
+
+static const struct luaL_Reg l_surface[] = {
+  {"__gc",        l_surface_gc},
+  {"width",       l_surface_width},
+  {"height",      l_surface_height},
+  {"resize",      l_surface_resize},
+  {"clear",       l_surface_clear},
+  {"char",        l_surface_char},
+  {"string",      l_surface_string},
+  {"stringf",     l_surface_stringf},
+  {"ansi_string", l_surface_ansi_string},
+  {"format",      l_surface_format},
+  {"runs",        l_surface_runs},
+  {"blit",        l_surface_blit},
+  {"copy",        l_surface_copy},
+  {"snapshot",    l_surface_snapshot},
+  {"scroll",      l_surface_scroll},
+  {"fill",        l_surface_fill},
+  {"border",      l_surface_border},
+  {"shade",       l_surface_shade},
+  {"draw_to",     l_surface_draw_to},
+  {"capture",     l_surface_capture},
+  {NULL, NULL}
+};
+
+///////////////////
+// canvas
+
+// a grid of dots drawn as braille patterns (2x4 dots per cell) or half
+// blocks (1x2), for charts and sparklines that change every frame. dots are
+// addressed from 0 at the top left corner, and whatever falls outside the
+// canvas is dropped. each cell also keeps the color it was last drawn with,
+// if any, which draw_to() uses instead of its fg.
+#define CANVAS "luabox.canvas"
+#define NO_COLOR 0xFFFFFFFF
+
+enum { CANVAS_BRAILLE, CANVAS_HALF };
+
+static const char * const canvas_modes[] = { "braille", "half", NULL };
+
+struct canvas {
+  int mode;
+  int cols, rows;     // in cells
+  int width, height;  // in dots
+  uint8_t *dots;      // one bit per dot, one byte per cell
+  uint32_t *colors;   // per cell, or NO_COLOR
+};
+
+// bit for each dot of a cell by row and column, which is also how the
+// braille patterns from U+2800 on are numbered
+static const uint8_t braille_bits[4][2] = {
+  { 0x01, 0x08 }, { 0x02, 0x10 }, { 0x04, 0x20 }, { 0x40, 0x80 }
+};
+
+// none, top, bottom and both dots of a cell in half block mode
+static const uint32_t half_blocks[4] = { ' ', 0x2580, 0x2584, 0x2588 };
+
+static struct canvas * check_canvas(lua_State *L, int arg) {
+  return luaL_checkudata(L, arg, CANVAS);
+}
+
+static uint32_t opt_color(lua_State *L, int arg) {
+  return lua_isnoneornil(L, arg) ? NO_COLOR : (uint32_t)luaL_checkinteger(L, arg);
+}
+
+static void clear_canvas(struct canvas *c) {
+  size_t i, count = (size_t)c->cols * c->rows;
+
+  memset(c->dots, 0, count);
+  for (i = 0; i < count; i++) c->colors[i] = NO_COLOR;
+}
+
+static int resize_canvas(struct canvas *c, int cols, int rows) {
+  size_t count = (size_t)(cols ? cols : 1) * (rows ? rows : 1);
+  uint8_t * dots = malloc(count);
+  uint32_t * colors = malloc(count * sizeof(uint32_t));
+
+  if (!dots || !colors) {
+    free(dots);
+    free(colors);
+    return 0;
+  }
+
+  free(c->dots);
+  free(c->colors);
+  c->dots   = dots;
+  c->colors = colors;
+  c->cols   = cols;
+  c->rows   = rows;
+  c->width  = cols * (c->mode == CANVAS_BRAILLE ? 2 : 1);
+  c->height = rows * (c->mode == CANVAS_BRAILLE ? 4 : 2);
+  clear_canvas(c);
+  return 1;
+}
+
+static inline void set_dot(struct canvas *c, int x, int y, int on, uint32_t color) {
+  size_t cell;
+  uint8_t bit;
+
+  if (x < 0 || y < 0 || x >= c->width || y >= c->height) return;
+
+  if (c->mode == CANVAS_BRAILLE) {
+    cell = (size_t)(y >> 2) * c->cols + (x >> 1);
+    bit = braille_bits[y & 3][x & 1];
+  } else {
+    cell = (size_t)(y >> 1) * c->cols + x;
+    bit = 1 << (y & 1);
+  }
+
+  if (!on) {
+    c->dots[cell] &= ~bit;
+    return;
+  }
+
+  c->dots[cell] |= bit;
+  if (color != NO_COLOR) c->colors[cell] = color;
+}
+
+// clips the line from x0/y0 to x1/y1 to the canvas (liang-barsky), so a
+// line running far off it costs no more than one within it. returns 0 if
+// none of it is left.
+static int clip_line(const struct canvas *c, double *x0, double *y0, double *x1, double *y1) {
+  double dx = *x1 - *x0, dy = *y1 - *y0, t0 = 0, t1 = 1, t;
+  double p[4] = { -dx, dx, -dy, dy };
+  double q[4] = { *x0, c->width - 1 - *x0, *y0, c->height - 1 - *y0 };
+  int i;
+
+  // also rules out nan and huge values, which don't fit in an int
+  if (!(*x0 > -1e9 && *x0 < 1e9 && *y0 > -1e9 && *y0 < 1e9)) return 0;
+  if (!(*x1 > -1e9 && *x1 < 1e9 && *y1 > -1e9 && *y1 < 1e9)) return 0;
+
+  for (i = 0; i < 4; i++) {
+    if (p[i] == 0) {
+      if (q[i] < 0) return 0;
+      continue;
+    }
+
+    t = q[i] / p[i];
+    if (p[i] < 0) {
+      if (t > t1) return 0;
+      if (t > t0) t0 = t;
+    } else {
+      if (t < t0) return 0;
+      if (t < t1) t1 = t;
+    }
+  }
+
+  *x1 = *x0 + t1 * dx; *y1 = *y0 + t1 * dy;
+  *x0 = *x0 + t0 * dx; *y0 = *y0 + t0 * dy;
+  return 1;
+}
+
+static void draw_line(struct canvas *c, double fx0, double fy0, double fx1, double fy1, uint32_t color) {
+  int x0, y0, x1, y1, dx, dy, sx, sy, err, e2;
+
+  if (!clip_line(c, &fx0, &fy0, &fx1, &fy1)) return;
+
+  x0 = (int)(fx0 + 0.5); y0 = (int)(fy0 + 0.5);
+  x1 = (int)(fx1 + 0.5); y1 = (int)(fy1 + 0.5);
+  dx = abs(x1 - x0); sx = x0 < x1 ? 1 : -1;
+  dy = -abs(y1 - y0); sy = y0 < y1 ? 1 : -1;
+  err = dx + dy;
+
+  for (;;) {
+    set_dot(c, x0, y0, 1, color);
+    if (x0 == x1 && y0 == y1) break;
+
+    e2 = 2 * err;
+    if (e2 >= dy) { err += dy; x0 += sx; }
+    if (e2 <= dx) { err += dx; y0 += sy; }
+  }
+}
+
+// canvas(cols, rows [, mode]) -> canvas of cols*rows cells, in "braille"
+// (the default) or "half" block mode
+static int l_tb_canvas(lua_State *L) {
+  int cols = luaL_checkinteger(L, 1);
+  int rows = luaL_checkinteger(L, 2);
+  int mode = luaL_checkoption(L, 3, "braille", canvas_modes);
+
+  luaL_argcheck(L, cols >= 0 && rows >= 0 && cols < 0x8000 && rows < 0x8000, 1, "invalid size");
+
+  struct canvas * c = lua_newuserdata(L, sizeof(struct canvas));
+  memset(c, 0, sizeof(*c));
+  c->mode = mode;
+  luaL_getmetatable(L, CANVAS);
+  lua_setmetatable(L, -2);
+
+  if (!resize_canvas(c, cols, rows)) return luaL_error(L, "out of memory");
+  return 1;
+}
+
+static int l_canvas_gc(lua_State *L) {
+  struct canvas * c = check_canvas(L, 1);
+  free(c->dots);
+  free(c->colors);
+  c->dots = NULL;
+  c->colors = NULL;
+  c->cols = c->rows = c->width = c->height = 0;
+  return 0;
+}
+
+// canvas:size() -> width, height in dots, then cols, rows in cells
+static int l_canvas_size(lua_State *L) {
+  struct canvas * c = check_canvas(L, 1);
+  lua_pushinteger(L, c->width);
+  lua_pushinteger(L, c->height);
+  lua_pushinteger(L, c->cols);
+  lua_pushinteger(L, c->rows);
+  return 4;
+}
+
+// canvas:resize(cols, rows) also clears it, unless the size is the same
+static int l_canvas_resize(lua_State *L) {
+  struct canvas * c = check_canvas(L, 1);
+  int cols = luaL_checkinteger(L, 2);
+  int rows = luaL_checkinteger(L, 3);
+
+  luaL_argcheck(L, cols >= 0 && rows >= 0 && cols < 0x8000 && rows < 0x8000, 2, "invalid size");
+
+  if (cols == c->cols && rows == c->rows) return 0;
+  if (!resize_canvas(c, cols, rows)) return luaL_error(L, "out of memory");
+  return 0;
+}
+
+// canvas:clear() turns every dot off and forgets the colors
+static int l_canvas_clear(lua_State *L) {
+  clear_canvas(check_canvas(L, 1));
+  return 0;
+}
+
+// canvas:set(x, y [, color])
+static int l_canvas_set(lua_State *L) {
+  struct canvas * c = check_canvas(L, 1);
+  set_dot(c, luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), 1, opt_color(L, 4));
+  return 0;
+}
+
+// canvas:unset(x, y)
+static int l_canvas_unset(lua_State *L) {
+  struct canvas * c = check_canvas(L, 1);
+  set_dot(c, luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), 0, NO_COLOR);
+  return 0;
+}
+
+// canvas:line(x0, y0, x1, y1 [, color])
+static int l_canvas_line(lua_State *L) {
+  struct canvas * c = check_canvas(L, 1);
+  draw_line(c, luaL_checknumber(L, 2), luaL_checknumber(L, 3),
+    luaL_checknumber(L, 4), luaL_checknumber(L, 5), opt_color(L, 6));
+  return 0;
+}
+
+// canvas:rect(x, y, w, h [, color [, filled]])
+static int l_canvas_rect(lua_State *L) {
+  struct canvas * c = check_canvas(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  int w = luaL_checkinteger(L, 4);
+  int h = luaL_checkinteger(L, 5);
+  uint32_t color = opt_color(L, 6);
+  int right = x + w - 1, bottom = y + h - 1, row, col;
+
+  if (w <= 0 || h <= 0) return 0;
+
+  if (!lua_toboolean(L, 7)) {
+    draw_line(c, x, y, right, y, color);
+    draw_line(c, x, bottom, right, bottom, color);
+    draw_line(c, x, y, x, bottom, color);
+    draw_line(c, right, y, right, bottom, color);
+    return 0;
+  }
+
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  if (right >= c->width) right = c->width - 1;
+  if (bottom >= c->height) bottom = c->height - 1;
+
+  for (row = y; row <= bottom; row++) {
+    for (col = x; col <= right; col++) set_dot(c, col, row, 1, color);
+  }
+
+  return 0;
+}
+
+// draws the numbers in the array at arg across the whole canvas, the first
+// at the left edge and the last at the right one, scaled so min is at the
+// bottom and max at the top. with bars, each is a line up from the bottom,
+// otherwise a line joins it to the one before. a nil or nan breaks the line.
+static int plot_values(lua_State *L, int bars) {
+  struct canvas * c = check_canvas(L, 1);
+  int n, i, have_prev = 0;
+  double min, max, v, x, y, prev_x = 0, prev_y = 0, scale_x, scale_y, bottom;
+  uint32_t color;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = luaL_len(L, 2);
+  color = opt_color(L, 5);
+
+  if (lua_isnoneornil(L, 3) || lua_isnoneornil(L, 4)) {
+    double lo = HUGE_VAL, hi = -HUGE_VAL;
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, 2, i);
+      v = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+      if (v < lo) lo = v; // nan never compares
+      if (v > hi) hi = v;
+    }
+
+    if (lo > hi) lo = hi = 0; // nothing to plot
+    if (bars && lo > 0) lo = 0;
+    min = luaL_optnumber(L, 3, lo);
+    max = luaL_optnumber(L, 4, hi);
+  } else {
+    min = luaL_checknumber(L, 3);
+    max = luaL_checknumber(L, 4);
+  }
+
+  bottom  = c->height - 1;
+  scale_x = n > 1 ? (double)(c->width - 1) / (n - 1) : 0;
+  scale_y = max > min ? bottom / (max - min) : 0;
+
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 2, i);
+    v = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : NAN;
+    lua_pop(L, 1);
+
+    if (v != v) {
+      have_prev = 0;
+      continue;
+    }
+
+    x = (i - 1) * scale_x;
+    y = bottom - (v - min) * scale_y;
+
+    if (bars) draw_line(c, x, bottom, x, y, color);
+    else if (have_prev) draw_line(c, prev_x, prev_y, x, y, color);
+    else draw_line(c, x, y, x, y, color);
+
+    prev_x = x; prev_y = y;
+    have_prev = 1;
+  }
+
+  lua_pushnumber(L, min);
+  lua_pushnumber(L, max);
+  return 2;
+}
+
+// canvas:plot(values [, min, max [, color]]) -> min, max
+// draws the array of numbers as a line across the canvas. min and max
+// default to the lowest and highest value.
+static int l_canvas_plot(lua_State *L) {
+  return plot_values(L, 0);
+}
+
+// canvas:bars(values [, min, max [, color]]) -> min, max
+// same as plot(), with a bar up from the bottom for each value instead. min
+// defaults to 0, unless there are negative values.
+static int l_canvas_bars(lua_State *L) {
+  return plot_values(L, 1);
+}
+
+// canvas:draw_to(x, y [, fg [, bg]]) puts the canvas on the back buffer at
+// x/y, in fg where cells have no color of their own. cells without any dots
+// are left as they are if bg is nil, and so is the bg of the others.
+static int l_canvas_draw_to(lua_State *L) {
+  struct canvas * c = check_canvas(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  uint32_t fg = luaL_optinteger(L, 4, TB_DEFAULT);
+  int set_bg = !lua_isnoneornil(L, 5);
+  uint32_t bg = set_bg ? (uint32_t)luaL_checkinteger(L, 5) : 0;
+  struct cellbuf screen = screen_buffer();
+  int w = c->cols, h = c->rows, skip_x, skip_y, row, col;
+  struct tb_cell * cell;
+  size_t at;
+
+  if (!clip_rect(&screen, &x, &y, &w, &h, &skip_x, &skip_y)) return 0;
+
+  for (row = 0; row < h; row++) {
+    cell = &screen.cells[(y + row) * screen.width + x];
+    at = (size_t)(skip_y + row) * c->cols + skip_x;
+
+    for (col = 0; col < w; col++, cell++, at++) {
+      if (!c->dots[at]) {
+        if (!set_bg) continue;
+        cell->ch = ' ';
+      } else {
+        cell->ch = c->mode == CANVAS_BRAILLE ? (uint32_t)(0x2800 + c->dots[at]) : half_blocks[c->dots[at]];
+      }
+
+      cell->fg = c->colors[at] == NO_COLOR ? fg : c->colors[at];
+      if (set_bg) cell->bg = bg;
+    }
+  }
+
+  if (screen.dirty) memset(screen.dirty + y, 1, h);
+  stats.cells_written += w * h;
+  return 0;
+}
+
+static const struct luaL_Reg l_canvas[] = {
+  {"__gc",    l_canvas_gc},
+  {"size",    l_canvas_size},
+  {"resize",  l_canvas_resize},
+  {"clear",   l_canvas_clear},
+  {"set",     l_canvas_set},
+  {"unset",   l_canvas_unset},
+  {"line",    l_canvas_line},
+  {"rect",    l_canvas_rect},
+  {"plot",    l_canvas_plot},
+  {"bars",    l_canvas_bars},
+  {"draw_to", l_canvas_draw_to},
+  {NULL, NULL}
+};
+
+///////////////////
+// list store
+
+// lines of text kept back to back in one buffer, with the offset where each
+// one starts, so a list with a million rows costs about as much memory as
+// the text itself and nothing for the gc to walk. items are 1 based and
+// can only be appended. the last item stays open when the text loaded so
+// far didn't end in a newline, so the next load carries on with it.
+#define LIST_STORE "luabox.list_store"
+#define LIST_READ_SIZE 65536
+
+struct list_store {
+  char *text;
+  size_t len, cap;
+
+  size_t *starts;    // where each item begins, plus one for the open item's end
+  size_t count, starts_cap;
+
+  int open;          // last item has no newline yet
+};
+
+static struct list_store * check_list_store(lua_State *L, int arg) {
+  return luaL_checkudata(L, arg, LIST_STORE);
+}
+
+static int store_reserve(struct list_store *store, size_t len, size_t count) {
+  if (len > store->cap) {
+    size_t cap = store->cap ? store->cap : 4096;
+    while (cap < len) cap *= 2;
+    char * text = realloc(store->text, cap);
+    if (!text) return 0;
+    store->text = text;
+    store->cap  = cap;
+  }
+
+  if (count + 1 > store->starts_cap) {
+    size_t cap = store->starts_cap ? store->starts_cap : 256;
+    while (cap < count + 1) cap *= 2;
+    size_t * starts = realloc(store->starts, cap * sizeof(size_t));
+    if (!starts) return 0;
+    store->starts     = starts;
+    store->starts_cap = cap;
+  }
+
+  return 1;
+}
+
+// bounds of item i (0 based), leaving out the newline and a \r before it
+static void store_item(const struct list_store *store, size_t i, const char **str, size_t *len) {
+  size_t start = store->starts[i], stop = store->starts[i + 1];
+
+  if (stop > start && (i + 1 < store->count || !store->open)) stop--; // newline
+  if (stop > start && store->text[stop - 1] == '\r') stop--;
+
+  *str = store->text + start;
+  *len = stop - start;
+}
+
+// indexes the text between from and store->len, which was just added
+static int store_split(struct list_store *store, size_t from) {
+  const char * nl;
+
+  while (from < store->len) {
+    if (!store->open) {
+      if (!store_reserve(store, 0, store->count + 1)) return 0;
+      store->starts[store->count++] = from;
+      store->open = 1;
+    }
+
+    nl = memchr(store->text + from, '\n', store->len - from);
+    if (!nl) {
+      from = store->len;
+      break;
+    }
+
+    from = nl - store->text + 1;
+    store->open = 0;
+  }
+
+  if (store->count > 0) store->starts[store->count] = store->len;
+  return 1;
+}
+
+static void store_add_lines(lua_State *L, struct list_store *store, const char *str, size_t len) {
+  if (!store_reserve(store, store->len + len, 0)) luaL_error(L, "out of memory");
+  memcpy(store->text + store->len, str, len);
+  store->len += len;
+  if (!store_split(store, store->len - len)) luaL_error(L, "out of memory");
+}
+
+// reads fd until eof, or until it would block or max bytes were read.
+// returns the number of bytes read, or -1 on errors.
+static ssize_t store_read(struct list_store *store, int fd, size_t max, int *eof) {
+  size_t total = 0, want, from;
+  ssize_t n;
+
+  *eof = 0;
+  while (total < max) {
+    want = max - total < LIST_READ_SIZE ? max - total : LIST_READ_SIZE;
+    if (!store_reserve(store, store->len + want, 0)) return -1;
+
+    n = read(fd, store->text + store->len, want);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (n < 0) return -1;
+    if (n == 0) {
+      *eof = 1;
+      break;
+    }
+
+    from = store->len;
+    store->len += n;
+    total += n;
+    if (!store_split(store, from)) return -1;
+  }
+
+  return total;
+}
+
+// list_store([text]) -> store, with a line of text per item
+static int l_tb_list_store(lua_State *L) {
+  size_t len = 0;
+  const char * str = luaL_optlstring(L, 1, NULL, &len);
+
+  struct list_store * store = lua_newuserdata(L, sizeof(struct list_store));
+  memset(store, 0, sizeof(struct list_store));
+  luaL_getmetatable(L, LIST_STORE);
+  lua_setmetatable(L, -2);
+
+  if (str) store_add_lines(L, store, str, len);
+  return 1;
+}
+
+static int l_store_gc(lua_State *L) {
+  struct list_store * store = check_list_store(L, 1);
+  free(store->text);
+  free(store->starts);
+  store->text = NULL;
+  store->starts = NULL;
+  store->len = store->count = 0;
+  return 0;
+}
+
+// store:add_lines(text) appends a line per item. a last line without a
+// newline is continued by the next call.
+static int l_store_add_lines(lua_State *L) {
+  struct list_store * store = check_list_store(L, 1);
+  size_t len;
+  const char * str = luaL_checklstring(L, 2, &len);
+
+  store_add_lines(L, store, str, len);
+  lua_pushinteger(L, store->count);
+  return 1;
+}
+
+// store:push(item) appends item as is, even if it has newlines in it
+static int l_store_push(lua_State *L) {
+  struct list_store * store = check_list_store(L, 1);
+  size_t len;
+  const char * str = luaL_checklstring(L, 2, &len);
+
+  // room for the newline closing an open item too
+  if (!store_reserve(store, store->len + store->open + len + 1, store->count + 1))
+    return luaL_error(L, "out of memory");
+
+  if (store->open) { // close the open item first
+    store->text[store->len++] = '\n';
+    store->open = 0;
+  }
+
+  store->starts[store->count++] = store->len;
+  memcpy(store->text + store->len, str, len);
+  store->len += len;
+  store->text[store->len++] = '\n';
+  store->starts[store->count] = store->len;
+
+  lua_pushinteger(L, store->count);
+  return 1;
+}
+
+// store:load_fd(fd [, max_bytes]) -> bytes read, eof
+// reads lines from fd until eof, or until it would block if it's non
+// blocking, so it can be called whenever the fd is ready (see wait()).
+static int l_store_load_fd(lua_State *L) {
+  struct list_store * store = check_list_store(L, 1);
+  int fd = luaL_checkinteger(L, 2);
+  lua_Number max = luaL_optnumber(L, 3, -1);
+  int eof;
+
+  ssize_t n = store_read(store, fd, max < 0 ? (size_t)-1 : (size_t)max, &eof);
+  if (n < 0) return luaL_error(L, "read failed: %s", strerror(errno));
+
+  lua_pushinteger(L, n);
+  lua_pushboolean(L, eof);
+  return 2;
+}
+
+// store:load_file(path) -> bytes read, or nil and an error message
+static int l_store_load_file(lua_State *L) {
+  struct list_store * store = check_list_store(L, 1);
+  const char * path = luaL_checkstring(L, 2);
+  int fd, eof, err;
+  ssize_t n;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    return 2;
+  }
+
+  n = store_read(store, fd, (size_t)-1, &eof);
+  err = errno;
+  close(fd);
+
+  if (n < 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(err));
+    return 2;
+  }
+
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+// store:get(i) -> item i, or nil if out of range
+static int l_store_get(lua_State *L) {
+  struct list_store * store = check_list_store(L, 1);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  const char * str;
+  size_t len;
+
+  if (i < 1 || (size_t)i > store->count) return 0;
+  store_item(store, i - 1, &str, &len);
+  lua_pushlstring(L, str, len);
+  return 1;
+}
+
+static int l_store_count(lua_State *L) {
+  lua_pushinteger(L, check_list_store(L, 1)->count);
+  return 1;
+}
+
+// store:bytes() -> size of the text, and of everything allocated
+static int l_store_bytes(lua_State *L) {
+  struct list_store * store = check_list_store(L, 1);
+  lua_pushinteger(L, store->len);
+  lua_pushinteger(L, store->cap + store->starts_cap * sizeof(size_t));
+  return 2;
+}
+
+static int l_store_clear(lua_State *L) {
+  struct list_store * store = check_list_store(L, 1);
+  store->len = store->count = 0;
+  store->open = 0;
+  return 0;
+}
+
+// store:draw(x, y, w, h, first, fg, bg [, selected, sel_fg, sel_bg [, align_right]])
+// draws items first..first+h-1 on rows y..y+h-1, cut to w columns with an
+// ellipsis at the end if they don't fit. the selected item gets sel_fg and
+// sel_bg. only the text is drawn, the rest of each row is left alone.
+// returns the number of rows drawn.
+static int l_store_draw(lua_State *L) {
+  struct list_store * store = check_list_store(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  int w = luaL_checkinteger(L, 4);
+  int h = luaL_checkinteger(L, 5);
+  lua_Integer first = luaL_checkinteger(L, 6);
+  uint32_t fg = luaL_checkinteger(L, 7);
+  uint32_t bg = luaL_checkinteger(L, 8);
+  lua_Integer selected = luaL_optinteger(L, 9, 0);
+  uint32_t sel_fg = luaL_optinteger(L, 10, fg);
+  uint32_t sel_bg = luaL_optinteger(L, 11, bg);
+  int align_right = lua_toboolean(L, 12);
+
+  struct cellbuf screen = screen_buffer();
+  struct text_pos fit;
+  const char * str;
+  size_t len;
+  lua_Integer i;
+  int row, cols, dx;
+
+  if (first < 1) { h += first - 1; y -= first - 1; first = 1; }
+
+  for (row = 0; row < h && w > 0; row++) {
+    i = first + row;
+    if ((size_t)i > store->count) break;
+    if (y + row < 0 || y + row >= screen.height) continue;
+
+    store_item(store, i - 1, &str, &len);
+    fit = measure_text(str, len, w, 1);
+    if (fit.bytes < len) fit = measure_text(str, len, w - 1, 1); // room for the ellipsis
+
+    cols = fit.bytes < len ? fit.cols + 1 : fit.cols;
+    dx = align_right ? w - cols : 0;
+
+    if (i == selected) {
+      put_text(&screen, x + dx, y + row, sel_fg, sel_bg, str, fit.bytes, fit.cols);
+      if (fit.bytes < len) put_cell(&screen, x + dx + fit.cols, y + row, 0x2026, sel_fg, sel_bg);
+    } else {
+      put_text(&screen, x + dx, y + row, fg, bg, str, fit.bytes, fit.cols);
+      if (fit.bytes < len) put_cell(&screen, x + dx + fit.cols, y + row, 0x2026, fg, bg);
+    }
+  }
+
+  lua_pushinteger(L, row);
+  return 1;
+}
+
+static const struct luaL_Reg l_list_store[] = {
+  {"__gc",      l_store_gc},
+  {"__len",     l_store_count},
+  {"add_lines", l_store_add_lines},
+  {"push",      l_store_push},
+  {"load_fd",   l_store_load_fd},
+  {"load_file", l_store_load_file},
+  {"get",       l_store_get},
+  {"count",     l_store_count},
+  {"bytes",     l_store_bytes},
+  {"clear",     l_store_clear},
+  {"draw",      l_store_draw},
+  {NULL, NULL}
+};
+
+///////////////////
+// fuzzy matching
+
+// scores items the way fzf's v1 algorithm does: find the first occurrence of
+// the query as a subsequence, shrink it from the end to the shortest window,
+// then score that window with bonuses for matches at word boundaries, camel
+// case humps and consecutive runs, and penalties for gaps. matching is byte
+// wise, ignoring ascii case unless the query has upper case letters in it.
+//
+// a matcher keeps the items that matched its last query, so typing one more
+// char only has to look at those. big scans are split across threads.
+#define FUZZY "luabox.fuzzy"
+#define FUZZY_CHUNK 16384 // items per thread, at least
+#define FUZZY_MAX_THREADS 8
+
+#define SCORE_MATCH          16
+#define SCORE_GAP_START      -3
+#define SCORE_GAP_EXTENSION  -1
+#define BONUS_BOUNDARY       (SCORE_MATCH / 2)
+#define BONUS_BOUNDARY_WHITE (BONUS_BOUNDARY + 2)
+#define BONUS_DELIMITER      (BONUS_BOUNDARY + 1)
+#define BONUS_NON_WORD       (SCORE_MATCH / 2)
+#define BONUS_CAMEL_123      (BONUS_BOUNDARY + SCORE_GAP_EXTENSION)
+#define BONUS_CONSECUTIVE    (-(SCORE_GAP_START + SCORE_GAP_EXTENSION))
+#define BONUS_FIRST_CHAR     2 // multiplier
+
+enum { CHAR_WHITE, CHAR_NON_WORD, CHAR_DELIMITER, CHAR_LOWER, CHAR_UPPER, CHAR_NUMBER };
+
+struct fuzzy {
+  struct list_store own;    // copy of the items, if they came in a table
+  struct list_store *items; // either &own or a store passed in
+  int items_ref;            // keeps that store alive
+
+  int *cands;               // items that matched the last query, by index
+  int *scores;              // and their scores
+  size_t ncands, cands_cap;
+  size_t seen;              // item count when cands was built
+
+  char *query;
+  size_t query_len;
+  int has_query;            // cands is valid for query
+};
+
+struct fuzzy_job {
+  const struct fuzzy *f;
+  const char *query;
+  size_t query_len;
+  int case_sensitive;
+  const int *in;            // candidates to check, or NULL for n items from first
+  size_t first, n;
+  int *out, *out_scores;    // room for n matches
+  size_t nout;
+};
+
+struct fuzzy_hit {
+  int idx, score, len;
+};
+
+static inline int char_class(unsigned char c) {
+  if (c >= 'a' && c <= 'z') return CHAR_LOWER;
+  if (c >= 'A' && c <= 'Z') return CHAR_UPPER;
+  if (c >= '0' && c <= '9') return CHAR_NUMBER;
+  if (c >= 0x80) return CHAR_LOWER; // part of a utf-8 sequence, call it a letter
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return CHAR_WHITE;
+  if (c == '/' || c == ',' || c == ':' || c == ';' || c == '|') return CHAR_DELIMITER;
+  return CHAR_NON_WORD;
+}
+
+static inline int char_bonus(int prev, int cur) {
+  if (cur > CHAR_DELIMITER) {
+    if (prev == CHAR_WHITE) return BONUS_BOUNDARY_WHITE;
+    if (prev == CHAR_DELIMITER) return BONUS_DELIMITER;
+    if (prev == CHAR_NON_WORD) return BONUS_BOUNDARY;
+    if ((prev == CHAR_LOWER && cur == CHAR_UPPER) || (prev != CHAR_NUMBER && cur == CHAR_NUMBER))
+      return BONUS_CAMEL_123;
+    return 0;
+  }
+
+  if (cur == CHAR_NON_WORD || cur == CHAR_DELIMITER) return BONUS_NON_WORD;
+  if (cur == CHAR_WHITE) return BONUS_BOUNDARY_WHITE;
+  return 0;
+}
+
+static inline unsigned char fold(unsigned char c, int case_sensitive) {
+  return (!case_sensitive && c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+// returns the offset of the first byte in str equal to a or b, or len
+static size_t find_either(const char *str, size_t len, char a, char b) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; i < len; i++) {
+    if (str[i] == a || str[i] == b) return i;
+  }
+  return len;
+}
+
+// scores str against the query, or returns -1 if it doesn't match
+static int fuzzy_score(const char *str, size_t len, const char *query, size_t query_len, int case_sensitive) {
+  size_t pos = 0, start, stop, q, i;
+  int score = 0, in_gap = 0, consecutive = 0, first_bonus = 0, bonus, prev, cur;
+  unsigned char c, qc;
+
+  if (query_len == 0) return 0;
+
+  // forward: the end of the first occurrence, using simd to skip ahead
+  for (q = 0; q < query_len; q++) {
+    qc = query[q];
+    if (pos >= len) return -1;
+    if (!case_sensitive && qc >= 'a' && qc <= 'z')
+      pos += find_either(str + pos, len - pos, qc, qc - 32);
+    else
+      pos += find_either(str + pos, len - pos, qc, qc);
+    if (pos >= len) return -1;
+    pos++;
+  }
+  stop = pos;
+
+  // backward: the latest start for that end, which gives the tightest window
+  q = query_len;
+  for (i = stop; i-- > 0;) {
+    if (fold(str[i], case_sensitive) == (unsigned char)query[q - 1] && --q == 0) break;
+  }
+  start = i;
+
+  prev = start > 0 ? char_class(str[start - 1]) : CHAR_WHITE;
+  for (i = start, q = 0; i < stop; i++) {
+    c = str[i];
+    cur = char_class(c);
+
+    if (q < query_len && fold(c, case_sensitive) == (unsigned char)query[q]) {
+      score += SCORE_MATCH;
+      bonus = char_bonus(prev, cur);
+
+      if (consecutive == 0) {
+        first_bonus = bonus;
+      } else {
+        if (bonus >= BONUS_BOUNDARY && bonus > first_bonus) first_bonus = bonus;
+        if (first_bonus > bonus) bonus = first_bonus;
+        if (BONUS_CONSECUTIVE > bonus) bonus = BONUS_CONSECUTIVE;
+      }
+
+      score += q == 0 ? bonus * BONUS_FIRST_CHAR : bonus;
+      in_gap = 0;
+      consecutive++;
+      q++;
+    } else {
+      score += in_gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+      in_gap = 1;
+      consecutive = 0;
+      first_bonus = 0;
+    }
+
+    prev = cur;
+  }
+
+  return score;
+}
+
+static void * fuzzy_work(void *arg) {
+  struct fuzzy_job * job = arg;
+  const struct list_store * items = job->f->items;
+  const char * str;
+  size_t k, len;
+  int idx, score;
+
+  for (k = 0; k < job->n; k++) {
+    idx = job->in ? job->in[k] : (int)(job->first + k);
+    store_item(items, idx, &str, &len);
+
+    score = fuzzy_score(str, len, job->query, job->query_len, job->case_sensitive);
+    if (score < 0) continue;
+
+    job->out[job->nout] = idx;
+    job->out_scores[job->nout++] = score;
+  }
+
+  return NULL;
+}
+
+// workers can get here at the same time as the ui
+static int online_cpus(void) {
+  static int cpus = 0;
+  int n = __atomic_load_n(&cpus, __ATOMIC_RELAXED);
+  if (!n) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    n = online > 0 ? (int)online : 1;
+    __atomic_store_n(&cpus, n, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+// narrows cands down to the items matching query. if cands isn't valid for
+// a prefix of query, every item is checked again.
+static int fuzzy_filter(struct fuzzy *f, const char *query, size_t query_len) {
+  struct fuzzy_job jobs[FUZZY_MAX_THREADS];
+  pthread_t threads[FUZZY_MAX_THREADS];
+  int started[FUZZY_MAX_THREADS];
+  size_t count = f->items->count, n, per, from, i;
+  int case_sensitive = 0, nthreads, t;
+
+  int narrow = f->has_query && f->seen == count && query_len >= f->query_len
+            && memcmp(query, f->query, f->query_len) == 0;
+
+  if (narrow && query_len == f->query_len) return 1; // same query
+
+  n = narrow ? f->ncands : count;
+  if (count > f->cands_cap) {
+    int * cands  = realloc(f->cands, count * sizeof(int));
+    if (cands) f->cands = cands;
+    int * scores = realloc(f->scores, count * sizeof(int));
+    if (scores) f->scores = scores;
+    if (!cands || !scores) return 0;
+    f->cands_cap = count;
+  }
+
+  char * copy = realloc(f->query, query_len + 1);
+  if (!copy) return 0;
+  memcpy(copy, query, query_len);
+  f->query = copy;
+
+  for (i = 0; i < query_len; i++) {
+    if (query[i] >= 'A' && query[i] <= 'Z') case_sensitive = 1;
+  }
+
+  nthreads = (n + FUZZY_CHUNK - 1) / FUZZY_CHUNK;
+  if (nthreads > online_cpus()) nthreads = online_cpus();
+  if (nthreads > FUZZY_MAX_THREADS) nthreads = FUZZY_MAX_THREADS;
+  if (nthreads < 1) nthreads = 1;
+  per = (n + nthreads - 1) / nthreads;
+
+  // each job writes its matches over the start of its own slice, which it
+  // has already read by then, so narrowing can happen in place
+  for (t = 0, from = 0; t < nthreads; t++, from += per) {
+    struct fuzzy_job * job = &jobs[t];
+    size_t to = from + per < n ? from + per : n;
+
+    job->f = f;
+    job->query = query;
+    job->query_len = query_len;
+    job->case_sensitive = case_sensitive;
+    job->in = narrow ? f->cands + from : NULL;
+    job->first = from;
+    job->n = from < to ? to - from : 0;
+    job->out = f->cands + from;
+    job->out_scores = f->scores + from;
+    job->nout = 0;
+
+    started[t] = t > 0 && pthread_create(&threads[t], NULL, fuzzy_work, job) == 0;
+  }
+
+  fuzzy_work(&jobs[0]);
+  for (t = 1; t < nthreads; t++) {
+    if (started[t]) pthread_join(threads[t], NULL);
+    else fuzzy_work(&jobs[t]);
+  }
+
+  // close the gaps between the slices
+  for (t = 0, f->ncands = 0; t < nthreads; t++) {
+    if (jobs[t].out != f->cands + f->ncands) {
+      memmove(f->cands + f->ncands, jobs[t].out, jobs[t].nout * sizeof(int));
+      memmove(f->scores + f->ncands, jobs[t].out_scores, jobs[t].nout * sizeof(int));
+    }
+    f->ncands += jobs[t].nout;
+  }
+
+  f->query_len = query_len;
+  f->seen = count;
+  f->has_query = 1;
+  return 1;
+}
+
+// best first: higher score, then shorter item, then earlier item
+static int hit_better(const struct fuzzy_hit *a, const struct fuzzy_hit *b) {
+  if (a->score != b->score) return a->score > b->score;
+  if (a->len != b->len) return a->len < b->len;
+  return a->idx < b->idx;
+}
+
+static int hit_cmp(const void *a, const void *b) {
+  return hit_better(a, b) ? -1 : hit_better(b, a) ? 1 : 0;
+}
+
+// keeps the best k hits in a heap with the worst one on top
+static void hit_sift_down(struct fuzzy_hit *heap, size_t n, size_t pos) {
+  struct fuzzy_hit hit = heap[pos];
+  size_t child;
+
+  while ((child = pos * 2 + 1) < n) {
+    if (child + 1 < n && hit_better(&heap[child], &heap[child + 1])) child++;
+    if (!hit_better(&hit, &heap[child])) break;
+    heap[pos] = heap[child];
+    pos = child;
+  }
+  heap[pos] = hit;
+}
+
+static struct fuzzy * check_fuzzy(lua_State *L, int arg) {
+  return luaL_checkudata(L, arg, FUZZY);
+}
+
+// fuzzy_matcher(items) -> matcher, for a list_store or a table of strings.
+// a table is copied, so changes to it afterwards aren't seen. a store can
+// keep growing, its new items are picked up by the next match.
+static int l_tb_fuzzy_matcher(lua_State *L) {
+  struct fuzzy * f = lua_newuserdata(L, sizeof(struct fuzzy));
+  memset(f, 0, sizeof(struct fuzzy));
+  f->items_ref = LUA_NOREF;
+  luaL_getmetatable(L, FUZZY);
+  lua_setmetatable(L, -2);
+
+  if (lua_istable(L, 1)) {
+    int i, n = luaL_len(L, 1);
+    size_t len;
+    const char * str;
+
+    f->items = &f->own;
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, 1, i);
+      str = lua_tolstring(L, -1, &len);
+      if (!str) { str = ""; len = 0; }
+
+      if (!store_reserve(&f->own, f->own.len + len + 1, f->own.count + 1))
+        return luaL_error(L, "out of memory");
+      f->own.starts[f->own.count++] = f->own.len;
+      memcpy(f->own.text + f->own.len, str, len);
+      f->own.len += len;
+      f->own.text[f->own.len++] = '\n';
+      f->own.starts[f->own.count] = f->own.len;
+      lua_pop(L, 1);
+    }
+  } else {
+    f->items = check_list_store(L, 1);
+    lua_pushvalue(L, 1);
+    f->items_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  return 1;
+}
+
+static int l_fuzzy_gc(lua_State *L) {
+  struct fuzzy * f = check_fuzzy(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, f->items_ref);
+  free(f->own.text);
+  free(f->own.starts);
+  free(f->cands);
+  free(f->scores);
+  free(f->query);
+  memset(f, 0, sizeof(struct fuzzy));
+  f->items_ref = LUA_NOREF;
+  f->items = &f->own;
+  return 0;
+}
+
+// matcher:match(query [, limit]) -> indices, total
+// returns the indices of the best limit items (all by default) matching
+// query, best first, plus the total number of items that matched.
+static int l_fuzzy_match(lua_State *L) {
+  struct fuzzy * f = check_fuzzy(L, 1);
+  size_t query_len, i, nhits = 0;
+  const char * query = luaL_checklstring(L, 2, &query_len);
+  lua_Integer limit = luaL_optinteger(L, 3, 0);
+  struct fuzzy_hit * hits, hit;
+  const char * str;
+  size_t len;
+
+  if (!fuzzy_filter(f, query, query_len)) return luaL_error(L, "out of memory");
+
+  size_t k = limit > 0 && (size_t)limit < f->ncands ? (size_t)limit : f->ncands;
+  hits = malloc((k ? k : 1) * sizeof(struct fuzzy_hit));
+  if (!hits) return luaL_error(L, "out of memory");
+
+  for (i = 0; i < f->ncands; i++) {
+    store_item(f->items, f->cands[i], &str, &len);
+    hit.idx = f->cands[i];
+    hit.score = f->scores[i];
+    hit.len = query_len > 0 ? len : 0; // keep the original order otherwise
+
+    if (nhits < k) {
+      hits[nhits++] = hit;
+      if (nhits == k) { // heapify once full
+        size_t pos = k / 2;
+        while (pos-- > 0) hit_sift_down(hits, k, pos);
+      }
+    } else if (k > 0 && hit_better(&hit, &hits[0])) {
+      hits[0] = hit;
+      hit_sift_down(hits, k, 0);
+    }
+  }
+
+  qsort(hits, nhits, sizeof(struct fuzzy_hit), hit_cmp);
+
+  lua_createtable(L, nhits, 0);
+  for (i = 0; i < nhits; i++) {
+    lua_pushinteger(L, hits[i].idx + 1);
+    lua_rawseti(L, -2, i + 1);
+  }
+  free(hits);
+
+  lua_pushinteger(L, f->ncands);
+  return 2;
+}
+
+// fuzzy(items, query [, limit]) -> indices, total, for a one off match
+static int l_tb_fuzzy(lua_State *L) {
+  lua_settop(L, 3);
+  lua_pushcfunction(L, l_tb_fuzzy_matcher);
+  lua_pushvalue(L, 1);
+  lua_call(L, 1, 1);
+  lua_replace(L, 1);
+  return l_fuzzy_match(L);
+}
+
+// fuzzy_score(str, query) -> score, or nil if str doesn't match
+static int l_tb_fuzzy_score(lua_State *L) {
+  size_t len, query_len, i;
+  const char * str = luaL_checklstring(L, 1, &len);
+  const char * query = luaL_checklstring(L, 2, &query_len);
+  int case_sensitive = 0, score;
+
+  for (i = 0; i < query_len; i++) {
+    if (query[i] >= 'A' && query[i] <= 'Z') case_sensitive = 1;
+  }
+
+  score = fuzzy_score(str, len, query, query_len, case_sensitive);
+  if (score < 0) return 0;
+  lua_pushinteger(L, score);
+  return 1;
+}
+
+static const struct luaL_Reg l_fuzzy[] = {
+  {"__gc",  l_fuzzy_gc},
+  {"match", l_fuzzy_match},
+  {NULL, NULL}
+};
+
+///////////////////
+// workers
+
+// a worker runs a script in a lua state of its own, on a thread of its own,
+// so slow work (git queries, file scans, parsing) doesn't hold up input and
+// rendering. it talks to the ui through two bounded single producer, single
+// consumer rings, one each way. a message is a list of nils, booleans,
+// numbers, strings and tables of those, serialized into a single block that
+// is handed over as is. each side has a wakeup fd (an eventfd on linux, a
+// pipe elsewhere) that turns readable when there's something for it, so the
+// ui can wait() on a worker's fd along with everything else.
+#define WORKER "luabox.worker"
+#define WORKER_QUEUE_SIZE 256 // messages each way
+#define WORKER_MAX_DEPTH 32   // of nested tables
+#define WORKER_ERROR_SIZE 64  // for what went wrong encoding a message
 
-  #define luaL_checkunsigned(L, narg) (luaL_checknumber(L, narg))
-  #define luaL_len(L, idx)            (lua_objlen(L, idx))
+enum { MSG_NIL, MSG_FALSE, MSG_TRUE, MSG_NUMBER, MSG_STRING, MSG_TABLE, MSG_END };
+enum { WORKER_RUNNING, WORKER_DONE, WORKER_FAILED };
 
-#elif defined(LUA_VERSION_NUM) && LUA_VERSION_NUM == 503
-  #define luaL_checkunsigned(L, narg) (luaL_checknumber(L, narg))
-#endif
+struct message {
+  size_t len, cap;
+  int count; // values at the top level
+  char data[];
+};
 
-static struct tb_event event;
+struct ring {
+  struct message **slots;
+  size_t size;       // a power of two
+  size_t head, tail; // next slot to read, and to write
+};
 
-static int l_tb_init(lua_State *L) {
-  lua_pushinteger(L, tb_init());
-  return 1;
-}
+struct wakeup {
+  int fd[2];         // read and write ends, the same eventfd on linux
+  int signaled;      // written to fd since the owner last reset it
+};
 
-static int l_tb_init_with(lua_State *L) {
-  uint16_t flags = luaL_checkunsigned(L, 1);
-  lua_pushinteger(L, tb_init_with(flags));
-  return 1;
+struct worker {
+  struct ring inbox;      // ui -> worker
+  struct ring outbox;     // worker -> ui
+  struct wakeup ui;       // there are messages for the ui
+  struct wakeup thread;   // there are messages for the worker, room to send or it was closed
+  pthread_t thread_id;
+  int started, joined;
+
+  int refs;               // the ui's handle and the thread, whoever is last frees it
+  int closed;             // by the ui, so the worker should finish
+  int state;
+  char *error;
+
+  char *script;
+  size_t script_len;
+  struct message *args;
+};
+
+// set on worker threads, so loading the module there gets open_worker_lib()
+static __thread int worker_thread;
+
+static struct worker ** check_worker_handle(lua_State *L, int arg) {
+  return luaL_checkudata(L, arg, WORKER);
 }
 
-static int l_tb_shutdown(lua_State *L) {
-  mouse_enabled = 0;
-  tb_shutdown();
-  return 0;
+static struct worker * check_worker(lua_State *L, int arg) {
+  struct worker ** handle = check_worker_handle(L, arg);
+  if (!*handle) luaL_error(L, "worker was freed");
+  return *handle;
 }
 
-static int l_tb_width(lua_State *L) {
-  lua_pushinteger(L, tb_width());
+static int msg_reserve(struct message **msg, size_t more) {
+  struct message * grown;
+  size_t cap;
+
+  if ((*msg)->len + more <= (*msg)->cap) return 1;
+
+  cap = (*msg)->cap * 2;
+  while (cap < (*msg)->len + more) cap *= 2;
+  if (!(grown = realloc(*msg, sizeof(struct message) + cap))) return 0;
+
+  grown->cap = cap;
+  *msg = grown;
   return 1;
 }
 
-static int l_tb_height(lua_State *L) {
-  lua_pushinteger(L, tb_height());
+static int msg_add(struct message **msg, const void *data, size_t len) {
+  if (!msg_reserve(msg, len)) return 0;
+  memcpy((*msg)->data + (*msg)->len, data, len);
+  (*msg)->len += len;
   return 1;
 }
 
-static int l_tb_clear_screen(lua_State *L) {
-  tb_clear_screen();
-  return 0;
+static int msg_add_tag(struct message **msg, char tag) {
+  return msg_add(msg, &tag, 1);
 }
 
-static int l_tb_clear_buffer(lua_State *L) {
-  tb_clear_buffer();
+static int encode_failed(char *err, const char *what) {
+  snprintf(err, WORKER_ERROR_SIZE, "%s", what);
   return 0;
 }
 
-static int l_tb_set_clear_attributes(lua_State *L) {
-  uint16_t fg = luaL_checkunsigned(L, 1);
-  uint16_t bg = luaL_checkunsigned(L, 2);
+// appends the value at idx. returns 0 if it can't, with what went wrong
+// copied to err, which holds WORKER_ERROR_SIZE bytes. leaves the stack as is.
+static int encode_value(lua_State *L, int idx, struct message **msg, int depth, char *err) {
+  const char * str;
+  lua_Number num;
+  size_t len;
 
-  lua_pop(L, 2);
-  tb_set_clear_attributes(fg, bg);
-  return 0;
-}
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+      return msg_add_tag(msg, MSG_NIL) || encode_failed(err, "out of memory");
 
-static int l_tb_resize(lua_State *L) {
-  tb_resize();
-  return 0;
+    case LUA_TBOOLEAN:
+      return msg_add_tag(msg, lua_toboolean(L, idx) ? MSG_TRUE : MSG_FALSE) || encode_failed(err, "out of memory");
+
+    case LUA_TNUMBER:
+      num = lua_tonumber(L, idx);
+      return (msg_add_tag(msg, MSG_NUMBER) && msg_add(msg, &num, sizeof(num))) || encode_failed(err, "out of memory");
+
+    case LUA_TSTRING:
+      str = lua_tolstring(L, idx, &len);
+      return (msg_add_tag(msg, MSG_STRING) && msg_add(msg, &len, sizeof(len)) && msg_add(msg, str, len))
+        || encode_failed(err, "out of memory");
+
+    case LUA_TTABLE:
+      if (depth >= WORKER_MAX_DEPTH) return encode_failed(err, "tables nested too deep (or a cycle)");
+      if (!lua_checkstack(L, 2)) return encode_failed(err, "stack overflow");
+      if (idx < 0) idx = lua_gettop(L) + idx + 1;
+      if (!msg_add_tag(msg, MSG_TABLE)) return encode_failed(err, "out of memory");
+
+      lua_pushnil(L);
+      while (lua_next(L, idx)) {
+        if (!encode_value(L, -2, msg, depth + 1, err) || !encode_value(L, -1, msg, depth + 1, err)) {
+          lua_pop(L, 2);
+          return 0;
+        }
+        lua_pop(L, 1);
+      }
+
+      return msg_add_tag(msg, MSG_END) || encode_failed(err, "out of memory");
+
+    default:
+      snprintf(err, WORKER_ERROR_SIZE, "can't send a %s", luaL_typename(L, idx));
+      return 0;
+  }
 }
 
-static int l_tb_render(lua_State *L) {
-  tb_render();
-  return 0;
+// serializes the values from first to the top of the stack into a message
+static struct message * encode_message(lua_State *L, int first) {
+  struct message * msg = malloc(sizeof(struct message) + 256);
+  char err[WORKER_ERROR_SIZE];
+  int i, top = lua_gettop(L);
+
+  if (!msg) luaL_error(L, "out of memory");
+  msg->len = 0;
+  msg->cap = 256;
+  msg->count = top >= first ? top - first + 1 : 0;
+
+  for (i = first; i <= top; i++) {
+    if (!encode_value(L, i, &msg, 0, err)) {
+      free(msg);
+      luaL_error(L, "%s", err);
+    }
+  }
+
+  return msg;
 }
 
-static int l_tb_set_cursor(lua_State *L) {
-  int cx = luaL_checkinteger(L, 1);
-  int cy = luaL_checkinteger(L, 2);
+static void decode_value(lua_State *L, const char **pos) {
+  char tag = *(*pos)++;
+  lua_Number num;
+  size_t len;
 
-  lua_pop(L, 2);
-  tb_set_cursor(cx, cy);
-  return 0;
+  switch (tag) {
+    case MSG_NIL:   lua_pushnil(L); break;
+    case MSG_FALSE: lua_pushboolean(L, 0); break;
+    case MSG_TRUE:  lua_pushboolean(L, 1); break;
+
+    case MSG_NUMBER:
+      memcpy(&num, *pos, sizeof(num));
+      *pos += sizeof(num);
+      lua_pushnumber(L, num);
+      break;
+
+    case MSG_STRING:
+      memcpy(&len, *pos, sizeof(len));
+      *pos += sizeof(len);
+      lua_pushlstring(L, *pos, len);
+      *pos += len;
+      break;
+
+    case MSG_TABLE:
+      luaL_checkstack(L, 3, "message too deep");
+      lua_newtable(L);
+      while (**pos != MSG_END) {
+        decode_value(L, pos);
+        decode_value(L, pos);
+        lua_rawset(L, -3);
+      }
+      (*pos)++;
+      break;
+  }
 }
 
-static int l_tb_show_cursor(lua_State *L) {
-  tb_show_cursor();
-  return 0;
+// pushes the values in msg, returning how many there were
+static int decode_message(lua_State *L, struct message *msg) {
+  const char * pos = msg->data;
+  int i;
+
+  luaL_checkstack(L, msg->count, "too many values in message");
+  for (i = 0; i < msg->count; i++) decode_value(L, &pos);
+  return msg->count;
 }
 
-static int l_tb_hide_cursor(lua_State *L) {
-  tb_hide_cursor();
-  return 0;
+static int wakeup_open(struct wakeup *w) {
+  w->signaled = 0;
+#ifdef __linux__
+  w->fd[0] = w->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return w->fd[0] >= 0;
+#else
+  if (pipe(w->fd) < 0) return 0;
+  fcntl(w->fd[0], F_SETFL, O_NONBLOCK);  fcntl(w->fd[1], F_SETFL, O_NONBLOCK);
+  fcntl(w->fd[0], F_SETFD, FD_CLOEXEC);  fcntl(w->fd[1], F_SETFD, FD_CLOEXEC);
+  return 1;
+#endif
 }
 
-static int l_tb_cell(lua_State *L) {
-  int x = luaL_checkinteger(L, 1);
-  int y = luaL_checkinteger(L, 2);
-  luaL_checktype(L, 3, LUA_TTABLE);
+static void wakeup_close(struct wakeup *w) {
+  if (w->fd[0] >= 0) close(w->fd[0]);
+  if (w->fd[1] >= 0 && w->fd[1] != w->fd[0]) close(w->fd[1]);
+  w->fd[0] = w->fd[1] = -1;
+}
 
-/* TODO: allow less than 3 members by default values */
-  lua_getfield(L, 3, "ch");
-  lua_getfield(L, 3, "fg");
-  lua_getfield(L, 3, "bg");
+// makes the fd readable, unless it already is
+static void wakeup_signal(struct wakeup *w) {
+  uint64_t one = 1;
+  if (__atomic_exchange_n(&w->signaled, 1, __ATOMIC_SEQ_CST)) return;
+  if (write(w->fd[1], &one, sizeof(one))) {} // full means it's readable anyway
+}
 
-  const struct tb_cell cell = {
-    .ch = luaL_checkstring(L, -3)[0],
-    .fg = luaL_checkinteger(L, -2),
-    .bg = luaL_checkinteger(L, -1),
-  };
+// drains the fd. owners call this before looking for work again, so any
+// signal sent after that point isn't lost.
+static void wakeup_reset(struct wakeup *w) {
+  uint64_t buf[8];
+  __atomic_store_n(&w->signaled, 0, __ATOMIC_SEQ_CST);
+  while (read(w->fd[0], buf, sizeof(buf)) > 0);
+}
 
-  lua_pop(L, 6);
-  tb_cell(x, y, &cell);
-  return 0;
+static void wakeup_wait(struct wakeup *w, int timeout) {
+  struct pollfd pfd = { w->fd[0], POLLIN, 0 };
+  while (poll(&pfd, 1, timeout) < 0 && errno == EINTR);
 }
 
-static uint32_t normalize_char(const char * str) {
-  uint32_t ch;
+static int ring_init(struct ring *r, size_t size) {
+  r->size = 1;
+  while (r->size < size) r->size *= 2;
+  r->head = r->tail = 0;
+  r->slots = malloc(r->size * sizeof(struct message *));
+  return r->slots != NULL;
+}
 
-  // str might be a number (char code), a unicode string or an actual char
-  // we'll start checking with the most probable scenario: a regular char
-  if (!str[1]) {
-    ch = str[0];
-  } else if (str[1] >= '0' && str[1] <= '9') { // looks like a number
-    ch = atoi(str);
-  } else {
-    tb_utf8_char_to_unicode(&ch, str);
-  }
+// only called by the producer. returns 0 if the ring is full.
+static int ring_push(struct ring *r, struct message *msg) {
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
 
-  return ch;
+  if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->size) return 0;
+  r->slots[tail & (r->size - 1)] = msg;
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+  return 1;
 }
 
-static int l_tb_char(lua_State* L) {
-  int x       = luaL_checkinteger(L, 1);
-  int y       = luaL_checkinteger(L, 2);
-  uint16_t fg = luaL_checkunsigned(L, 3);
-  uint16_t bg = luaL_checkunsigned(L, 4);
-  const char * str = luaL_checkstring(L, 5);
+// only called by the consumer. returns NULL if the ring is empty, and sets
+// was_full when the producer might be waiting for room.
+static struct message * ring_pop(struct ring *r, int *was_full) {
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+  struct message * msg;
 
-  uint32_t ch = normalize_char(str);
-  tb_char(x, y, fg, bg, ch);
+  if (head == tail) return NULL;
+  msg = r->slots[head & (r->size - 1)];
+  *was_full = tail - head == r->size;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+  return msg;
+}
 
-  lua_pop(L, 5);
-  return 0;
+static void ring_free(struct ring *r) {
+  struct message * msg;
+  int was_full;
+
+  if (!r->slots) return;
+  while ((msg = ring_pop(r, &was_full))) free(msg);
+  free(r->slots);
+  r->slots = NULL;
 }
 
-static int l_tb_string(lua_State *L) {
-  int x = luaL_checkinteger(L, 1);
-  int y = luaL_checkinteger(L, 2);
-  int fg = luaL_checkinteger(L, 3);
-  int bg = luaL_checkinteger(L, 4);
-  const char * str = luaL_checkstring(L, 5);
+// takes the next message from r, resetting our wakeup before trying again
+// if it looks empty. the other side is woken up if it was waiting for room.
+static struct message * take_message(struct ring *r, struct wakeup *ours, struct wakeup *theirs) {
+  struct message * msg;
+  int was_full = 0;
 
-  int len;
-  if (lua_gettop(L) == 6) {
-    len = tb_string_with_limit(x, y, fg, bg, (char *)str, luaL_checkinteger(L, 6));
-  } else {
-    len = tb_string(x, y, fg, bg, (char *)str);
+  if (!(msg = ring_pop(r, &was_full))) {
+    wakeup_reset(ours);
+    msg = ring_pop(r, &was_full);
   }
 
-  lua_pushinteger(L, len);
-  return 1;
+  if (was_full) wakeup_signal(theirs);
+  return msg;
 }
 
-static int l_tb_stringf(lua_State *L) {
-  int x = luaL_checkinteger(L, 1);
-  int y = luaL_checkinteger(L, 2);
-  int fg = luaL_checkinteger(L, 3);
-  int bg = luaL_checkinteger(L, 4);
-  const char * fmt = luaL_checkstring(L, 5);
+static void release_worker(struct worker *w) {
+  if (__atomic_sub_fetch(&w->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
 
-  int buflen = strlen(fmt);   // initial buffer length
-  int total  = lua_gettop(L); // total arguments passed
-  int remain = total - 5;     // remaning arguments in stack
+  ring_free(&w->inbox);
+  ring_free(&w->outbox);
+  wakeup_close(&w->ui);
+  wakeup_close(&w->thread);
+  free(w->args);
+  free(w->script);
+  free(w->error);
+  free(w);
+}
 
-  char * arr[remain];
-  // char ** arr = calloc(remain, sizeof(char *));
+static struct worker * worker_upvalue(lua_State *L) {
+  return lua_touserdata(L, lua_upvalueindex(1));
+}
 
-  int i = remain;
-  while (i--) {
-    arr[i] = (char *)luaL_checkstring(L, 6 + i);
-    buflen += strlen(arr[i]);
-  }
+// worker.send(...) -> true, or false if the ui has closed the worker.
+// waits while the queue to the ui is full.
+static int l_worker_send(lua_State *L) {
+  struct worker * w = worker_upvalue(L);
+  struct message * msg = encode_message(L, 1);
 
-  char final[buflen * 2];
-  arsprintf(final, fmt, arr);
+  while (!ring_push(&w->outbox, msg)) {
+    if (__atomic_load_n(&w->closed, __ATOMIC_ACQUIRE)) {
+      free(msg);
+      lua_pushboolean(L, 0);
+      return 1;
+    }
 
-  int len = tb_string(x, y, fg, bg, final);
-  lua_pushinteger(L, len);
+    wakeup_reset(&w->thread);
+    if (ring_push(&w->outbox, msg)) break;
+    wakeup_wait(&w->thread, -1);
+  }
 
+  wakeup_signal(&w->ui);
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-static int l_tb_enable_mouse(lua_State *L) {
-  if (!mouse_enabled) tb_enable_mouse();
-  mouse_enabled = 1;
-  return 0;
-}
+// worker.recv([timeout]) -> true, ... or nil on timeout, or nil and
+// "closed" once the ui has closed the worker and there's nothing left to
+// read. waits forever if timeout (in ms) is nil or negative.
+static int l_worker_recv(lua_State *L) {
+  struct worker * w = worker_upvalue(L);
+  int timeout = luaL_optinteger(L, 1, -1), n;
+  double deadline = timeout >= 0 ? now_us() + timeout * 1000.0 : 0;
+  struct message * msg;
 
-static int l_tb_disable_mouse(lua_State *L) {
-  if (mouse_enabled) tb_disable_mouse();
-  mouse_enabled = 0;
-  return 0;
-}
+  while (!(msg = take_message(&w->inbox, &w->thread, &w->ui))) {
+    if (__atomic_load_n(&w->closed, __ATOMIC_ACQUIRE)) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "closed");
+      return 2;
+    }
 
-static int l_tb_enable_focus_tracking(lua_State *L) {
-  if (!focus_tracking_enabled) tb_enable_focus_tracking();
-  focus_tracking_enabled = 1;
-  return 0;
-}
+    if (timeout >= 0) {
+      timeout = (int)((deadline - now_us()) / 1000.0);
+      if (timeout <= 0) return 0;
+    }
 
-static int l_tb_disable_focus_tracking(lua_State *L) {
-  if (focus_tracking_enabled) tb_disable_focus_tracking();
-  focus_tracking_enabled = 0;
-  return 0;
+    wakeup_wait(&w->thread, timeout);
+  }
+
+  lua_pushboolean(L, 1);
+  n = decode_message(L, msg);
+  free(msg);
+  return n + 1;
 }
 
-static int l_tb_toggle_mouse(lua_State *L) {
-  return mouse_enabled ? l_tb_disable_mouse(L) : l_tb_enable_mouse(L);
+// worker.closed() -> whether the ui has closed the worker
+static int l_worker_closed(lua_State *L) {
+  lua_pushboolean(L, __atomic_load_n(&worker_upvalue(L)->closed, __ATOMIC_ACQUIRE));
+  return 1;
 }
 
-static int l_tb_select_output_mode(lua_State *L) {
-  int mode = luaL_checkinteger(L, 1);
+// what require('luabox') gets in a worker: the types and text functions that
+// keep no state outside their own userdata, minus the draw() methods. the
+// rest (the screen, events, timers, stats, traces) shares globals that only
+// the ui thread may touch.
+static const struct luaL_Reg l_luabox_worker[] = {
+  {"ansi",                 l_tb_ansi},
+  {"list_store",           l_tb_list_store},
+  {"fuzzy",                l_tb_fuzzy},
+  {"fuzzy_matcher",        l_tb_fuzzy_matcher},
+  {"fuzzy_score",          l_tb_fuzzy_score},
+  {"text_width",           l_tb_text_width},
+  {"clip_to_width",        l_tb_clip_to_width},
+  {"col_to_index",         l_tb_col_to_index},
+  {"expand_tabs",          l_tb_expand_tabs},
+  {"graphemes",            l_tb_graphemes},
+  {"grapheme_count",       l_tb_grapheme_count},
+  {"grapheme_sub",         l_tb_grapheme_sub},
+  {"is_emoji",             l_tb_is_emoji},
+  {"nfc",                  l_tb_nfc},
+  {"nfd",                  l_tb_nfd},
+  {"wrap_index",           l_tb_wrap_index},
+  {"text_buffer",          l_tb_text_buffer},
+  {"utf8_char_length",     l_tb_utf8_char_length},
+  {"utf8_char_to_unicode", l_tb_utf8_char_to_unicode},
+  {"utf8_unicode_to_char", l_tb_utf8_unicode_to_char},
+  {"is_char_wide",         l_tb_is_char_wide},
+  {NULL, NULL}
+};
 
+// like register_type, leaving out draw()
+static void register_worker_type(lua_State *L, const char *name, const luaL_Reg *methods) {
+  luaL_newmetatable(L, name);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  for (; methods->name; methods++) {
+    if (strcmp(methods->name, "draw") == 0) continue;
+    lua_pushcfunction(L, methods->func);
+    lua_setfield(L, -2, methods->name);
+  }
   lua_pop(L, 1);
-  lua_pushinteger(L, tb_select_output_mode(mode));
+}
+
+static int open_worker_lib(lua_State *L) {
+  register_worker_type(L, WRAP_INDEX, l_wrap_index);
+  register_worker_type(L, TEXT_BUFFER, l_text_buffer);
+  register_worker_type(L, ANSI, l_ansi);
+  register_worker_type(L, LIST_STORE, l_list_store);
+  register_worker_type(L, FUZZY, l_fuzzy);
+
+  lua_newtable(L);
+  luaL_setfuncs(L, l_luabox_worker, 0);
   return 1;
 }
 
-static void populate_event(lua_State *L) {
-  lua_pushnumber(L, event.type);
-  lua_setfield(L, 1, "type");
+// runs in the worker's own state, in protected mode
+static int run_worker(lua_State *L) {
+  struct worker * w = lua_touserdata(L, 1);
+  static const struct luaL_Reg fns[] = {
+    {"send",   l_worker_send},
+    {"recv",   l_worker_recv},
+    {"closed", l_worker_closed},
+    {NULL, NULL}
+  };
+  int i;
+
+  lua_settop(L, 0);
+  luaL_openlibs(L);
 
-  lua_pushnumber(L, event.key);
-  lua_setfield(L, 1, "key");
+  // the worker table, as a global
+  lua_newtable(L);
+  for (i = 0; fns[i].name; i++) {
+    lua_pushlightuserdata(L, w);
+    lua_pushcclosure(L, fns[i].func, 1);
+    lua_setfield(L, -2, fns[i].name);
+  }
+  lua_setglobal(L, "worker");
 
-  lua_pushnumber(L, event.meta);
-  lua_setfield(L, 1, "meta"); // ctrl/alt/shift or motion in mouse events
+  // there might be no luabox.so to find, eg. when it's linked in statically
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  lua_pushcfunction(L, open_worker_lib);
+  lua_setfield(L, -2, "luabox");
+  lua_pop(L, 2);
 
-  if (event.type == TB_EVENT_MOUSE) {
+  // whatever the script returns is sent as a last message
+  lua_pushlightuserdata(L, w);
+  lua_pushcclosure(L, l_worker_send, 1);
+  if (luaL_loadbuffer(L, w->script, w->script_len, "=worker")) return lua_error(L);
+  lua_call(L, decode_message(L, w->args), LUA_MULTRET);
+  if (lua_gettop(L) > 1) lua_call(L, lua_gettop(L) - 1, 0);
 
-    lua_pushnumber(L, event.x);
-    lua_setfield(L, 1, "x");
+  return 0;
+}
 
-    lua_pushnumber(L, event.y);
-    lua_setfield(L, 1, "y");
+static void * worker_main(void *arg) {
+  struct worker * w = arg;
+  lua_State * L = luaL_newstate();
+  const char * err;
+  int state = WORKER_DONE;
 
-    lua_pushnumber(L, event.h);
-    lua_setfield(L, 1, "clicks"); // click count
+  if (!L) {
+    w->error = strdup("out of memory");
+    state = WORKER_FAILED;
+  } else {
+    worker_thread = 1;
+    lua_pushcfunction(L, run_worker);
+    lua_pushlightuserdata(L, w);
+    if (lua_pcall(L, 1, 0, 0)) {
+      err = lua_tostring(L, -1);
+      w->error = strdup(err ? err : "error object is not a string");
+      state = WORKER_FAILED;
+    }
+    lua_close(L);
+  }
 
-  } else if (event.type == TB_EVENT_FOCUS) {
+  __atomic_store_n(&w->state, state, __ATOMIC_RELEASE);
+  wakeup_signal(&w->ui);
+  release_worker(w);
+  return NULL;
+}
 
-    lua_pushnumber(L, event.key);
-    lua_setfield(L, 1, "key");
+// worker(script [, ...]) -> worker
+// runs the script (lua source) on a new thread, in a new lua state with the
+// standard libraries and a `worker` table with send, recv and closed. the
+// extra arguments are passed to the script as `...`. what the script returns
+// is sent as a last message. require('luabox') in the script only gets the
+// parts that don't touch the terminal, see l_luabox_worker.
+static int l_tb_worker(lua_State *L) {
+  size_t len;
+  const char * script = luaL_checklstring(L, 1, &len);
+  struct message * args = encode_message(L, 2);
+  struct worker * w = calloc(1, sizeof(struct worker));
+  int ret;
 
-  } else if (event.type == TB_EVENT_KEY) {
+  struct worker ** handle = lua_newuserdata(L, sizeof(struct worker *));
+  *handle = NULL;
+  luaL_getmetatable(L, WORKER);
+  lua_setmetatable(L, -2);
 
-    char_len = tb_utf8_unicode_to_char(utf8_char, event.ch);
-    utf8_char[char_len] = '\0';
+  if (w) w->ui.fd[0] = w->ui.fd[1] = w->thread.fd[0] = w->thread.fd[1] = -1;
+  if (!w || !(w->script = malloc(len)) ||
+      !ring_init(&w->inbox, WORKER_QUEUE_SIZE) || !ring_init(&w->outbox, WORKER_QUEUE_SIZE)) {
+    if (w) { w->refs = 1; w->args = args; release_worker(w); } else free(args);
+    return luaL_error(L, "out of memory");
+  }
 
-    lua_pushstring(L, utf8_char);
-    lua_setfield(L, 1, "ch");
+  memcpy(w->script, script, len);
+  w->script_len = len;
+  w->args = args;
+  w->refs = 2;
+  *handle = w;
 
-  } else if (event.type == TB_EVENT_RESIZE) {
-    lua_pushnumber(L, event.w);
-    lua_setfield(L, 1, "w");
+  if (!wakeup_open(&w->ui) || !wakeup_open(&w->thread)) {
+    w->refs = 1;
+    return luaL_error(L, "can't start worker: %s", strerror(errno));
+  }
 
-    lua_pushnumber(L, event.h);
-    lua_setfield(L, 1, "h");
+  // pthread_create returns the error instead of setting errno
+  if ((ret = pthread_create(&w->thread_id, NULL, worker_main, w)) != 0) {
+    w->refs = 1;
+    return luaL_error(L, "can't start worker: %s", strerror(ret));
   }
+
+  w->started = 1;
+  return 1;
 }
 
-static int l_tb_peek_event(lua_State *L) {
-  luaL_checktype(L, 1, LUA_TTABLE);
-  int timeout = luaL_checkinteger(L, 2);
+// worker:send(...) -> true, or false if the queue is full or the worker has
+// finished. never waits.
+static int l_worker_handle_send(lua_State *L) {
+  struct worker * w = check_worker(L, 1);
+  struct message * msg;
 
-  int ret = tb_peek_event(&event, timeout);
-  populate_event(L);
+  if (__atomic_load_n(&w->state, __ATOMIC_ACQUIRE) != WORKER_RUNNING || w->closed) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
 
-  lua_pop(L, 2);
-  lua_pushinteger(L, ret);
+  msg = encode_message(L, 2);
+  if (!ring_push(&w->inbox, msg)) {
+    free(msg);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  wakeup_signal(&w->thread);
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-static int l_tb_poll_event(lua_State *L){
-  luaL_checktype(L, 1, LUA_TTABLE);
+// worker:recv() -> true, ... or nothing if there are no messages. never
+// waits, use fd() to know when to call it.
+static int l_worker_handle_recv(lua_State *L) {
+  struct worker * w = check_worker(L, 1);
+  struct message * msg = take_message(&w->outbox, &w->ui, &w->thread);
+  int n;
 
-  int ret = tb_poll_event(&event);
-  populate_event(L);
+  if (!msg) return 0;
 
-  lua_pop(L, 1);
-  lua_pushinteger(L, ret);
+  lua_pushboolean(L, 1);
+  n = decode_message(L, msg);
+  free(msg);
+  return n + 1;
+}
+
+// worker:fd() -> fd that's readable when there are messages, or the worker
+// finished. pass it to wait() or ui.watch.
+static int l_worker_handle_fd(lua_State *L) {
+  lua_pushinteger(L, check_worker(L, 1)->ui.fd[0]);
   return 1;
 }
 
-static int l_tb_utf8_char_length(lua_State *L) {
-  char c = luaL_checkstring(L, 1)[0];
+static int push_worker_status(lua_State *L, struct worker *w) {
+  switch (__atomic_load_n(&w->state, __ATOMIC_ACQUIRE)) {
+    case WORKER_RUNNING: lua_pushliteral(L, "running"); return 1;
+    case WORKER_DONE:    lua_pushliteral(L, "done"); return 1;
+  }
 
-  lua_pop(L, 1);
-  lua_pushinteger(L, tb_utf8_char_length(c));
-  return 1;
+  lua_pushliteral(L, "failed");
+  lua_pushstring(L, w->error);
+  return 2;
 }
 
-static int l_tb_utf8_char_to_unicode(lua_State *L) {
-  const char * str = luaL_checkstring(L, 1);
-  uint32_t ch = normalize_char(str);
-  lua_pop(L, 1);
-  lua_pushinteger(L, ch);
-  return 1;
+// worker:status() -> "running", "done", or "failed" and the error
+static int l_worker_handle_status(lua_State *L) {
+  return push_worker_status(L, check_worker(L, 1));
 }
 
-static int l_tb_utf8_unicode_to_char(lua_State *L) {
-  const char * str = luaL_checkstring(L, 1);
+// worker:close() tells the worker to finish: its recv() returns nil and
+// "closed" and its send() false from then on. messages it sent before are
+// still there to read.
+static int l_worker_handle_close(lua_State *L) {
+  struct worker * w = check_worker(L, 1);
+  __atomic_store_n(&w->closed, 1, __ATOMIC_RELEASE);
+  wakeup_signal(&w->thread);
+  return 0;
+}
 
-  uint32_t ch = normalize_char(str);
-  char *out = NULL;
+// worker:join() -> status, like status(), once the worker's thread has
+// finished. this blocks, so close() it first if it waits for messages.
+static int l_worker_handle_join(lua_State *L) {
+  struct worker * w = check_worker(L, 1);
 
-  lua_pop(L, 1);
-  lua_pushinteger(L, tb_utf8_unicode_to_char(out, ch));
-  return 1;
+  if (w->started && !w->joined) {
+    pthread_join(w->thread_id, NULL);
+    w->joined = 1;
+  }
+
+  return push_worker_status(L, w);
 }
 
-static int l_tb_is_char_wide(lua_State *L) {
-  const char * str = luaL_checkstring(L, 1);
-  uint32_t ch = normalize_char(str);
+static int l_worker_handle_gc(lua_State *L) {
+  struct worker ** handle = check_worker_handle(L, 1);
+  struct worker * w = *handle;
 
-  lua_pop(L, 1);
-  lua_pushinteger(L, tb_unicode_is_char_wide(ch));
-  return 1;
+  if (!w) return 0;
+  *handle = NULL;
+
+  __atomic_store_n(&w->closed, 1, __ATOMIC_RELEASE);
+  if (w->started && !w->joined) {
+    wakeup_signal(&w->thread);
+    pthread_detach(w->thread_id);
+  }
+
+  release_worker(w);
+  return 0;
 }
 
+static const struct luaL_Reg l_worker[] = {
+  {"__gc",   l_worker_handle_gc},
+  {"send",   l_worker_handle_send},
+  {"recv",   l_worker_handle_recv},
+  {"fd",     l_worker_handle_fd},
+  {"status", l_worker_handle_status},
+  {"close",  l_worker_handle_close},
+  {"join",   l_worker_handle_join},
+  {NULL, NULL}
+};
+
 ///////////////////
 // helpers
 
@@ -381,6 +7740,10 @@ static const struct luaL_Reg l_luabox[] = {
   {"init",                   l_tb_init},
   {"init_with",              l_tb_init_with},
   {"shutdown",               l_tb_shutdown},
+  {"init_headless",          l_tb_init_headless},
+  {"headless_resize",        l_tb_headless_resize},
+  {"headless_feed",          l_tb_headless_feed},
+  {"headless_bytes",         l_tb_headless_bytes},
   {"width",                  l_tb_width},
   {"height",                 l_tb_height},
   {"clear_screen",           l_tb_clear_screen},
@@ -388,6 +7751,8 @@ static const struct luaL_Reg l_luabox[] = {
   {"set_clear_attributes",   l_tb_set_clear_attributes},
   {"resize",                 l_tb_resize},
   {"render",                 l_tb_render},
+  {"render_dirty",           l_tb_render_dirty},
+  {"mark_dirty",             l_tb_mark_dirty},
   {"rgb",                    l_tb_rgb},
   {"rgb_from_xterm",         l_tb_rgb_from_xterm},
   {"bold",                   l_tb_bold},
@@ -396,6 +7761,42 @@ static const struct luaL_Reg l_luabox[] = {
   {"char",                   l_tb_char},
   {"string",                 l_tb_string},
   {"stringf",                l_tb_stringf},
+  {"format",                 l_tb_format},
+  {"ansi",                   l_tb_ansi},
+  {"ansi_string",            l_tb_ansi_string},
+  {"list_store",             l_tb_list_store},
+  {"fuzzy",                  l_tb_fuzzy},
+  {"fuzzy_matcher",          l_tb_fuzzy_matcher},
+  {"fuzzy_score",            l_tb_fuzzy_score},
+  {"worker",                 l_tb_worker},
+  {"surface",                l_tb_surface},
+  {"canvas",                 l_tb_canvas},
+  {"blit",                   l_tb_blit},
+  {"copy",                   l_tb_copy},
+  {"scroll",                 l_tb_scroll},
+  {"fill",                   l_tb_fill},
+  {"border",                 l_tb_border},
+  {"shade",                  l_tb_shade},
+  {"snapshot",               l_tb_snapshot},
+  {"screen_view",            l_tb_screen_view},
+  {"runs",                   l_tb_runs},
+  {"set_owner",              l_tb_set_owner},
+  {"hit",                    l_tb_hit},
+  {"clear_owners",           l_tb_clear_owners},
+  {"save_owners",            l_tb_save_owners},
+  {"restore_owners",         l_tb_restore_owners},
+  {"text_width",             l_tb_text_width},
+  {"clip_to_width",          l_tb_clip_to_width},
+  {"col_to_index",           l_tb_col_to_index},
+  {"expand_tabs",            l_tb_expand_tabs},
+  {"graphemes",              l_tb_graphemes},
+  {"grapheme_count",         l_tb_grapheme_count},
+  {"grapheme_sub",           l_tb_grapheme_sub},
+  {"is_emoji",               l_tb_is_emoji},
+  {"nfc",                    l_tb_nfc},
+  {"nfd",                    l_tb_nfd},
+  {"wrap_index",             l_tb_wrap_index},
+  {"text_buffer",            l_tb_text_buffer},
   {"set_cursor",             l_tb_set_cursor},
   {"show_cursor",            l_tb_show_cursor},
   {"hide_cursor",            l_tb_hide_cursor},
@@ -407,15 +7808,54 @@ static const struct luaL_Reg l_luabox[] = {
   {"select_output_mode",     l_tb_select_output_mode},
   {"peek_event",             l_tb_peek_event},
   {"poll_event",             l_tb_poll_event},
+  {"drain_events",           l_tb_drain_events},
+  {"wait",                   l_tb_wait},
+  {"after",                  l_tb_after},
+  {"every",                  l_tb_every},
+  {"cancel",                 l_tb_cancel},
+  {"clear_timers",           l_tb_clear_timers},
+  {"run_timers",             l_tb_run_timers},
+  {"next_timer",             l_tb_next_timer},
+  {"on_frame",               l_tb_on_frame},
+  {"invalidate",             l_tb_invalidate},
   {"utf8_char_length",       l_tb_utf8_char_length},
   {"utf8_char_to_unicode",   l_tb_utf8_char_to_unicode},
   {"utf8_unicode_to_char",   l_tb_utf8_unicode_to_char},
   {"is_char_wide",           l_tb_is_char_wide},
+  {"stats",                  l_tb_stats},
+  {"reset_stats",            l_tb_reset_stats},
+  {"enable_frame_stats",     l_tb_enable_frame_stats},
+  {"disable_frame_stats",    l_tb_disable_frame_stats},
+  {"record_trace",           l_tb_record_trace},
+  {"replay_trace",           l_tb_replay_trace},
+  {"replaying",              l_tb_replaying},
+  {"trace_report",           l_tb_trace_report},
+  {"stop_trace",             l_tb_stop_trace},
   {NULL,NULL}
 };
 
+// creates the metatable for userdata of type name, with methods as __index
+static void register_type(lua_State *L, const char *name, const luaL_Reg *methods) {
+  luaL_newmetatable(L, name);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, methods, 0);
+  lua_pop(L, 1);
+}
+
 int luaopen_luabox(lua_State *L) {
-  luaL_newlib(L, l_luabox);
+  if (worker_thread) return open_worker_lib(L);
+
+  register_type(L, WRAP_INDEX, l_wrap_index);
+  register_type(L, TEXT_BUFFER, l_text_buffer);
+  register_type(L, FORMAT, l_format);
+  register_type(L, ANSI, l_ansi);
+  register_type(L, SURFACE, l_surface);
+  register_type(L, CANVAS, l_canvas);
+  register_type(L, LIST_STORE, l_list_store);
+  register_type(L, FUZZY, l_fuzzy);
+  register_type(L, WORKER, l_worker);
+  new_counted_lib(L, l_luabox);
 
   // init options
   lua_pushnumber(L, TB_INIT_ALL          ); lua_setfield(L, -2, "INIT_ALL");
@@ -431,6 +7871,11 @@ int luaopen_luabox(lua_State *L) {
   lua_pushnumber(L, TB_OUTPUT_TRUECOLOR); lua_setfield(L, -2, "OUTPUT_TRUECOLOR");
   #endif
 
+  // size of each record in the packed strings used by blit/snapshot
+  lua_pushnumber(L, sizeof(struct tb_cell)); lua_setfield(L, -2, "CELL_SIZE");
+  lua_pushstring(L, cell_cdef());            lua_setfield(L, -2, "CELL_CDEF");
+  lua_pushstring(L, VIEW_CDEF);              lua_setfield(L, -2, "VIEW_CDEF");
+
   // errors
   lua_pushnumber(L, TB_EUNSUPPORTED_TERMINAL); lua_setfield(L, -2, "EUNSUPPORTED_TERMINAL");
   lua_pushnumber(L, TB_EFAILED_TO_OPEN_TTY  ); lua_setfield(L, -2, "EFAILED_TO_OPEN_TTY");
@@ -441,6 +7886,7 @@ int luaopen_luabox(lua_State *L) {
   lua_pushnumber(L, TB_EVENT_RESIZE ); lua_setfield(L, -2, "EVENT_RESIZE");
   lua_pushnumber(L, TB_EVENT_MOUSE  ); lua_setfield(L, -2, "EVENT_MOUSE");
   lua_pushnumber(L, TB_EVENT_FOCUS  ); lua_setfield(L, -2, "EVENT_FOCUS");
+  lua_pushnumber(L, EVENT_STRIDE    ); lua_setfield(L, -2, "EVENT_STRIDE");
 
   // text attributes
   lua_pushnumber(L, TB_BOLD         ); lua_setfield(L, -2, "BOLD");
@@ -0,0 +1,63 @@
+-- the ansi parser has to end up with the same lines and colors however its
+-- input is cut into chunks. run with `make test`
+
+local tb = require('luabox')
+local check = require('tests.lib.check')
+
+local W, H = 12, 8
+
+local input = table.concat({
+  'plain \27[1;31mbold red\27[0m\r\n',
+  '\27[38;5;208mxterm\27[48;2;10;20;30m rgb bg\27[m\n',
+  '\27[38:2::1:2:3mcolons\27[39m done\n',
+  'caf\195\169 \237\149\156\234\184\128 \240\159\145\141\n',       -- 2 and 3 byte chars, wide ones, a 4 byte one
+  'tab\there\n',
+  'overwrite\rOVER\n',
+  'erase me\b\b\b\b\b\27[Kd\n',
+  '\27]0;title\7\27]8;;http://x\27\\link\27]8;;\27\\ \27(Bskipped\n',
+  '\27[?25lprivate\27[?25h and a very long line that wraps',
+})
+
+local function parse(chunks)
+  local p = tb.ansi(W, 20)
+  for _, chunk in ipairs(chunks) do p:feed(chunk) end
+  return p
+end
+
+-- the text of every line, and the cells drawn for the last H of them
+local function output(p)
+  local lines = {}
+  for i = 1, p:lines() do lines[i] = p:get(i) end
+
+  tb.clear_buffer()
+  p:draw(0, 0, W, H, nil, tb.DEFAULT, tb.DEFAULT)
+  return table.concat(lines, '\n'), tb.snapshot(0, 0, W, H)
+end
+
+assert(tb.init_headless(W, H) == 0, 'headless init failed')
+tb.select_output_mode(tb.OUTPUT_256)
+
+local whole_text, whole_cells = output(parse({ input }))
+check('lines', parse({ input }):lines(), 13)
+check('erase in line', parse({ input }):get(8), 'erad')
+
+for at = 1, #input - 1 do
+  local text, cells = output(parse({ input:sub(1, at), input:sub(at + 1) }))
+  check('text split at ' .. at, text, whole_text)
+  check('cells split at ' .. at, cells, whole_cells)
+end
+
+local bytes = {}
+for i = 1, #input do bytes[i] = input:sub(i, i) end
+local text, cells = output(parse(bytes))
+check('text byte by byte', text, whole_text)
+check('cells byte by byte', cells, whole_cells)
+
+-- an empty chunk changes nothing, not even mid escape
+text, cells = output(parse({ input:sub(1, 10), '', input:sub(11) }))
+check('text with an empty chunk', text, whole_text)
+check('cells with an empty chunk', cells, whole_cells)
+
+tb.shutdown()
+
+check.done()
@@ -0,0 +1,20 @@
+-- what the scripts under tests/ share. check(what, got, expected) reports a
+-- mismatch and carries on, check.done() exits with a failure if there was any.
+
+local check = { failed = 0 }
+
+setmetatable(check, { __call = function(_, what, got, expected)
+  if got ~= expected then
+    check.failed = check.failed + 1
+    print(string.format('FAIL %s: expected %q, got %q', what, tostring(expected), tostring(got)))
+  end
+end })
+
+function check.done()
+  if check.failed > 0 then
+    print(check.failed .. ' failed')
+    os.exit(1)
+  end
+end
+
+return check
@@ -0,0 +1,52 @@
+-- the text and line index behind long Lists: loading, pushing and getting
+-- items back. run with `make test`
+
+local ffi = require('ffi')
+local tb = require('luabox')
+local check = require('tests.lib.check')
+
+ffi.cdef[[
+int pipe(int fds[2]);
+long write(int fd, const void *buf, size_t count);
+int close(int fd);
+]]
+
+local store = tb.list_store('one\ntwo\r\nthree')
+check('count', store:count(), 3)
+check('get', store:get(2), 'two')
+check('open item', store:get(3), 'three')
+check('out of range', store:get(4), nil)
+
+store:add_lines('four\nfive')
+check('continued item', store:get(3), 'threefour')
+check('count after add_lines', #store, 4)
+
+-- a push after an item left open closes it first. fill the text up to
+-- the end of its first allocation, so the closing newline is the byte
+-- that needs room
+local long = string.rep('x', 4000)
+store = tb.list_store()
+store:add_lines(long)
+check('push after add_lines', store:push(string.rep('y', 95)), 2)
+check('item closed by push', store:get(1), long)
+check('pushed item', store:get(2), string.rep('y', 95))
+check('bytes after push', store:bytes(), 4000 + 1 + 95 + 1)
+
+-- same after load_fd left the last line open
+local fds = ffi.new('int[2]')
+assert(ffi.C.pipe(fds) == 0, 'pipe failed')
+local text = 'a\nb\n' .. long
+ffi.C.write(fds[1], text, #text)
+ffi.C.close(fds[1])
+
+store = tb.list_store()
+local n, eof = store:load_fd(fds[0])
+ffi.C.close(fds[0])
+check('bytes loaded', n, #text)
+check('eof', eof, true)
+check('push after load_fd', store:push('c\nd'), 4)
+check('item closed by push after load_fd', store:get(3), long)
+check('pushed item with a newline', store:get(4), 'c\nd')
+check('count after push', store:count(), 4)
+
+check.done()
@@ -0,0 +1,79 @@
+-- the piece table behind EditableTextBox: edits, undo and redo, searching
+-- and wrapped rows. run with `make test`
+
+local tb = require('luabox')
+local check = require('tests.lib.check')
+
+-- edits
+local buf = tb.text_buffer('hello world')
+check('insert', buf:insert(5, ','), 1)
+check('delete', buf:delete(6, 99), 6)
+check('text after edits', buf:text(), 'hello,')
+check('chars', buf:chars(), 6)
+check('insert multibyte', buf:insert(0, 'été '), 4)
+check('sub', buf:sub(0, 3), 'été')
+check('char_at', buf:char_at(1), 't')
+
+-- undo and redo, by step, with the cursor each one goes back to
+buf = tb.text_buffer('one')
+buf:checkpoint(3)
+buf:insert(3, ' two')
+buf:insert(7, ' three')
+buf:checkpoint(13)
+buf:delete(0, 4)
+
+local cursor, anchor = buf:undo(9)
+check('undo delete', buf:text(), 'one two three')
+check('undo cursor', cursor, 13)
+check('undo anchor', anchor, nil)
+
+cursor = buf:undo(13)
+check('undo step of two inserts', buf:text(), 'one')
+check('undo cursor again', cursor, 3)
+check('nothing left to undo', buf:undo(3), nil)
+
+cursor = buf:redo(3)
+check('redo inserts', buf:text(), 'one two three')
+check('redo cursor', cursor, 13) -- the one it was undone at
+buf:redo(13)
+check('redo delete', buf:text(), 'two three')
+check('history', table.concat({ buf:history() }, ','), '2,0')
+
+buf:undo(9)
+buf:checkpoint(13, 4)
+buf:insert(13, '!')
+check('edit drops redo', select(2, buf:history()), 0)
+cursor, anchor = buf:undo(14)
+check('undo anchor restored', anchor, 4)
+check('text after undo', buf:text(), 'one two three')
+
+-- find, forward from pos or back from it
+buf = tb.text_buffer('ab cd\nef/gh')
+check('find next', buf:find(0, ' '), 2)
+check('find next at pos', buf:find(2, ' '), 2)
+check('find next of set', buf:find(3, ' /\n'), 5)
+check('find none', buf:find(7, ' \n'), nil)
+check('find back', buf:find(8, ' \n', true), 5)
+check('find back skips pos', buf:find(5, '\n', true), nil)
+check('find not in set', buf:find(2, '^ '), 3)
+check('find back not in set', buf:find(3, '^ ', true), 1)
+check('find multibyte', tb.text_buffer('é é'):find(0, ' '), 1)
+check('find rejects non ascii', pcall(buf.find, buf, 0, 'é'), false)
+
+-- wrapped rows, kept up to date as lines come and go
+buf = tb.text_buffer('1234567\nab\n\nxyz', 4)
+check('rows', buf:rows(), 5)
+check('row of pos', table.concat({ buf:pos_to_row(8) }, ','), '2,0')
+check('pos of row', buf:row_col_to_pos(4, 1), 13)
+buf:insert(8, '1\n2\n')
+check('rows after adding lines', buf:rows(), 7)
+check('rows at', table.concat(buf:rows_at(2, 2), ','), '1,8,1,2,10,1')
+buf:checkpoint(0)
+buf:delete(0, 12)
+check('rows after removing lines', buf:rows(), 3)
+buf:undo(0)
+check('rows after undo', buf:rows(), 7)
+buf:set_wrap(2)
+check('rows when rewrapped', buf:rows(), 11)
+
+check.done()
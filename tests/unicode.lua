@@ -0,0 +1,55 @@
+-- grapheme clusters, display widths and normalization. run with `make test`
+
+local tb = require('luabox')
+local check = require('tests.lib.check')
+
+local flag    = '\240\159\135\186\240\159\135\184'         -- U+1F1FA U+1F1F8
+local family  = '\240\159\145\168\226\128\141\240\159\145\169\226\128\141\240\159\145\167' -- man, zwj, woman, zwj, girl
+local thumb   = '\240\159\145\141\240\159\143\187'         -- thumbs up, skin tone
+local heart   = '\226\157\164\239\184\143'                 -- U+2764 U+FE0F
+local e_acute = 'e\204\129'                                -- e, combining acute
+local hangul  = '\225\132\128\225\133\161'                 -- jamo L + V
+
+-- widths
+check('ascii width', tb.text_width('abc'), 3)
+check('combining mark width', tb.text_width(e_acute), 1)
+check('wide char width', tb.text_width('\237\149\156'), 2)
+check('flag width', tb.text_width(flag), 2)
+check('flag and ascii width', tb.text_width(flag .. 'x'), 3)
+check('two flags width', tb.text_width(flag .. flag), 4)
+check('lone regional indicator width', tb.text_width('\240\159\135\186'), 1)
+check('zwj sequence width', tb.text_width(family), 2)
+check('skin tone width', tb.text_width(thumb), 2)
+check('emoji presentation width', tb.text_width(heart), 2)
+check('text presentation width', tb.text_width('\226\157\164'), 1)
+check('jamo width', tb.text_width(hangul), 2)
+
+-- clusters
+check('flag clusters', tb.grapheme_count(flag .. flag), 2)
+check('zwj clusters', tb.grapheme_count(family .. 'x'), 2)
+check('combining clusters', tb.grapheme_count(e_acute .. e_acute), 2)
+check('crlf clusters', tb.grapheme_count('a\r\nb'), 3)
+check('jamo clusters', tb.grapheme_count(hangul), 1)
+
+local str = 'a' .. e_acute .. family .. flag .. 'z'
+check('sub middle', tb.grapheme_sub(str, 2, 3), e_acute .. family)
+check('sub negative', tb.grapheme_sub(str, -2), flag .. 'z')
+check('sub past end', tb.grapheme_sub(str, 5, 99), 'z')
+check('sub empty', tb.grapheme_sub(str, 3, 2), '')
+
+local parts = {}
+for i, j, cols in tb.graphemes('a' .. thumb .. 'b') do
+  parts[#parts + 1] = i .. '-' .. j .. ':' .. cols
+end
+check('graphemes', table.concat(parts, ' '), '1-1:1 2-9:2 10-10:1')
+
+-- normalization
+check('nfc composes', tb.nfc(e_acute), '\195\169')
+check('nfd decomposes', tb.nfd('\195\169'), e_acute)
+check('nfc reorders marks', tb.nfc('a\204\163\204\135'), tb.nfc('a\204\135\204\163'))
+check('nfd hangul syllable', tb.nfd('\237\149\156'), '\225\132\146\225\133\161\225\134\171')
+check('nfc hangul syllable', tb.nfc('\225\132\146\225\133\161\225\134\171'), '\237\149\156')
+check('nfc ascii', tb.nfc('plain'), 'plain')
+check('nfd singleton', tb.nfd('\226\132\171'), 'A\204\138') -- angstrom sign
+
+check.done()
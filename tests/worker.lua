@@ -0,0 +1,61 @@
+-- worker threads, and what require('luabox') gives their scripts. run with
+-- `make test`
+
+local tb = require('luabox')
+local check = require('tests.lib.check')
+
+-- runs script to the end, returning the last message it sent and its status
+local function run(script, ...)
+  local w = tb.worker(script, ...)
+  local got, msg, running = {}
+  repeat
+    tb.wait({ w:fd() }, 100)
+    running = w:status() == 'running' -- before draining, so nothing is missed
+    repeat
+      msg = { w:recv() }
+      if msg[1] then got = msg end
+    until not msg[1]
+  until not running
+  return got, w:join()
+end
+
+assert(tb.init_headless(10, 3) == 0, 'headless init failed')
+
+local got, status = run([[
+  local tb = require('luabox')
+  local store = tb.list_store('apple\nbanana\ncherry\n')
+  local hits = tb.fuzzy_matcher(store):match('an')
+  local parser = tb.ansi()
+  parser:feed('\27[31mred\27[0m\n')
+  return store:count(), #hits, hits[1], parser:get(1), tb.text_width('\237\149\156')
+]])
+check('worker status', status, 'done')
+check('store count', got[2], 3)
+check('fuzzy hits', got[3], 1)
+check('fuzzy hit', got[4], 2)
+check('ansi text', got[5], 'red')
+check('text width', got[6], 2)
+
+-- nothing that touches the terminal or the module's globals
+got = run([[
+  local tb = require('luabox')
+  local found = {}
+  for _, name in ipairs({ 'init', 'peek_event', 'after', 'stats', 'surface', 'format' }) do
+    if tb[name] then found[#found + 1] = name end
+  end
+  if tb.list_store().draw then found[#found + 1] = 'store:draw' end
+  if tb.ansi().draw then found[#found + 1] = 'ansi:draw' end
+  return table.concat(found, ' ')
+]])
+check('ui only functions in worker', got[2], '')
+
+-- and the ui's module still works once the worker is gone
+local ev = {}
+tb.headless_feed('a')
+tb.peek_event(ev, 200)
+check('event after worker', ev.ch, 'a')
+check('stats after worker', type(tb.stats().calls), 'table')
+
+tb.shutdown()
+
+check.done()